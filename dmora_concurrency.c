@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +9,23 @@
 #include <signal.h>
 #include <semaphore.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <math.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
 
 
 //======================================================================================
@@ -15,18 +34,25 @@
 //
 //======================================================================================
 
-pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  QueueEmpty = PTHREAD_COND_INITIALIZER;
-pthread_cond_t  QueueFull = PTHREAD_COND_INITIALIZER;
-
 // This flag is used to signal the currently running task (and all its spawned
 // threads) that it is time top close up shop.
 // This flag is set when SIGTERM is received.
 static volatile sig_atomic_t TerminationRequested = 0;
 
+// When termination was first requested, on the CLOCK_MONOTONIC clock, so that the
+// runners can tell how long shutting down took. Zero until then.
+static _Atomic uint64_t TerminationRequestedNs = 0;
+
 static void sig_handler(int _)
 {
     (void)_;
+    // clock_gettime is async-signal-safe, so the shutdown is timed from the signal
+    // itself rather than from whenever some thread notices the flag.
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+    uint64_t unset = 0;
+    atomic_compare_exchange_strong(&TerminationRequestedNs, &unset,
+                                   (uint64_t)timespec.tv_sec * 1000000000ULL + (uint64_t)timespec.tv_nsec);
     TerminationRequested = 1;
 }
 
@@ -38,556 +64,7569 @@ static void sig_handler(int _)
 //======================================================================================
 const int PROD_CON_MAX_SLEEP_TIME_MS = 50;
 
-// This function based on https://stackoverflow.com/a/1157217
-void random_sleep(long max_sleep_time_ms) {
-    struct timespec timespec;
+#define CACHE_LINE_SIZE 64
+
+// glibc's random() keeps its state behind a lock, which every actor drawing a sleep
+// period would then contend on. Instead, each thread has a generator of its own
+// (xorshift64*), seeded from --seed and a stream that names the thread's role and
+// id. With the same seed, every thread draws the same numbers from run to run.
+enum RandomStream {
+    MainStream,
+    ProducerStream,
+    ConsumerStream,
+    StageStream,
+    PhilosopherStream,
+    AgentStream,
+    BrokerStream,
+    BrewerStream,
+    WorkerStream
+};
 
-    long period = random() % max_sleep_time_ms;
-    timespec.tv_sec = period / 1000;
-    timespec.tv_nsec = (period % 1000) * (long)1E6;
+uint64_t RandomSeed = 0;
+bool RandomSeedGiven = false;
 
-    nanosleep(&timespec, &timespec);
-}
+// Zero until the thread seeds it; xorshift never leaves zero once out of it.
+_Thread_local uint64_t RandomState = 0;
 
+// splitmix64, to spread the seed and stream over the whole state.
+uint64_t mix_seed(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
 
-//======================================================================================
-//
-//  Producer/Consumer.
-//
-//======================================================================================
+void random_seed_thread(enum RandomStream stream, int id) {
+    uint64_t state = mix_seed(RandomSeed ^ mix_seed(((uint64_t)stream << 32) | (uint32_t)id));
+    RandomState = state != 0 ? state : 1;
+}
 
-#define QUEUE_SIZE 100
+uint64_t random_next() {
+    if (RandomState == 0) {
+        random_seed_thread(MainStream, 0);
+    }
 
-int ProducerCount = 0;
-int ConsumerCount = 0;
+    uint64_t x = RandomState;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    RandomState = x;
 
+    return x * 0x2545f4914f6cdd1dULL;
+}
 
-//========================================================
-// Queue
-//========================================================
+// A number from 0 to bound - 1. Takes the high half of a 128-bit product rather than
+// a modulo, which is both faster and less biased.
+uint64_t random_below(uint64_t bound) {
+    return (uint64_t)(((unsigned __int128)random_next() * bound) >> 64);
+}
 
-// The Producers/Consumers  "queue" implemented as a simple array in a ring
-// buffer configuration. This data must live in the heap so that threads
-// can share it.
-//
-int PCQueue[QUEUE_SIZE];
+size_t next_power_of_two(size_t value) {
+    size_t power = 1;
+    while (power < value) {
+        power <<= 1;
+    }
 
-int Q_Head = 0;
-int Q_Tail = 0;
+    return power;
+}
 
-const int QUEUE_END = QUEUE_SIZE - 1;
 
-// To simulate a more non-deterministic behavior for producers and consumers, I will
-// add a random sleep period, then each actor will try to either add a datum to the
-// "queue" or remove one from it.
+//========================================================
+// Arenas
+//========================================================
 
-// The queue is full when one of two conditions is true:
-//  - The head is at position 0 and the tail is at QUEUE_SIZE - 1
-//  - The tail is within one element of the head.
-bool queue_full() {
-    return (Q_Head == 0 && Q_Tail == QUEUE_END) || (Q_Tail == (Q_Head - 1));
-}
+// Each model instance takes its bookkeeping (actors, thread handles, histograms,
+// synchronization) from an arena: a single zeroed allocation, sized up front, that
+// goes away in one free when the instance is torn down. Every piece starts on a
+// cache line of its own, so that the pieces different actors write never share one.
+struct Arena {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+};
 
-// The queue is empty if the head is outside the queue. That is, is negative.
-bool queue_empty() {
-    return Q_Head < 0;
+// What a piece of the given size takes up in an arena. Callers add these up to size
+// the arena.
+size_t arena_bytes(size_t size) {
+    return (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
 }
 
-void queue_push(int value) {
-    if (Q_Head < 0) {
-        Q_Head = 0;
-        Q_Tail = 0;
-    } else if (Q_Head > 0 && Q_Tail == QUEUE_END) {
-        Q_Tail = 0;
-    } else {
-        Q_Tail++;
+bool arena_init(struct Arena* arena, size_t size) {
+    arena->size = size > 0 ? arena_bytes(size) : CACHE_LINE_SIZE;
+    arena->used = 0;
+    arena->base = (unsigned char*)aligned_alloc(CACHE_LINE_SIZE, arena->size);
+    if (arena->base == NULL) {
+        return false;
     }
 
-    PCQueue[Q_Tail]  = value;
+    memset(arena->base, 0, arena->size);
+    return true;
 }
 
-int queue_pop() {
-    int value = PCQueue[Q_Head];
-
-    if (Q_Head == Q_Tail) {
-        Q_Head = -1;
-        Q_Tail = -1;
-    } else if (Q_Head == QUEUE_END) {
-        Q_Head = 0;
-    } else {
-        Q_Head++;
+// Returns a zeroed piece of the arena. Running out means the arena was sized wrong,
+// which is a bug, so it aborts rather than make every caller check.
+void* arena_alloc(struct Arena* arena, size_t size) {
+    size_t bytes = arena_bytes(size);
+    if (bytes > arena->size - arena->used) {
+        fprintf(stderr, "Arena of %zu bytes overrun by a %zu byte piece.\n", arena->size, size);
+        abort();
     }
 
-    return value;
+    void* piece = arena->base + arena->used;
+    arena->used += bytes;
+
+    return piece;
+}
+
+void arena_release(struct Arena* arena) {
+    free(arena->base);
+    memset(arena, 0, sizeof(struct Arena));
 }
 
 
 //========================================================
-// Producer/Consumer tasks
+// Benchmark support
 //========================================================
 
-// This is the "contents" produced and consumed. Just a simple counter.
-int Count = 0;
+// In benchmark mode (--bench) the models drop their artificial sleeps and chatter,
+// run for a fixed time (or a fixed amount of work), and report how fast they went.
+bool BenchMode = false;
+double BenchDurationSecs = 5.0;
 
-void* produce(void* id) {
-    int my_id = *(int*)id;
-    printf("Starting consumer %d\n", my_id);
+// With --instances, the Producer/Consumer and the Dining Philosophers run several
+// independent copies of themselves side by side, as in a multi-tenant load test.
+// Each instance has queues, forks and locks of its own, so they only compete for
+// the CPUs.
+#define MAX_INSTANCES 64
 
-    while (!TerminationRequested) {
-        random_sleep(PROD_CON_MAX_SLEEP_TIME_MS);
+int InstanceCount = 1;
 
-        pthread_mutex_lock(&Mutex);
-        if (queue_full()) {
-            printf("Producer %d, queue full, waiting...\n", my_id);
-            pthread_cond_wait(&QueueFull, &Mutex);
-        }
+const uint64_t NANOS_PER_SEC = 1000000000ULL;
+
+// Above this many actors of a kind, benchmark reports only print the totals.
+#define MAX_REPORTED_ACTORS 64
+
+uint64_t now_ns() {
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+    return (uint64_t)timespec.tv_sec * NANOS_PER_SEC + (uint64_t)timespec.tv_nsec;
+}
 
-        int value = Count++;
-        queue_push(value);
-        pthread_mutex_unlock(&Mutex);
-        pthread_cond_signal(&QueueEmpty);
+// Sleeps until the given CLOCK_MONOTONIC time, waking up every few milliseconds to
+// notice a termination request (SIGINT may well be delivered to another thread).
+void sleep_until(uint64_t deadline_ns) {
+    const uint64_t POLL_NS = 10 * 1000 * 1000;
 
-        printf("Producer %d, value: %d\n", my_id, value);
+    uint64_t now;
+    while (!TerminationRequested && (now = now_ns()) < deadline_ns) {
+        uint64_t period = deadline_ns - now < POLL_NS ? deadline_ns - now : POLL_NS;
+        struct timespec timespec = {(time_t)(period / NANOS_PER_SEC), (long)(period % NANOS_PER_SEC)};
+        nanosleep(&timespec, NULL);
     }
+}
 
-    printf("Producer %d exiting.\n", my_id);
+// Sets the termination flag, noting the time if nobody (SIGINT included) got there
+// first. Waking up whoever sleeps is up to each model.
+void request_termination() {
+    uint64_t unset = 0;
+    atomic_compare_exchange_strong(&TerminationRequestedNs, &unset, now_ns());
+    TerminationRequested = 1;
+}
 
-    return NULL;
+// Printed once every thread of the run is done, benchmark or not, since how long a
+// shutdown takes matters for restarts either way.
+void report_shutdown() {
+    uint64_t requested = atomic_load(&TerminationRequestedNs);
+    if (requested != 0) {
+        printf("Shutdown took %.3f ms from the termination request.\n", (double)(now_ns() - requested) / 1E6);
+    }
 }
 
-void* consume(void* id) {
-    int my_id = *(int*)id;
-    printf("Starting consumer %d\n", my_id);
+// A log-linear histogram of nanosecond latencies, in the spirit of HdrHistogram.
+// Values below 16 get a bucket each; above that, every power of two is split in 16
+// equal sub-buckets, so any reported value is within about 6% of the real one.
+// Recording is a couple of instructions and never allocates, so each thread keeps
+// its own histogram and they are merged when the run is over.
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
 
-    while (!TerminationRequested) {
-        random_sleep(PROD_CON_MAX_SLEEP_TIME_MS);
+int histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
 
-        pthread_mutex_lock(&Mutex);
-        if (queue_empty()) {
-            printf("Consumer %d, queue empty, waiting...\n", my_id);
-            pthread_cond_wait(&QueueEmpty, &Mutex);
-        }
-        int value = queue_pop();
-        pthread_mutex_unlock(&Mutex);
-        pthread_cond_signal(&QueueFull);
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+}
 
-        printf("Consumer %d, value: %d\n", my_id, value);
+// The value in the middle of the bucket's range.
+uint64_t histogram_bucket_value(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)bucket;
     }
 
-    printf("Consumer %d exiting.\n", my_id);
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(bucket - shift * HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + (((uint64_t)1 << shift) >> 1);
+}
 
-    return NULL;
+void histogram_record(struct Histogram* histogram, uint64_t value) {
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->buckets[histogram_bucket(value)]++;
+}
+
+void histogram_merge(struct Histogram* into, const struct Histogram* from) {
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+// Returns the value below which the given fraction (0 to 1) of the samples fall.
+uint64_t histogram_percentile(const struct Histogram* histogram, double fraction) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->count);
+    if (rank >= histogram->count) {
+        return histogram->max;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            uint64_t value = histogram_bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+// For histograms of counts rather than of nanoseconds.
+void print_count_percentiles(const char* label, const struct Histogram* histogram) {
+    printf("  %s: mean %.1f, p50 %llu, p99 %llu, max %llu\n",
+           label,
+           histogram->count > 0 ? (double)histogram->sum / (double)histogram->count : 0.0,
+           (unsigned long long)histogram_percentile(histogram, 0.50),
+           (unsigned long long)histogram_percentile(histogram, 0.99),
+           (unsigned long long)histogram->max);
+}
+
+void print_latency_percentiles(const char* label, const struct Histogram* histogram) {
+    printf("  %s: %llu samples, mean %.0f ns, p50 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n",
+           label,
+           (unsigned long long)histogram->count,
+           histogram->count > 0 ? (double)histogram->sum / (double)histogram->count : 0.0,
+           (unsigned long long)histogram_percentile(histogram, 0.50),
+           (unsigned long long)histogram_percentile(histogram, 0.99),
+           (unsigned long long)histogram_percentile(histogram, 0.999),
+           (unsigned long long)histogram->max);
+}
+
+// What a benchmark run got through, for the harness (see --sweep). Each report adds
+// its totals in, so that a run with several instances counts all of them.
+struct RunResult {
+    long operations;
+    uint64_t elapsed_ns;
+    struct Histogram latency;
+};
+
+struct RunResult LastRun;
+
+void record_run(long operations, uint64_t elapsed_ns, const struct Histogram* latency) {
+    LastRun.operations += operations;
+    LastRun.elapsed_ns = elapsed_ns;
+    histogram_merge(&LastRun.latency, latency);
 }
 
 
 //========================================================
-// Producer/Consumer runner
+// Hardware counters
 //========================================================
 
-void run_prodcon() {
-    printf("Running Producer/Consumer with %d producers and %d consumers.\n", ProducerCount, ConsumerCount);
+// With --counters, every worker thread of a benchmark run (the actors' own threads,
+// or the pool workers and fiber schedulers they run on) counts its own cycles,
+// instructions and last-level cache misses with perf_event_open, user space only, so
+// that the default perf_event_paranoid setting allows it. Context switches happen
+// in the kernel, where such a counter would not see them, so they come from the
+// thread's getrusage (voluntary and involuntary alike) instead. Each
+// thread adds its counts to the totals as it exits, and the report divides them by
+// the items, meals or potions the run got through: whether a hot path is bound by
+// cache misses or by switching shows up per operation. A counter the machine (or a
+// virtual machine) does not offer is reported as unavailable; the others still count.
+bool HardwareCounters = false;
+
+enum HardwareCounter {
+    CyclesCounter,
+    InstructionsCounter,
+    CacheMissesCounter,
+    ContextSwitchesCounter,
+    COUNTER_COUNT
+};
 
-    pthread_t producers[ProducerCount];
-    pthread_t consumers[ConsumerCount];
+char* HardwareCounterNames[] = {
+        "cycles",
+        "instructions",
+        "LLC misses",
+        "context switches"
+};
 
-    // Start consumers first, to avoid choking the queue.
-    for (int i = 0; i < ConsumerCount; i++) {
-        pthread_create(&consumers[i], NULL, consume, (void *) &i);
+struct CounterTotals {
+    atomic_ulong values[COUNTER_COUNT];
+
+    // How many threads got each counter opened, and how many threads counted at all.
+    atomic_int opened[COUNTER_COUNT];
+    atomic_int threads;
+};
+
+struct CounterTotals Counters;
+
+// The descriptors of the calling thread's counters, -1 when not open, and its context
+// switches so far when it started counting.
+struct ThreadCounters {
+    int descriptors[COUNTER_COUNT];
+    long context_switches;
+};
+
+long thread_context_switches() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Reads the thread's counters into the totals when it exits; see counters_open.
+pthread_key_t ThreadCountersKey;
+pthread_once_t ThreadCountersOnce = PTHREAD_ONCE_INIT;
+
+void counters_close(void* data) {
+    struct ThreadCounters* counters = (struct ThreadCounters*)data;
+    atomic_fetch_add_explicit(&Counters.values[ContextSwitchesCounter],
+                              (unsigned long)(thread_context_switches() - counters->context_switches),
+                              memory_order_relaxed);
+    for (int i = 0; i < ContextSwitchesCounter; i++) {
+        if (counters->descriptors[i] < 0) {
+            continue;
+        }
+
+        // Scaled by the share of the time the counter was actually on the PMU, in case
+        // there were more counters than it has room for.
+        uint64_t reading[3];
+        if (read(counters->descriptors[i], reading, sizeof(reading)) == (ssize_t)sizeof(reading)) {
+            double value = reading[2] > 0 ? (double)reading[0] * (double)reading[1] / (double)reading[2] : 0.0;
+            atomic_fetch_add_explicit(&Counters.values[i], (unsigned long)value, memory_order_relaxed);
+        }
+        close(counters->descriptors[i]);
     }
+    free(counters);
+}
 
-    // Then the producers.
-    for (int i = 0; i < ProducerCount; i++) {
-        pthread_create(&producers[i], NULL, produce, (void *) &i);
+void counters_create_key() {
+    pthread_key_create(&ThreadCountersKey, counters_close);
+}
+
+// Called by each worker thread as it starts. Does nothing without --counters.
+void counters_open() {
+    if (!HardwareCounters) {
+        return;
     }
 
-    // At this point, this function has nothing else to do. So the logical
-    // next step is to make it wait for the threads to finish their work.
-    // The join call below will block the main thread, which is exactly what
-    // I want.
+    static const uint64_t EVENTS[ContextSwitchesCounter] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    pthread_once(&ThreadCountersOnce, counters_create_key);
+    struct ThreadCounters* counters = (struct ThreadCounters*)malloc(sizeof(struct ThreadCounters));
+    counters->context_switches = thread_context_switches();
+    atomic_fetch_add_explicit(&Counters.opened[ContextSwitchesCounter], 1, memory_order_relaxed);
+    counters->descriptors[ContextSwitchesCounter] = -1;
+    for (int i = 0; i < ContextSwitchesCounter; i++) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = EVENTS[i];
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // This thread, on whichever CPU it runs.
+        counters->descriptors[i] = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+        if (counters->descriptors[i] >= 0) {
+            atomic_fetch_add_explicit(&Counters.opened[i], 1, memory_order_relaxed);
+        }
+    }
 
-    // Normally, this would be the right order:
-    //    Stop the producers, so the consumers have a chance to dry up the
-    //    queue. Then stop the consumers.
-    // In this case, I am keeping it simple and just stopping everything
-    // at the same time. Nonetheless, I preserve the order for the sake of example.
-    for (int i = 0; i < ProducerCount; i++) {
-        pthread_join(producers[i], NULL);
+    atomic_fetch_add_explicit(&Counters.threads, 1, memory_order_relaxed);
+    pthread_setspecific(ThreadCountersKey, counters);
+}
+
+// Once every worker thread has been joined: the totals per operation (per item, meal
+// or potion, as the unit says) of the run recorded so far.
+void report_counters(const char* unit) {
+    int threads = atomic_load(&Counters.threads);
+    if (!HardwareCounters || threads == 0) {
+        return;
     }
-    for (int i = 0; i < ConsumerCount; i++) {
-        pthread_join(consumers[i], NULL);
+
+    long operations = LastRun.operations;
+    printf("  Counters over %d threads, per %s:", threads, unit);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (atomic_load(&Counters.opened[i]) < threads) {
+            printf("%s %s unavailable", i > 0 ? "," : "", HardwareCounterNames[i]);
+        } else {
+            printf("%s %.2f %s", i > 0 ? "," : "",
+                   operations > 0 ? (double)atomic_load(&Counters.values[i]) / (double)operations : 0.0,
+                   HardwareCounterNames[i]);
+        }
+    }
+
+    unsigned long cycles = atomic_load(&Counters.values[CyclesCounter]);
+    if (atomic_load(&Counters.opened[CyclesCounter]) == threads &&
+        atomic_load(&Counters.opened[InstructionsCounter]) == threads && cycles > 0) {
+        printf(" (%.2f instructions per cycle)",
+               (double)atomic_load(&Counters.values[InstructionsCounter]) / (double)cycles);
     }
+    printf("\n");
 }
 
 
-//======================================================================================
-//
-//  Dining Philosophers.
-//
-//======================================================================================
+//========================================================
+// Lock profiling
+//========================================================
 
-// This solution implements the four righties and one leftie strategy discussed in
-// The Little Book of Semaphores.
+// With LOCK_PROFILING on (off by default, see the CMake option of the same name),
+// every mutex lock and unlock, condvar wait and semaphore operation of the models
+// goes through a wrapper that records, for its call site, how many times it ran,
+// how many of those had to wait, for how long, and (for mutexes) how long the lock
+// was then held. A ranked report is printed at exit. Each call site gets a static
+// record of its own, which registers itself on first use, so there is no table to
+// size or look up. With it off, the wrappers are plain macros for the calls they
+// wrap and cost nothing.
+#ifndef LOCK_PROFILING
+#define LOCK_PROFILING 0
+#endif
+
+#if LOCK_PROFILING
+
+struct LockSite {
+    const char* kind;
+    const char* primitive;
+    const char* function;
+    int line;
+
+    atomic_bool registered;
+    struct LockSite* next;
+
+    atomic_ulong operations;
+    atomic_ulong contended;
+    atomic_ulong wait_ns;
+    atomic_ulong max_wait_ns;
+    atomic_ulong hold_ns;
+};
 
-#define FORK_COUNT 5
-#define PHILOSOPHER_COUNT 5
+_Atomic(struct LockSite*) LockSites = NULL;
 
-// The forks will be the resources that the diners share/compete for. Since each
-// philosopher is a different thread, the forks need to be in the heap.
-// By the problem definition, we have five forks.
-// I use semaphores since that seems to be the convention, though in this case,
-// its maximum value is 1, so I could, just the same, have used mutexes.
-sem_t Forks[FORK_COUNT];
+#define LOCK_SITE(site_kind, site_primitive) \
+    ({ \
+        static struct LockSite site_ = { \
+                .kind = site_kind, .primitive = #site_primitive, .function = __func__, .line = __LINE__}; \
+        &site_; \
+    })
 
-const long MINIMUM_THINKING_SECS = 1;
-const long MAXIMUM_THINKING_SECS = 20 - MINIMUM_THINKING_SECS;
-const long MINIMUM_EATING_SECS = 2;
-const long MAXIMUM_EATING_SECS = 9 - MINIMUM_EATING_SECS;
+void register_lock_site(struct LockSite* site) {
+    if (atomic_load_explicit(&site->registered, memory_order_relaxed) ||
+        atomic_exchange(&site->registered, true)) {
+        return;
+    }
 
-void think(int id) {
-    printf("Philosopher %d, thinking...\n", id);
-    sleep(MINIMUM_THINKING_SECS);
-    random_sleep(MAXIMUM_THINKING_SECS * 1000);
+    struct LockSite* head = atomic_load(&LockSites);
+    do {
+        site->next = head;
+    } while (!atomic_compare_exchange_weak(&LockSites, &head, site));
 }
 
-void eat(int id) {
-    printf("Philosopher %d, eating\n", id);
-    sleep(MINIMUM_EATING_SECS);
-    random_sleep(MAXIMUM_EATING_SECS);
-}
+void record_lock_operation(struct LockSite* site, bool contended, uint64_t wait_ns) {
+    register_lock_site(site);
+    atomic_fetch_add_explicit(&site->operations, 1, memory_order_relaxed);
+    if (!contended) {
+        return;
+    }
 
-void get_forks(int id, int left_fork, int right_fork) {
-    printf("Philosopher %d, getting fork %d\n", id, right_fork);
-    sem_wait(&Forks[right_fork]);
-    printf("Philosopher %d, getting fork %d\n", id, left_fork);
-    sem_wait(&Forks[left_fork]);
+    atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->wait_ns, wait_ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&site->max_wait_ns, memory_order_relaxed);
+    while (wait_ns > max &&
+           !atomic_compare_exchange_weak_explicit(&site->max_wait_ns, &max, wait_ns,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+        // Somebody else raised it in between; try again against the new value.
+    }
 }
 
-void put_down_forks(int id, int left_fork, int right_fork) {
-    printf("Philosopher %d, yielding fork %d\n", id, right_fork);
-    sem_post(&Forks[right_fork]);
-    printf("Philosopher %d, yielding fork %d\n", id, left_fork);
-    sem_post(&Forks[left_fork]);
-}
+// The mutexes the calling thread holds, so that unlocking one can charge the hold
+// time to the site that locked it. Nobody holds more than a couple at a time; any
+// beyond MAX_HELD_LOCKS are simply not timed.
+#define MAX_HELD_LOCKS 8
 
-void* think_then_eat(void* id) {
-    int my_id = *(int*)id;
-    printf("Philosopher %d sitting at table.\n", my_id);
+struct HeldLock {
+    pthread_mutex_t* mutex;
+    struct LockSite* site;
+    uint64_t acquired_ns;
+};
 
-    // Figure out which forks we can get.
-    int left_fork = my_id;
-    int right_fork = (my_id + 1) % FORK_COUNT;
+_Thread_local struct HeldLock HeldLocks[MAX_HELD_LOCKS];
+_Thread_local int HeldLockCount = 0;
 
-    // Philosopher 0 is a leftie, so his/her/their forks
-    // need to be swapped.
-    if (my_id == 0) {
-        left_fork = right_fork;
-        right_fork = my_id;
+struct HeldLock* find_held_lock(pthread_mutex_t* mutex) {
+    for (int i = HeldLockCount - 1; i >= 0; i--) {
+        if (HeldLocks[i].mutex == mutex) {
+            return &HeldLocks[i];
+        }
     }
 
-    while (!TerminationRequested) {
-        think(my_id);
-        get_forks(my_id, left_fork, right_fork);
-        eat(my_id);
-        put_down_forks(my_id, left_fork, right_fork);
-    }
+    return NULL;
+}
 
-     printf("Philosopher %d leaving the table.\n", my_id);
-     return NULL;
+void charge_hold_time(struct HeldLock* held, uint64_t now) {
+    atomic_fetch_add_explicit(&held->site->hold_ns, now - held->acquired_ns, memory_order_relaxed);
 }
 
-void run_diners() {
-    printf("Running Dining Philosophers.\n");
+// Returns what pthread_mutex_lock would, so that callers of a robust mutex still
+// get EOWNERDEAD (with the mutex taken) from either the trylock or the lock.
+int profiled_mutex_lock(struct LockSite* site, pthread_mutex_t* mutex) {
+    bool contended = false;
+    uint64_t wait_ns = 0;
+    int result = pthread_mutex_trylock(mutex);
+    if (result == EBUSY) {
+        contended = true;
+        uint64_t start = now_ns();
+        result = pthread_mutex_lock(mutex);
+        wait_ns = now_ns() - start;
+    }
+    record_lock_operation(site, contended, wait_ns);
+
+    if (HeldLockCount < MAX_HELD_LOCKS) {
+        HeldLocks[HeldLockCount++] = (struct HeldLock){mutex, site, now_ns()};
+    }
+
+    return result;
+}
 
-    // Prepare the forks, i.e. the semaphores.
-    for (int i = 0; i < FORK_COUNT; i++) {
-        sem_init(&Forks[i], 0, 1);
+int profiled_mutex_unlock(pthread_mutex_t* mutex) {
+    struct HeldLock* held = find_held_lock(mutex);
+    if (held != NULL) {
+        charge_hold_time(held, now_ns());
+        *held = HeldLocks[--HeldLockCount];
     }
 
-    int id[] = {0, 1, 2, 3, 4, 5};
-    pthread_t philosophers[PHILOSOPHER_COUNT];
-    for (int i = 0; i < PHILOSOPHER_COUNT; i++) {
-        pthread_create(&philosophers[i], NULL, think_then_eat, (void *) &id[i]);
+    return pthread_mutex_unlock(mutex);
+}
+
+// A condvar wait always counts as contended. The mutex is not held while waiting,
+// so the wait is not charged to its hold time.
+int profiled_cond_wait(struct LockSite* site, pthread_cond_t* condition, pthread_mutex_t* mutex) {
+    uint64_t start = now_ns();
+    struct HeldLock* held = find_held_lock(mutex);
+    if (held != NULL) {
+        charge_hold_time(held, start);
     }
 
-    // Wait for philosophers to be done.
-    for (int i = 0; i < PHILOSOPHER_COUNT; i++) {
-        pthread_join(philosophers[i], NULL);
+    int result = pthread_cond_wait(condition, mutex);
+
+    uint64_t end = now_ns();
+    record_lock_operation(site, true, end - start);
+    if (held != NULL) {
+        held->acquired_ns = end;
     }
+
+    return result;
 }
 
+#define lock_mutex(mutex) profiled_mutex_lock(LOCK_SITE("mutex", mutex), (mutex))
+#define unlock_mutex(mutex) profiled_mutex_unlock(mutex)
+#define wait_condition(condition, mutex) \
+    profiled_cond_wait(LOCK_SITE("condvar", condition), (condition), (mutex))
+
+#else
+
+#define lock_mutex(mutex) pthread_mutex_lock(mutex)
+#define unlock_mutex(mutex) pthread_mutex_unlock(mutex)
+#define wait_condition(condition, mutex) pthread_cond_wait((condition), (mutex))
+
+#endif
+
 
 //======================================================================================
 //
-//  Potion Brewers.
+//  Event log.
 //
 //======================================================================================
 
-// This solution implements the pushers strategy for the Cigarette Smoker's Problem
-// as presented in the Little Book of Semaphores. I prefer to call them brokers. Other
-// elements of the problem have been named according to the nomenclature used in the
-// class materials.
-
-#define BREWER_COUNT 3
+// Calling printf for every push, pop or fork action makes the whole program run at
+// the speed of the terminal, since every call takes the stdio lock. Instead, each
+// thread appends small binary events to a ring of its own, and a logger thread
+// drains all the rings every few milliseconds, formats the events and prints them
+// in timestamp order. The rings are single-producer/single-consumer, so the hot
+// path never takes a lock. If a ring fills up faster than the logger can drain it,
+// new events are dropped (and counted) rather than blocking the actor.
+//
+// The -v option picks how much gets logged:
+//   - none:    nothing (the default in benchmark mode)
+//   - sampled: one event in every EVENT_SAMPLE_INTERVAL, per thread
+//   - full:    everything (the default otherwise)
+enum Verbosity {
+    QuietLog,
+    SampledLog,
+    FullLog,
+    InvalidLog
+};
 
-char* INGREDIENT_NAMES[] = { "Bezoars", "Unicorn Horns", "Mistletoe Berries"};
+// -1 until set on the command line; then resolved based on the mode.
+int LogVerbosity = -1;
 
-struct Ingredient {
-    char* name;
-    sem_t* flag;
-    bool* is_available;
+char* VerbosityNames[] = {
+        "none",
+        "sampled",
+        "full",
+        "invalid"
 };
 
-struct BrewerInfo {
-    int id;
+enum Verbosity parse_verbosity(const char* name) {
+    for (int i = 0; i < InvalidLog; i++) {
+        if (strcmp(name, VerbosityNames[i]) == 0 || (name[0] == '0' + i && name[1] == '\0')) {
+            return (enum Verbosity)i;
+        }
+    }
 
-    struct Ingredient* ingredient;
-    sem_t* agent;
-};
+    return InvalidLog;
+}
 
-struct AgentInfo {
-    int id;
-    struct Ingredient* ingredient1;
-    struct Ingredient* ingredient2;
-    sem_t* agent;
+// Every event is printed with its actor's id and a value, with the format below.
+enum EventCode {
+    ProducedEvent,
+    ConsumedEvent,
+    ForwardedEvent,
+    QueueFullEvent,
+    QueueEmptyEvent,
+    ThinkingEvent,
+    EatingEvent,
+    GettingForkEvent,
+    YieldingForkEvent,
+    ReleasingIngredientsEvent,
+    BrokeringEvent,
+    MatchingEvent,
+    BrewingEvent,
+    UsingPotionEvent
 };
 
-struct BrokerInfo {
-    int id;
-
-    struct Ingredient* broker_ingredient;
-    struct Ingredient* ingredient1;
-    struct Ingredient* ingredient2;
+const char* EventFormats[] = {
+        "Producer %d, value: %ld\n",
+        "Consumer %d, value: %ld\n",
+        "Stage worker %d, forwarded value: %ld\n",
+        "Producer %d, queue full, waiting...\n",
+        "Consumer %d, queue empty, waiting...\n",
+        "Philosopher %d, thinking...\n",
+        "Philosopher %d, eating\n",
+        "Philosopher %d, getting fork %ld\n",
+        "Philosopher %d, yielding fork %ld\n",
+        "Agent %d releasing ingredients.\n",
+        "Broker %d waking up brewer %ld.\n",
+        "Agent %d completing the set for brewer %ld.\n",
+        "Brewer %d brewing potion.\n",
+        "Brewer %d using potion.\n"
+};
 
-    pthread_mutex_t* mutex;
+struct Event {
+    uint64_t timestamp_ns;
+    int actor_id;
+    int code;
+    long value;
 };
 
-//sem_t Agent;
-//sem_t Bezoars;
-//sem_t Horns;
-//sem_t Berries;
-//
-//sem_t BezoarsBrewer;
-//sem_t HornsBrewer;
-//sem_t BerriesBrewer;
-//
-//bool HornsAvailable = false;
-//bool BezoarsAvailable = false;
-//bool BerriesAvailable = false;
+#define EVENT_LOG_CAPACITY 4096
+#define EVENT_SAMPLE_INTERVAL 64
 
+const uint64_t EVENT_FLUSH_INTERVAL_NS = 20 * 1000 * 1000;
 
-// This code is based directly on the pusher solution
-// shown in the Little Book of Semaphores.
+struct EventLog {
+    // Written by the owning thread.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    int actor_id;
+    unsigned long sequence;
+    atomic_ulong dropped;
 
-//void* bezoars_broker(void *) {
-//    sem_wait(&Bezoars);
-//
-//    pthread_mutex_lock(&Mutex);
-//
-//    if (HornsAvailable) {
-//        HornsAvailable = false;
-//        sem_post(&Horns);
-//    } else if (BerriesAvailable) {
-//        BerriesAvailable = false;
-//        sem_post(&Berries);
-//    } else {
-//        BezoarsAvailable = true;
-//    }
-//
-//    pthread_mutex_unlock(&Mutex);
-//}
-//
-//void* horns_broker(void *) {
-//    sem_wait(&Horns);
-//
-//    pthread_mutex_lock(&Mutex);
-//
-//    if (BezoarsAvailable) {
-//        BezoarsAvailable = false;
-//        sem_post(&Bezoars);
-//    } else if (BerriesAvailable) {
-//        BerriesAvailable = false;
-//        sem_post(&Berries);
-//    } else {
-//        HornsAvailable = true;
-//    }
-//
-//    pthread_mutex_unlock(&Mutex);
-//}
-//
-//void* berries_broker(void *) {
-//    sem_wait(&Berries);
-//
-//    pthread_mutex_lock(&Mutex);
-//
-//    if (HornsAvailable) {
-//        HornsAvailable = false;
-//        sem_post(&Horns);
-//    } else if (BezoarsAvailable) {
-//        BezoarsAvailable = false;
-//        sem_post(&Berries);
-//    } else {
-//        BerriesAvailable = true;
-//    }
-//
-//    pthread_mutex_unlock(&Mutex);
-//}
+    // Written by the logger thread.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
 
-void* broker_ingredients(void* broker_info) {
-    struct BrokerInfo* broker = (struct BrokerInfo*)broker_info;
+    struct Event events[EVENT_LOG_CAPACITY];
+};
 
-    printf("Broker %d starting.", broker->id);
+// The ring of the calling thread, if it has opened one.
+_Thread_local struct EventLog* ThreadLog = NULL;
 
-    sem_wait(broker->broker_ingredient->flag);
+// Every ring ever opened, so that the logger can find them. Rings stay registered
+// after their threads exit, until the logger is stopped.
+pthread_mutex_t EventLogsLock = PTHREAD_MUTEX_INITIALIZER;
+struct EventLog** EventLogs = NULL;
+int EventLogCount = 0;
+int EventLogSlots = 0;
 
-    pthread_mutex_lock(broker->mutex);
+pthread_t Logger;
+atomic_bool LoggerRunning = false;
 
-    if (broker->ingredient1->is_available) {
-        broker->ingredient1->is_available = false;
-        sem_post(broker->ingredient1->flag);
-    } else if (broker->ingredient2->is_available) {
-        broker->ingredient2->is_available = false;
-        sem_post(broker->ingredient2->flag);
-    } else {
-        broker->broker_ingredient->is_available = (bool *) true;
+// Gives the calling thread its own ring. Events are labelled with actor_id.
+void event_log_open(int actor_id) {
+    if (LogVerbosity == QuietLog) {
+        return;
+    }
+
+    struct EventLog* log = (struct EventLog*)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct EventLog));
+    if (log == NULL) {
+        return;
     }
+    atomic_init(&log->tail, 0);
+    atomic_init(&log->head, 0);
+    atomic_init(&log->dropped, 0);
+    log->actor_id = actor_id;
+    log->sequence = 0;
+
+    lock_mutex(&EventLogsLock);
+    if (EventLogCount == EventLogSlots) {
+        int slots = EventLogSlots == 0 ? 64 : EventLogSlots * 2;
+        struct EventLog** logs = (struct EventLog**)realloc(EventLogs, sizeof(struct EventLog*) * slots);
+        if (logs == NULL) {
+            unlock_mutex(&EventLogsLock);
+            free(log);
+            return;
+        }
+        EventLogs = logs;
+        EventLogSlots = slots;
+    }
+    EventLogs[EventLogCount++] = log;
+    unlock_mutex(&EventLogsLock);
 
-    pthread_mutex_unlock(broker->mutex);
+    ThreadLog = log;
 }
 
-void* release_ingredients(void* agent_info) {
-    struct AgentInfo* agent = (struct AgentInfo*)agent_info;
+// Labels the calling thread's events from now on with actor_id. Executor workers
+// run many actors, so they relabel their ring before each step.
+void event_log_relabel(int actor_id) {
+    if (ThreadLog != NULL) {
+        ThreadLog->actor_id = actor_id;
+    }
+}
 
-    printf("Agent %d opening shop.", agent->id);
+void log_event(enum EventCode code, long value) {
+    struct EventLog* log = ThreadLog;
+    if (log == NULL) {
+        return;
+    }
 
-    while (!TerminationRequested) {
-        sem_wait(agent->agent);
+    if (LogVerbosity == SampledLog && log->sequence++ % EVENT_SAMPLE_INTERVAL != 0) {
+        return;
+    }
 
-        printf("Agent %d releasing ingredients.", agent->id);
-        sem_post(agent->ingredient1->flag);
-        sem_post(agent->ingredient2->flag);
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&log->head, memory_order_acquire) == EVENT_LOG_CAPACITY) {
+        atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+        return;
     }
 
-    printf("Agent %d opening shop.", agent->id);
+    struct Event* event = &log->events[tail % EVENT_LOG_CAPACITY];
+    event->timestamp_ns = now_ns();
+    event->actor_id = log->actor_id;
+    event->code = code;
+    event->value = value;
+    atomic_store_explicit(&log->tail, tail + 1, memory_order_release);
 }
 
-void* brew(void* brewer_info) {
-    struct BrewerInfo* brewer = (struct BrewerInfo*)brewer_info;
+int compare_events(const void* a, const void* b) {
+    const struct Event* first = (const struct Event*)a;
+    const struct Event* second = (const struct Event*)b;
 
-    printf("BrewerInfo %d opening shop.", brewer->id);
+    return (first->timestamp_ns > second->timestamp_ns) - (first->timestamp_ns < second->timestamp_ns);
+}
 
-    while (!TerminationRequested) {
-        sem_wait(brewer->ingredient->flag);
-        printf("BrewerInfo %d brewing potion.", brewer->id);
-        sem_post(brewer->agent);
-        printf("BrewerInfo %d using potion.", brewer->id);
+// Moves everything currently in the rings to stdout, oldest first. Besides the
+// logger thread, the runners call it before printing their reports, so that the
+// events do not end up in the middle of them. The registry lock keeps the two apart
+// (and protects the static batch buffer).
+void event_log_drain() {
+    static struct Event* batch = NULL;
+    static size_t batch_slots = 0;
+    size_t batch_count = 0;
+
+    lock_mutex(&EventLogsLock);
+    if (batch_slots < (size_t)EventLogCount * EVENT_LOG_CAPACITY) {
+        free(batch);
+        batch_slots = (size_t)EventLogSlots * EVENT_LOG_CAPACITY;
+        batch = (struct Event*)malloc(sizeof(struct Event) * batch_slots);
+        if (batch == NULL) {
+            batch_slots = 0;
+            unlock_mutex(&EventLogsLock);
+            return;
+        }
     }
 
-    printf("BrewerInfo %d closing shop.", brewer->id);
-}
-
-void initialize_ingredients(struct Ingredient* ingredients) {
-    for (int i = 0; i < 3; i++) {
-        ingredients[i].flag = (sem_t *) malloc(sizeof(sem_t));
-        sem_init(ingredients[i].flag, 0, 0);
+    for (int i = 0; i < EventLogCount; i++) {
+        struct EventLog* log = EventLogs[i];
+        size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
 
-        ingredients[i].is_available = (bool *) malloc(sizeof(bool));
-        *(ingredients[i].is_available) = false;
+        for (; head != tail; head++) {
+            batch[batch_count++] = log->events[head % EVENT_LOG_CAPACITY];
+        }
+        atomic_store_explicit(&log->head, head, memory_order_release);
+    }
 
-        ingredients[i].name = (char*)malloc(sizeof(char) * strlen(INGREDIENT_NAMES[i]));
-        strcpy(ingredients[i].name, INGREDIENT_NAMES[i]);
+    qsort(batch, batch_count, sizeof(struct Event), compare_events);
+    for (size_t i = 0; i < batch_count; i++) {
+        printf(EventFormats[batch[i].code], batch[i].actor_id, batch[i].value);
     }
+    fflush(stdout);
+    unlock_mutex(&EventLogsLock);
 }
 
-void run_brewers() {
-    printf("Running Potion Brewers.\n");
-
-    sem_t agent;
-    sem_init(&agent, 0, 0);
+void* run_logger(void* _) {
+    (void)_;
 
-    struct Ingredient* ingredients = (struct Ingredient*)malloc(sizeof(struct Ingredient) * 3);
-    initialize_ingredients(ingredients);
+    while (atomic_load(&LoggerRunning)) {
+        event_log_drain();
 
-    struct AgentInfo agent_info[3];
-    struct BrewerInfo brewer_info[3];
-    struct BrokerInfo broker_info[3];
+        struct timespec timespec = {0, (long)EVENT_FLUSH_INTERVAL_NS};
+        nanosleep(&timespec, NULL);
+    }
 
-    pthread_t brewers[3];
-    pthread_t agents[3];
-    pthread_t brokers[3];
+    return NULL;
+}
 
-    for (int i = 0; i < 3; i++) {
-        brewer_info[i].id = i;
-        brewer_info[i].ingredient = &ingredients[i];
-        brewer_info[i].agent = &agent;
+void event_log_start() {
+    if (LogVerbosity == QuietLog) {
+        return;
+    }
 
-        agent_info[i].id = i;
-        agent_info[i].agent = &agent;
+    atomic_store(&LoggerRunning, true);
+    pthread_create(&Logger, NULL, run_logger, NULL);
+}
 
-        int broker_ingredient = i;
-        int ingredient1 = (i + 1) % 3;
-        int ingredient2 = (i + 2) % 3;
+// Stops the logger, prints whatever is left in the rings and releases them. All
+// actors must be done by now.
+void event_log_stop() {
+    if (!atomic_load(&LoggerRunning)) {
+        return;
+    }
 
-        broker_info[i].mutex = &Mutex;
-        broker_info[i].id = i;
-        broker_info[i].broker_ingredient = &ingredients[broker_ingredient];
-//        broker_info[i].ingredient_1_available = &ingredients_available[ingredient1];
-//        broker_info[i].ingredient_2_available = &ingredients_available[ingredient2];
-//        broker_info[i].flag_ingredient = &ingredient_flags[broker_ingredient];
-        broker_info[i].ingredient1 = &ingredients[ingredient1];
-        broker_info[i].ingredient1 = &ingredients[ingredient2];
+    atomic_store(&LoggerRunning, false);
+    pthread_join(Logger, NULL);
+    event_log_drain();
 
-        pthread_create(&agents[i], NULL, release_ingredients, (void *) &agent_info[i]);
-        pthread_create(&brokers[i], NULL, broker_ingredients, (void *) &broker_info[i]);
-        pthread_create(&brewers[i], NULL, brew, (void *) &brewer_info[i]);
+    unsigned long dropped = 0;
+    for (int i = 0; i < EventLogCount; i++) {
+        dropped += atomic_load(&EventLogs[i]->dropped);
+        free(EventLogs[i]);
     }
+    free(EventLogs);
+    EventLogs = NULL;
+    EventLogCount = 0;
+    EventLogSlots = 0;
 
-    // Wait for everyone to be done.
-    for (int i = 0; i < 3; i++) {
-        pthread_join(brewers[i], NULL);
-        sem_destroy(ingredients[i].flag);
+    if (dropped > 0) {
+        printf("The event log dropped %lu events it could not keep up with.\n", dropped);
     }
-
-    sem_destroy(&agent);
 }
 
 
 //======================================================================================
 //
-//  MAIN: command line parser, usage help, top level routine.
+//  Thread placement.
 //
 //======================================================================================
 
-//========================================================
-// Concurrency Problem Management
-//========================================================
-
-// Represents the concurrency problem to tackle:
-//   - Producers/Consumers
-//   - Dining Philosophers
-//   - Potion Brewers
-enum Model {
-    ProdCon,
-    Diners,
-    Brewers,
-    None
+// By default threads go wherever the scheduler puts them, and it moves them around
+// freely. With --affinity, every actor thread is pinned to one CPU as it is
+// created, so that threads that talk to each other can share caches:
+//   - compact: fill one socket at a time, hyperthread siblings first, then
+//              neighbouring cores.
+//   - scatter: spread threads over sockets first, then over cores, and only then
+//              over hyperthread siblings.
+//   - a CPU list such as "0,2,4-7": use exactly those CPUs, in that order.
+// Threads are numbered into placement slots by their runners, and slot k gets the
+// k-th CPU of the order above (wrapping around when there are more threads).
+enum AffinityMode {
+    NoAffinity,
+    CompactAffinity,
+    ScatterAffinity,
+    ListAffinity
+};
+
+enum AffinityMode Affinity = NoAffinity;
+
+char* AffinityNames[] = {
+        "none",
+        "compact",
+        "scatter",
+        "list"
+};
+
+// The CPUs, in placement order.
+int* AffinityCpus = NULL;
+int AffinityCpuCount = 0;
+
+struct CpuInfo {
+    int cpu;
+    int package;
+    int core;
+    int core_rank;
+    int sibling;
+};
+
+// Parses a list like "0,2,4-7" into AffinityCpus. Returns false if it is malformed.
+bool parse_cpu_list(const char* list) {
+    free(AffinityCpus);
+    AffinityCpus = NULL;
+    AffinityCpuCount = 0;
+
+    int slots = 0;
+    const char* cursor = list;
+    while (*cursor != '\0') {
+        char* end;
+        long first = strtol(cursor, &end, 10);
+        if (end == cursor || first < 0 || first >= CPU_SETSIZE) {
+            return false;
+        }
+
+        long last = first;
+        cursor = end;
+        if (*cursor == '-') {
+            last = strtol(cursor + 1, &end, 10);
+            if (end == cursor + 1 || last < first || last >= CPU_SETSIZE) {
+                return false;
+            }
+            cursor = end;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (AffinityCpuCount == slots) {
+                slots = slots == 0 ? 16 : slots * 2;
+                AffinityCpus = (int*)realloc(AffinityCpus, sizeof(int) * slots);
+            }
+            AffinityCpus[AffinityCpuCount++] = (int)cpu;
+        }
+
+        if (*cursor == ',') {
+            cursor++;
+        } else if (*cursor != '\0') {
+            return false;
+        }
+    }
+
+    return AffinityCpuCount > 0;
+}
+
+bool parse_affinity(const char* spec) {
+    if (strcmp(spec, "compact") == 0) {
+        Affinity = CompactAffinity;
+        return true;
+    }
+    if (strcmp(spec, "scatter") == 0) {
+        Affinity = ScatterAffinity;
+        return true;
+    }
+
+    Affinity = ListAffinity;
+    return parse_cpu_list(spec);
+}
+
+int read_topology_value(int cpu, const char* name) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+    int value = 0;
+    FILE* file = fopen(path, "r");
+    if (file != NULL) {
+        if (fscanf(file, "%d", &value) != 1) {
+            value = 0;
+        }
+        fclose(file);
+    }
+
+    return value;
+}
+
+int compare_compact(const void* a, const void* b) {
+    const struct CpuInfo* first = (const struct CpuInfo*)a;
+    const struct CpuInfo* second = (const struct CpuInfo*)b;
+
+    if (first->package != second->package) {
+        return first->package - second->package;
+    }
+    if (first->core != second->core) {
+        return first->core - second->core;
+    }
+    return first->cpu - second->cpu;
+}
+
+int compare_scatter(const void* a, const void* b) {
+    const struct CpuInfo* first = (const struct CpuInfo*)a;
+    const struct CpuInfo* second = (const struct CpuInfo*)b;
+
+    if (first->sibling != second->sibling) {
+        return first->sibling - second->sibling;
+    }
+    if (first->core_rank != second->core_rank) {
+        return first->core_rank - second->core_rank;
+    }
+    return first->package - second->package;
+}
+
+// Works out the placement order for compact and scatter from the topology that
+// sysfs reports for the CPUs this process may run on.
+void affinity_init() {
+    if (Affinity != CompactAffinity && Affinity != ScatterAffinity) {
+        return;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    struct CpuInfo* cpus = (struct CpuInfo*)malloc(sizeof(struct CpuInfo) * CPU_COUNT(&allowed));
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[count].cpu = cpu;
+            cpus[count].package = read_topology_value(cpu, "physical_package_id");
+            cpus[count].core = read_topology_value(cpu, "core_id");
+            count++;
+        }
+    }
+
+    // Sorted compactly, siblings of a core are adjacent and cores of a package are
+    // adjacent, so ranks within each can be counted in a single pass.
+    qsort(cpus, count, sizeof(struct CpuInfo), compare_compact);
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || cpus[i].package != cpus[i - 1].package) {
+            cpus[i].core_rank = 0;
+            cpus[i].sibling = 0;
+        } else if (cpus[i].core != cpus[i - 1].core) {
+            cpus[i].core_rank = cpus[i - 1].core_rank + 1;
+            cpus[i].sibling = 0;
+        } else {
+            cpus[i].core_rank = cpus[i - 1].core_rank;
+            cpus[i].sibling = cpus[i - 1].sibling + 1;
+        }
+    }
+
+    if (Affinity == ScatterAffinity) {
+        qsort(cpus, count, sizeof(struct CpuInfo), compare_scatter);
+    }
+
+    free(AffinityCpus);
+    AffinityCpus = (int*)malloc(sizeof(int) * count);
+    AffinityCpuCount = count;
+    for (int i = 0; i < count; i++) {
+        AffinityCpus[i] = cpus[i].cpu;
+    }
+
+    free(cpus);
+}
+
+void print_affinity() {
+    if (Affinity == NoAffinity) {
+        return;
+    }
+
+    printf("Pinning threads (%s) to CPUs:", AffinityNames[Affinity]);
+    for (int i = 0; i < AffinityCpuCount; i++) {
+        printf("%s%d", i == 0 ? " " : ",", AffinityCpus[i]);
+    }
+    printf("\n");
+}
+
+// Pins a freshly created thread to the CPU of its placement slot.
+void pin_thread(pthread_t thread, int slot) {
+    if (Affinity == NoAffinity || AffinityCpuCount == 0) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(AffinityCpus[slot % AffinityCpuCount], &set);
+
+    int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (error != 0) {
+        printf("Unable to pin a thread to CPU %d: %s\n", AffinityCpus[slot % AffinityCpuCount], strerror(error));
+    }
+}
+
+// Moves the calling thread to the CPU of the given placement slot, saving where it
+// was allowed to run before. Memory the thread touches from then on is placed on
+// that CPU's NUMA node by the kernel's first-touch policy, which is how shared
+// buffers end up next to the threads that use them. Returns false if placement is
+// not enabled, in which case there is nothing to restore.
+bool move_current_thread(int slot, cpu_set_t* previous) {
+    if (Affinity == NoAffinity || AffinityCpuCount == 0) {
+        return false;
+    }
+
+    pthread_getaffinity_np(pthread_self(), sizeof(*previous), previous);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(AffinityCpus[slot % AffinityCpuCount], &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void restore_current_thread(const cpu_set_t* previous) {
+    pthread_setaffinity_np(pthread_self(), sizeof(*previous), previous);
+}
+
+
+//======================================================================================
+//
+//  Waiting.
+//
+//======================================================================================
+
+// Going straight to sleep whenever a queue is full or a fork is taken costs a
+// futex syscall and a context switch, even when the wait would have been over in a
+// microsecond. The wait strategy (--wait) decides what a thread does each time it
+// finds it cannot proceed yet:
+//   - spin:     busy-wait with a pause instruction. Lowest latency, burns a CPU.
+//   - yield:    spin for a while, then keep calling sched_yield.
+//   - block:    sleep right away (the original behavior).
+//   - adaptive: spin for a while, then yield for a while, then sleep (the default).
+enum WaitStrategy {
+    SpinWait,
+    YieldWait,
+    BlockWait,
+    AdaptiveWait,
+    InvalidWait
+};
+
+enum WaitStrategy Waiting = AdaptiveWait;
+
+char* WaitStrategyNames[] = {
+        "spin",
+        "yield",
+        "block",
+        "adaptive",
+        "invalid"
+};
+
+enum WaitStrategy parse_wait_strategy(const char* name) {
+    for (int i = 0; i < InvalidWait; i++) {
+        if (strcmp(name, WaitStrategyNames[i]) == 0) {
+            return (enum WaitStrategy)i;
+        }
+    }
+
+    return InvalidWait;
+}
+
+#define WAIT_SPINS 200
+#define WAIT_YIELDS 50
+
+// Tells the CPU this is a spin loop: saves power and, on hyperthreaded cores,
+// leaves the pipeline to the sibling.
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// The state of one wait, from the moment the caller first found it could not
+// proceed until it finally can.
+struct Waiter {
+    int rounds;
+};
+
+#define WAITER_INIT {0}
+
+// Call each time the awaited condition is found not to hold. Either spins or yields
+// for a bit and returns false, so that the caller checks again, or returns true to
+// tell the caller it is time to block.
+bool wait_step(struct Waiter* waiter) {
+    int round = waiter->rounds++;
+
+    switch (Waiting) {
+        case SpinWait:
+            cpu_relax();
+            return false;
+
+        case YieldWait:
+            if (round < WAIT_SPINS) {
+                cpu_relax();
+            } else {
+                sched_yield();
+            }
+            return false;
+
+        case BlockWait:
+            return true;
+
+        default:
+            if (round < WAIT_SPINS) {
+                cpu_relax();
+                return false;
+            }
+            if (round < WAIT_SPINS + WAIT_YIELDS) {
+                sched_yield();
+                return false;
+            }
+            return true;
+    }
+}
+
+bool wait_may_block() {
+    return Waiting == BlockWait || Waiting == AdaptiveWait;
+}
+
+//========================================================
+// Parking lots
+//========================================================
+
+// Lock-free code has no condvar to sleep on, so a thread that has to block there
+// parks on a futex instead. A parking lot is an eventcount: a sleeper registers
+// itself, reads the sequence number, checks its condition one last time and only
+// then sleeps on the sequence number. Whoever makes the condition true bumps the
+// sequence and wakes everyone, but only if somebody registered, so that while
+// nobody sleeps the cost of a notification is one fence and one load.
+struct ParkingLot {
+    atomic_int sequence;
+    atomic_int sleepers;
+};
+
+// Futexes are private to the process, which saves the kernel looking up the
+// mapping behind them, unless --shm puts the queues (and their parking lots) in
+// memory shared with other processes. It is settled before any thread starts, as a
+// private wake never finds a shared waiter.
+int FutexPrivateFlag = FUTEX_PRIVATE_FLAG;
+
+long futex_wait(atomic_int* address, int expected) {
+    return syscall(SYS_futex, (int*)address, FUTEX_WAIT | FutexPrivateFlag, expected, NULL, NULL, 0);
+}
+
+long futex_wake(atomic_int* address, int count) {
+    return syscall(SYS_futex, (int*)address, FUTEX_WAKE | FutexPrivateFlag, count, NULL, NULL, 0);
+}
+
+void parking_init(struct ParkingLot* lot) {
+    atomic_init(&lot->sequence, 0);
+    atomic_init(&lot->sleepers, 0);
+}
+
+// Registers the caller as a sleeper and returns the key to sleep on. The caller
+// must then check its condition again and either park or cancel.
+int parking_prepare(struct ParkingLot* lot) {
+    atomic_fetch_add(&lot->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load(&lot->sequence);
+}
+
+void parking_park(struct ParkingLot* lot, int key) {
+    futex_wait(&lot->sequence, key);
+    atomic_fetch_sub(&lot->sleepers, 1);
+}
+
+void parking_cancel(struct ParkingLot* lot) {
+    atomic_fetch_sub(&lot->sleepers, 1);
+}
+
+void parking_wake_all(struct ParkingLot* lot) {
+    atomic_fetch_add(&lot->sequence, 1);
+    futex_wake(&lot->sequence, INT_MAX);
+}
+
+// Call after making the condition true (the store that does so must come first).
+void parking_notify(struct ParkingLot* lot) {
+    if (!wait_may_block()) {
+        return;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&lot->sleepers, memory_order_relaxed) > 0) {
+        parking_wake_all(lot);
+    }
+}
+
+
+//========================================================
+// Semaphores
+//========================================================
+
+// The models' semaphores. With FUTEX_SEMAPHORES on (the default, see the CMake
+// option of the same name), a semaphore is just a counter and a waiter count: taking
+// it is a CAS on the counter, posting it is an atomic add, and the futex calls
+// happen only when someone actually has to sleep. With it off, they are plain POSIX
+// semaphores, which go through glibc's generic code on every call.
+#ifndef FUTEX_SEMAPHORES
+#define FUTEX_SEMAPHORES 1
+#endif
+
+#if FUTEX_SEMAPHORES
+
+struct Semaphore {
+    atomic_int value;
+    atomic_int waiters;
+};
+
+const char* SEMAPHORE_KIND = "futex";
+
+void semaphore_init(struct Semaphore* semaphore, int value) {
+    atomic_init(&semaphore->value, value);
+    atomic_init(&semaphore->waiters, 0);
+}
+
+void semaphore_destroy(struct Semaphore* semaphore) {
+    (void)semaphore;
+}
+
+bool semaphore_trywait(struct Semaphore* semaphore) {
+    int value = atomic_load_explicit(&semaphore->value, memory_order_relaxed);
+    while (value > 0) {
+        if (atomic_compare_exchange_weak_explicit(&semaphore->value, &value, value - 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Sleeps until the semaphore may have been posted. Returns whether it was taken in
+// the process, which it never is here: the caller tries again.
+//
+// A sleeper registers before the futex checks the value is still zero, and a poster
+// bumps the value before it checks for sleepers. Both are sequentially consistent,
+// so at least one of them sees the other, and no wakeup is lost.
+bool semaphore_sleep(struct Semaphore* semaphore) {
+    atomic_fetch_add(&semaphore->waiters, 1);
+    if (atomic_load(&semaphore->value) == 0) {
+        futex_wait(&semaphore->value, 0);
+    }
+    atomic_fetch_sub(&semaphore->waiters, 1);
+
+    return false;
+}
+
+void semaphore_post(struct Semaphore* semaphore) {
+    atomic_fetch_add(&semaphore->value, 1);
+    if (atomic_load(&semaphore->waiters) > 0) {
+        futex_wake(&semaphore->value, 1);
+    }
+}
+
+#else
+
+struct Semaphore {
+    sem_t semaphore;
+};
+
+const char* SEMAPHORE_KIND = "POSIX";
+
+void semaphore_init(struct Semaphore* semaphore, int value) {
+    sem_init(&semaphore->semaphore, 0, value);
+}
+
+void semaphore_destroy(struct Semaphore* semaphore) {
+    sem_destroy(&semaphore->semaphore);
+}
+
+bool semaphore_trywait(struct Semaphore* semaphore) {
+    return sem_trywait(&semaphore->semaphore) == 0;
+}
+
+// Returns whether the semaphore was taken; it is not if a signal got in the way.
+bool semaphore_sleep(struct Semaphore* semaphore) {
+    return sem_wait(&semaphore->semaphore) == 0;
+}
+
+void semaphore_post(struct Semaphore* semaphore) {
+    sem_post(&semaphore->semaphore);
+}
+
+#endif
+
+// Waits on a semaphore as the strategy says: polling with semaphore_trywait first,
+// then sleeping until it is posted.
+void wait_on_semaphore(struct Semaphore* semaphore) {
+    struct Waiter waiter = WAITER_INIT;
+
+    while (!semaphore_trywait(semaphore)) {
+        if (wait_step(&waiter) && semaphore_sleep(semaphore)) {
+            return;
+        }
+    }
+}
+
+// With LOCK_PROFILING on, the semaphore calls above get wrapped as well, thanks to
+// macros of the same names; the wrappers call the functions with their names in
+// parentheses, which macros do not expand. A post never waits, so it only counts.
+#if LOCK_PROFILING
+
+void profiled_wait_on_semaphore(struct LockSite* site, struct Semaphore* semaphore) {
+    if ((semaphore_trywait)(semaphore)) {
+        record_lock_operation(site, false, 0);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    (wait_on_semaphore)(semaphore);
+    record_lock_operation(site, true, now_ns() - start);
+}
+
+// A failed attempt counts as contended, without any waiting.
+bool profiled_semaphore_trywait(struct LockSite* site, struct Semaphore* semaphore) {
+    bool taken = (semaphore_trywait)(semaphore);
+    record_lock_operation(site, !taken, 0);
+
+    return taken;
+}
+
+void profiled_semaphore_post(struct LockSite* site, struct Semaphore* semaphore) {
+    record_lock_operation(site, false, 0);
+    (semaphore_post)(semaphore);
+}
+
+#define wait_on_semaphore(semaphore) \
+    profiled_wait_on_semaphore(LOCK_SITE("semaphore", semaphore), (semaphore))
+#define semaphore_trywait(semaphore) \
+    profiled_semaphore_trywait(LOCK_SITE("semaphore", semaphore), (semaphore))
+#define semaphore_post(semaphore) \
+    profiled_semaphore_post(LOCK_SITE("semaphore", semaphore), (semaphore))
+
+#endif
+
+#if LOCK_PROFILING
+
+int compare_lock_sites(const void* a, const void* b) {
+    uint64_t first = atomic_load(&(*(struct LockSite* const*)a)->wait_ns);
+    uint64_t second = atomic_load(&(*(struct LockSite* const*)b)->wait_ns);
+
+    return first < second ? 1 : first > second ? -1 : 0;
+}
+
+void print_lock_site_heading(const char* where) {
+    printf("  %-9s %-34s %-30s %11s %11s %10s %12s %10s\n",
+           "kind", "primitive", where, "operations", "contended", "wait ms", "max wait us", "hold ms");
+}
+
+// Call sites ranked by the time spent waiting at them; then the same totals per
+// primitive, as named by the expression at the call site.
+void lock_profile_report() {
+    int count = 0;
+    for (struct LockSite* site = atomic_load(&LockSites); site != NULL; site = site->next) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    struct LockSite** sites = (struct LockSite**)malloc(sizeof(struct LockSite*) * count);
+    int i = 0;
+    for (struct LockSite* site = atomic_load(&LockSites); site != NULL; site = site->next) {
+        sites[i++] = site;
+    }
+    qsort(sites, count, sizeof(struct LockSite*), compare_lock_sites);
+
+    printf("\nLock profile by call site, most waited on first:\n");
+    print_lock_site_heading("site");
+    for (i = 0; i < count; i++) {
+        struct LockSite* site = sites[i];
+        char where[64];
+        snprintf(where, sizeof(where), "%s:%d", site->function, site->line);
+        printf("  %-9s %-34s %-30s %11lu %11lu %10.3f %12.3f %10.3f\n",
+               site->kind, site->primitive, where,
+               atomic_load(&site->operations), atomic_load(&site->contended),
+               (double)atomic_load(&site->wait_ns) / 1E6, (double)atomic_load(&site->max_wait_ns) / 1E3,
+               (double)atomic_load(&site->hold_ns) / 1E6);
+    }
+
+    // The sites are already in order, so the first site of each primitive puts it
+    // in its place.
+    printf("\nLock profile by primitive:\n");
+    print_lock_site_heading("sites");
+    for (i = 0; i < count; i++) {
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = strcmp(sites[j]->kind, sites[i]->kind) == 0 && strcmp(sites[j]->primitive, sites[i]->primitive) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        int site_count = 0;
+        unsigned long operations = 0, contended = 0;
+        uint64_t wait_ns = 0, max_wait_ns = 0, hold_ns = 0;
+        for (int j = i; j < count; j++) {
+            struct LockSite* site = sites[j];
+            if (strcmp(site->kind, sites[i]->kind) != 0 || strcmp(site->primitive, sites[i]->primitive) != 0) {
+                continue;
+            }
+            site_count++;
+            operations += atomic_load(&site->operations);
+            contended += atomic_load(&site->contended);
+            wait_ns += atomic_load(&site->wait_ns);
+            hold_ns += atomic_load(&site->hold_ns);
+            if (atomic_load(&site->max_wait_ns) > max_wait_ns) {
+                max_wait_ns = atomic_load(&site->max_wait_ns);
+            }
+        }
+
+        char where[16];
+        snprintf(where, sizeof(where), "%d", site_count);
+        printf("  %-9s %-34s %-30s %11lu %11lu %10.3f %12.3f %10.3f\n",
+               sites[i]->kind, sites[i]->primitive, where, operations, contended,
+               (double)wait_ns / 1E6, (double)max_wait_ns / 1E3, (double)hold_ns / 1E6);
+    }
+
+    free(sites);
+}
+
+#else
+
+void lock_profile_report() {
+}
+
+#endif
+
+
+//========================================================
+// Ticket and MCS locks
+//========================================================
+
+// -L picks what the models' locks are made of: the forks of -d, and the lock of the
+// mutex queue of -p and -P.
+//   - native: semaphores for the forks and a pthread mutex for the queue, as ever.
+//             Neither hands the lock over in any particular order.
+//   - ticket: a ticket lock. Taking it is a fetch-and-add for a ticket, then waiting
+//             for the lock to serve that ticket, so waiters get it in turn. They all
+//             watch the same counter, though, so each handover reaches every one of
+//             them.
+//   - mcs:    an MCS lock, just as fair: waiters form a queue, each watching a flag
+//             in a node of its own, so a handover only touches the next in line.
+// Both wait as --wait says, and when it is time to block, sleep on a futex on
+// whatever they watch.
+enum LockKind {
+    NativeLocks,
+    TicketLocks,
+    McsLocks,
+    InvalidLocks
+};
+
+enum LockKind Locking = NativeLocks;
+
+char* LockKindNames[] = {
+        "native",
+        "ticket",
+        "mcs",
+        "invalid"
+};
+
+enum LockKind parse_lock_kind(const char* name) {
+    for (int i = 0; i < InvalidLocks; i++) {
+        if (strcmp(name, LockKindNames[i]) == 0) {
+            return (enum LockKind)i;
+        }
+    }
+
+    return InvalidLocks;
+}
+
+// Tickets wrap around, which is harmless as long as fewer than 2^32 threads wait.
+struct TicketLock {
+    atomic_int next;
+    atomic_int serving;
+    atomic_int sleepers;
+};
+
+void ticket_lock_init(struct TicketLock* lock) {
+    atomic_init(&lock->next, 0);
+    atomic_init(&lock->serving, 0);
+    atomic_init(&lock->sleepers, 0);
+}
+
+bool ticket_trylock(struct TicketLock* lock) {
+    int serving = atomic_load_explicit(&lock->serving, memory_order_relaxed);
+    int next = serving;
+
+    return atomic_compare_exchange_strong_explicit(&lock->next, &next, serving + 1,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+void ticket_lock(struct TicketLock* lock) {
+    int ticket = atomic_fetch_add_explicit(&lock->next, 1, memory_order_relaxed);
+    struct Waiter waiter = WAITER_INIT;
+
+    int serving;
+    while ((serving = atomic_load_explicit(&lock->serving, memory_order_acquire)) != ticket) {
+        if (wait_step(&waiter)) {
+            atomic_fetch_add(&lock->sleepers, 1);
+            if (atomic_load(&lock->serving) == serving) {
+                futex_wait(&lock->serving, serving);
+            }
+            atomic_fetch_sub(&lock->sleepers, 1);
+        }
+    }
+}
+
+// Sleepers wait for different tickets on the same counter, so all of them have to be
+// woken up for the one whose turn it is.
+void ticket_unlock(struct TicketLock* lock) {
+    atomic_fetch_add(&lock->serving, 1);
+    if (atomic_load(&lock->sleepers) > 0) {
+        futex_wake(&lock->serving, INT_MAX);
+    }
+}
+
+// A node is only ever in one lock's queue at a time. Nodes go on cache lines of
+// their own, so that a waiter watching its flag does not share the line with
+// anybody else's.
+struct McsNode {
+    _Alignas(CACHE_LINE_SIZE) _Atomic(struct McsNode*) next;
+    atomic_int locked;
+    atomic_int sleeping;
+};
+
+struct McsLock {
+    _Atomic(struct McsNode*) tail;
+};
+
+void mcs_lock_init(struct McsLock* lock) {
+    atomic_init(&lock->tail, NULL);
+}
+
+void mcs_node_reset(struct McsNode* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, 1, memory_order_relaxed);
+    atomic_store_explicit(&node->sleeping, 0, memory_order_relaxed);
+}
+
+bool mcs_trylock(struct McsLock* lock, struct McsNode* node) {
+    mcs_node_reset(node);
+    struct McsNode* tail = NULL;
+
+    return atomic_compare_exchange_strong_explicit(&lock->tail, &tail, node,
+                                                   memory_order_acq_rel, memory_order_relaxed);
+}
+
+void mcs_lock(struct McsLock* lock, struct McsNode* node) {
+    mcs_node_reset(node);
+    struct McsNode* previous = atomic_exchange_explicit(&lock->tail, node, memory_order_acq_rel);
+    if (previous == NULL) {
+        return;
+    }
+
+    atomic_store_explicit(&previous->next, node, memory_order_release);
+
+    // Same handshake as the futex semaphores: the sleeper says so before it checks
+    // the flag one last time, and the unlocker clears the flag before it checks for
+    // a sleeper.
+    struct Waiter waiter = WAITER_INIT;
+    while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+        if (wait_step(&waiter)) {
+            atomic_store(&node->sleeping, 1);
+            if (atomic_load(&node->locked)) {
+                futex_wait(&node->locked, 1);
+            }
+            atomic_store(&node->sleeping, 0);
+        }
+    }
+}
+
+void mcs_unlock(struct McsLock* lock, struct McsNode* node) {
+    struct McsNode* successor = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (successor == NULL) {
+        struct McsNode* tail = node;
+        if (atomic_compare_exchange_strong_explicit(&lock->tail, &tail, NULL,
+                                                    memory_order_release, memory_order_relaxed)) {
+            return;
+        }
+
+        // Somebody got in line, but has yet to link itself behind this node. It may
+        // well be preempted in between, hence the yields.
+        struct Waiter waiter = WAITER_INIT;
+        while ((successor = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL) {
+            if (wait_step(&waiter)) {
+                sched_yield();
+            }
+        }
+    }
+
+    atomic_store(&successor->locked, 0);
+    if (atomic_load(&successor->sleeping)) {
+        futex_wake(&successor->locked, 1);
+    }
+}
+
+// With LOCK_PROFILING on, these get wrapped like the semaphores: a first try that
+// fails, and any wait that follows, count as contended.
+#if LOCK_PROFILING
+
+void profiled_ticket_lock(struct LockSite* site, struct TicketLock* lock) {
+    if (ticket_trylock(lock)) {
+        record_lock_operation(site, false, 0);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    (ticket_lock)(lock);
+    record_lock_operation(site, true, now_ns() - start);
+}
+
+void profiled_mcs_lock(struct LockSite* site, struct McsLock* lock, struct McsNode* node) {
+    if (mcs_trylock(lock, node)) {
+        record_lock_operation(site, false, 0);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    (mcs_lock)(lock, node);
+    record_lock_operation(site, true, now_ns() - start);
+}
+
+bool profiled_ticket_trylock(struct LockSite* site, struct TicketLock* lock) {
+    bool taken = (ticket_trylock)(lock);
+    record_lock_operation(site, !taken, 0);
+
+    return taken;
+}
+
+bool profiled_mcs_trylock(struct LockSite* site, struct McsLock* lock, struct McsNode* node) {
+    bool taken = (mcs_trylock)(lock, node);
+    record_lock_operation(site, !taken, 0);
+
+    return taken;
+}
+
+#define ticket_lock(lock) profiled_ticket_lock(LOCK_SITE("ticket", lock), (lock))
+#define mcs_lock(lock, node) profiled_mcs_lock(LOCK_SITE("mcs", lock), (lock), (node))
+#define ticket_trylock(lock) profiled_ticket_trylock(LOCK_SITE("ticket", lock), (lock))
+#define mcs_trylock(lock, node) profiled_mcs_trylock(LOCK_SITE("mcs", lock), (lock), (node))
+
+#endif
+
+
+//======================================================================================
+//
+//  Timers.
+//
+//======================================================================================
+
+//========================================================
+// Timer wheels
+//========================================================
+
+// A hierarchical timer wheel, in the spirit of the one the Linux kernel used for
+// years: level 0 has a slot for each of the next 64 ticks, level 1 one for each of
+// the next 64 runs of 64 ticks, and so on up. A timer goes in the lowest level
+// whose range covers it, so putting one in is constant time whatever its delay.
+// Each time the ticks below a level slot have all gone by, that slot is cascaded:
+// its timers go back in, now a level or more lower. A timer is cascaded at most
+// once per level on its way down to level 0, where its slot coming round means it
+// is due.
+//
+// A wheel is not thread-safe: whoever owns it must lock it, if it is shared at all.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Timers are embedded at the start of whatever waits on them.
+struct Timer {
+    struct Timer* next;
+
+    // The tick it is due in.
+    uint64_t tick;
+};
+
+struct TimerWheel {
+    // The next tick to go through.
+    uint64_t tick;
+    long pending;
+    struct Timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct TimerWheel* wheel, uint64_t tick) {
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->tick = tick;
+}
+
+// Timers due before the wheel's current tick are due in it. Those due further out
+// than the top level reaches wait in its furthest slot, and get put back in from
+// there as it cascades until they are in range.
+void timer_wheel_insert(struct TimerWheel* wheel, struct Timer* timer) {
+    const uint64_t RANGE = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+
+    uint64_t tick = timer->tick < wheel->tick ? wheel->tick : timer->tick;
+    if (tick - wheel->tick >= RANGE) {
+        tick = wheel->tick + RANGE - 1;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && tick - wheel->tick >= 1ULL << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    struct Timer** slot = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    *slot = timer;
+    wheel->pending++;
+}
+
+// Goes through every tick up to and including the given one, and returns the
+// timers that are due as a list.
+struct Timer* timer_wheel_advance(struct TimerWheel* wheel, uint64_t now_tick) {
+    struct Timer* due = NULL;
+
+    while (wheel->pending > 0 && wheel->tick <= now_tick) {
+        uint64_t tick = wheel->tick;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS && (tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) == 0;
+             level++) {
+            struct Timer** slot = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+            struct Timer* timer = *slot;
+            *slot = NULL;
+            while (timer != NULL) {
+                struct Timer* next = timer->next;
+                wheel->pending--;
+                timer_wheel_insert(wheel, timer);
+                timer = next;
+            }
+        }
+
+        struct Timer** slot = &wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+        while (*slot != NULL) {
+            struct Timer* timer = *slot;
+            *slot = timer->next;
+            timer->next = due;
+            due = timer;
+            wheel->pending--;
+        }
+        wheel->tick++;
+    }
+
+    // With nothing left in it, there is nothing to go through.
+    if (wheel->tick <= now_tick) {
+        wheel->tick = now_tick + 1;
+    }
+
+    return due;
+}
+
+// Takes every timer out of the wheel, due or not, and returns them as a list.
+struct Timer* timer_wheel_flush(struct TimerWheel* wheel) {
+    struct Timer* all = NULL;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS && wheel->pending > 0; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            while (wheel->slots[level][i] != NULL) {
+                struct Timer* timer = wheel->slots[level][i];
+                wheel->slots[level][i] = timer->next;
+                timer->next = all;
+                all = timer;
+                wheel->pending--;
+            }
+        }
+    }
+
+    return all;
+}
+
+// The next tick the wheel needs going through for anything to come due: the first
+// level 0 slot in use, or failing that the next cascade, whatever it brings down.
+uint64_t timer_wheel_next_tick(struct TimerWheel* wheel) {
+    uint64_t tick = wheel->tick;
+    while (wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)] == NULL && (tick & (TIMER_WHEEL_SLOTS - 1)) != 0) {
+        tick++;
+    }
+
+    return tick;
+}
+
+//========================================================
+// Timer service
+//========================================================
+
+// Actors on threads of their own sleep a lot outside the benchmarks: random_sleep(),
+// think(), eat(). Each of those used to be a nanosleep(), that is, a kernel timer
+// and a wakeup per actor, whenever it was due. With --timers wheel (the default),
+// they register their deadlines with a single timer thread instead, and block on a
+// futex until it wakes them. The thread sleeps until the next tick anything is due
+// in, and wakes all of that tick's sleepers in one go, so simultaneous deadlines
+// cost one timer between them, and never more than one per tick.
+//
+// The catch is that deadlines are rounded up to the next tick. Nothing wakes early,
+// but anything may wake up to a tick late.
+const uint64_t TIMER_SERVICE_TICK_NS = 100 * 1000;
+
+enum TimerMode {
+    WheelTimers,
+    SleepTimers,
+    InvalidTimers
+};
+
+char* TimerModeNames[] = {
+        "wheel",
+        "sleep",
+        "invalid"
+};
+
+enum TimerMode Timing = WheelTimers;
+
+enum TimerMode parse_timers(const char* text) {
+    for (int i = 0; i < InvalidTimers; i++) {
+        if (strcmp(text, TimerModeNames[i]) == 0) {
+            return (enum TimerMode)i;
+        }
+    }
+
+    return InvalidTimers;
+}
+
+struct TimerSleeper {
+    struct Timer timer;
+    atomic_int woken;
+};
+
+struct TimerService {
+    pthread_mutex_t mutex;
+    struct TimerWheel wheel;
+
+    // The tick the service means to wake up in next. A sleeper due sooner bumps the
+    // sequence, which the service sleeps on, to have it wake up earlier.
+    uint64_t wake_tick;
+    atomic_int sequence;
+
+    // Once termination is requested, every sleeper is woken up and nobody else is
+    // put to sleep.
+    bool closed;
+    bool running;
+    atomic_bool stopping;
+    pthread_t thread;
+
+    // How many sleepers were woken up, and in how many batches.
+    uint64_t woken;
+    uint64_t batches;
+};
+
+struct TimerService Timers = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+long futex_wait_for(atomic_int* address, int expected, uint64_t timeout_ns) {
+    struct timespec timeout = {(time_t)(timeout_ns / NANOS_PER_SEC), (long)(timeout_ns % NANOS_PER_SEC)};
+    return syscall(SYS_futex, (int*)address, FUTEX_WAIT | FutexPrivateFlag, expected, &timeout, NULL, 0);
+}
+
+// Wakes up a list of sleepers. Their next link must be read before they are woken,
+// since a woken sleeper is gone as soon as it returns.
+void timer_service_wake(struct Timer* timer) {
+    uint64_t woken = 0;
+    while (timer != NULL) {
+        struct TimerSleeper* sleeper = (struct TimerSleeper*)timer;
+        timer = timer->next;
+        atomic_store(&sleeper->woken, 1);
+        futex_wake(&sleeper->woken, 1);
+        woken++;
+    }
+
+    if (woken > 0) {
+        Timers.woken += woken;
+        Timers.batches++;
+    }
+}
+
+void* run_timer_service(void* _) {
+    (void)_;
+    // Short of any sleepers, it still looks for a termination request now and then.
+    const uint64_t POLL_NS = 10 * 1000 * 1000;
+
+    struct TimerService* service = &Timers;
+    bool closing = false;
+    while (!closing && !atomic_load(&service->stopping)) {
+        lock_mutex(&service->mutex);
+        closing = TerminationRequested;
+        uint64_t now = now_ns();
+        struct Timer* due = closing ? timer_wheel_flush(&service->wheel)
+                                    : timer_wheel_advance(&service->wheel, now / TIMER_SERVICE_TICK_NS);
+        service->closed = closing;
+        service->wake_tick = service->wheel.pending > 0 ? timer_wheel_next_tick(&service->wheel) : UINT64_MAX;
+        uint64_t wake_ns = service->wake_tick < (now + POLL_NS) / TIMER_SERVICE_TICK_NS
+                           ? service->wake_tick * TIMER_SERVICE_TICK_NS : now + POLL_NS;
+        int sequence = atomic_load(&service->sequence);
+        unlock_mutex(&service->mutex);
+
+        timer_service_wake(due);
+        if (!closing && wake_ns > now) {
+            futex_wait_for(&service->sequence, sequence, wake_ns - now);
+        }
+    }
+
+    return NULL;
+}
+
+void timer_service_start() {
+    if (Timing != WheelTimers) {
+        return;
+    }
+
+    struct TimerService* service = &Timers;
+    timer_wheel_init(&service->wheel, now_ns() / TIMER_SERVICE_TICK_NS);
+    service->wake_tick = UINT64_MAX;
+    service->closed = false;
+    atomic_store(&service->stopping, false);
+    service->woken = 0;
+    service->batches = 0;
+    service->running = pthread_create(&service->thread, NULL, run_timer_service, NULL) == 0;
+}
+
+// Once every actor is done. Even without a termination request, nobody is asleep
+// by then, so there is nobody left to wake up.
+void timer_service_stop() {
+    struct TimerService* service = &Timers;
+    if (!service->running) {
+        return;
+    }
+
+    atomic_store(&service->stopping, true);
+    atomic_fetch_add(&service->sequence, 1);
+    futex_wake(&service->sequence, 1);
+    pthread_join(service->thread, NULL);
+    service->running = false;
+
+    if (!BenchMode && service->woken > 0) {
+        printf("Timer wheel: %llu sleeps woken up in %llu batches.\n",
+               (unsigned long long)service->woken, (unsigned long long)service->batches);
+    }
+}
+
+// Sleeps until the given CLOCK_MONOTONIC time, cut short by a termination request,
+// on the timer service if it is running and in sleep_until() otherwise.
+void timer_sleep_until(uint64_t deadline_ns) {
+    struct TimerService* service = &Timers;
+    if (!service->running) {
+        sleep_until(deadline_ns);
+        return;
+    }
+
+    struct TimerSleeper sleeper;
+    sleeper.timer.tick = (deadline_ns + TIMER_SERVICE_TICK_NS - 1) / TIMER_SERVICE_TICK_NS;
+    atomic_init(&sleeper.woken, 0);
+
+    lock_mutex(&service->mutex);
+    if (service->closed || TerminationRequested) {
+        unlock_mutex(&service->mutex);
+        return;
+    }
+    timer_wheel_insert(&service->wheel, &sleeper.timer);
+    bool sooner = sleeper.timer.tick < service->wake_tick;
+    if (sooner) {
+        service->wake_tick = sleeper.timer.tick;
+        atomic_fetch_add(&service->sequence, 1);
+    }
+    unlock_mutex(&service->mutex);
+
+    if (sooner) {
+        futex_wake(&service->sequence, 1);
+    }
+    while (atomic_load(&sleeper.woken) == 0) {
+        futex_wait(&sleeper.woken, 0);
+    }
+}
+
+// This function based on https://stackoverflow.com/a/1157217
+void random_sleep(long max_sleep_time_ms) {
+    long period = (long)random_below((uint64_t)max_sleep_time_ms);
+    if (Timers.running) {
+        timer_sleep_until(now_ns() + (uint64_t)period * 1000000);
+        return;
+    }
+
+    struct timespec timespec;
+    timespec.tv_sec = period / 1000;
+    timespec.tv_nsec = (period % 1000) * (long)1E6;
+
+    nanosleep(&timespec, &timespec);
+}
+
+
+//======================================================================================
+//
+//  Executor.
+//
+//======================================================================================
+
+// With --executor pool, the models no longer get one thread per actor, which stops
+// working somewhere in the thousands of actors. Instead, each actor is a task: a state
+// machine whose step function does whatever it can without blocking and returns.
+// A fixed set of workers (--workers, one per CPU by default) runs the steps.
+//
+// Each worker has a deque of tasks. A worker takes tasks from the front of its own
+// deque and puts them back at the end once they have run (so they take turns, rather
+// than the same task running over and over), and when its own deque is empty, it
+// steals from the front of somebody else's. Only the owner ever adds to a deque, and
+// every task sits in exactly one deque at a time, so a deque sized for all the tasks
+// never fills up and never needs to grow.
+//
+// The Dining Philosophers can also run as fibers (--executor fibers), see the Fibers
+// section below.
+enum ExecutorKind {
+    ThreadExecutor,
+    PoolExecutor,
+    FiberExecutor,
+    InvalidExecutor
+};
+
+enum ExecutorKind Execution = ThreadExecutor;
+
+char* ExecutorNames[] = {
+        "threads",
+        "pool",
+        "fibers",
+        "invalid"
+};
+
+enum ExecutorKind parse_executor(const char* name) {
+    for (int i = 0; i < InvalidExecutor; i++) {
+        if (strcmp(name, ExecutorNames[i]) == 0) {
+            return (enum ExecutorKind)i;
+        }
+    }
+
+    return InvalidExecutor;
+}
+
+// Zero means one worker per online CPU.
+int WorkerCount = 0;
+
+// What a step tells the executor:
+//   - progressed: the task did something, and should run again soon.
+//   - stalled:    the task could not do anything (a fork was taken, the queue was
+//                 full...). It runs again too, but a worker that only finds stalled
+//                 tasks backs off for a bit.
+//   - done:       the task has finished, and never runs again.
+enum TaskStatus {
+    TaskProgressed,
+    TaskStalled,
+    TaskDone
+};
+
+// Tasks are embedded at the start of the models' own actor structs.
+struct Task {
+    enum TaskStatus (*step)(struct Task* task);
+
+    // The task does not run again before this CLOCK_MONOTONIC time, which is how
+    // actors sleep without holding up a worker.
+    uint64_t wake_ns;
+
+    // The actor's id, for the event log.
+    int id;
+};
+
+struct TaskDeque {
+    // The front, advanced (with a CAS) by whoever takes a task.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t top;
+
+    // The end, only ever written by the owner.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t bottom;
+
+    size_t mask;
+    _Atomic(struct Task*)* slots;
+};
+
+struct Executor;
+
+struct ExecutorWorker {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    struct Executor* executor;
+    struct TaskDeque deque;
+};
+
+struct Executor {
+    int worker_count;
+    struct ExecutorWorker* workers;
+    pthread_t* threads;
+
+    // Tasks that have not returned TaskDone yet. The workers leave when it gets to 0.
+    _Alignas(CACHE_LINE_SIZE) atomic_long remaining;
+};
+
+void deque_init(struct TaskDeque* deque, size_t capacity) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    deque->mask = capacity - 1;
+    deque->slots = (_Atomic(struct Task*)*)calloc(capacity, sizeof(_Atomic(struct Task*)));
+}
+
+// Owner only. There is always room, see above.
+void deque_push(struct TaskDeque* deque, struct Task* task) {
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(&deque->slots[bottom & deque->mask], task, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+// Owner and thieves alike. The slot is read before the CAS; if it was reused in the
+// meantime, top has moved on and the CAS fails, so a stale read is never returned.
+struct Task* deque_take(struct TaskDeque* deque) {
+    size_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    for (;;) {
+        size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+        if (top >= bottom) {
+            return NULL;
+        }
+
+        struct Task* task = atomic_load_explicit(&deque->slots[top & deque->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&deque->top, &top, top + 1,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            return task;
+        }
+    }
+}
+
+size_t deque_size(struct TaskDeque* deque) {
+    size_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    size_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    return bottom > top ? bottom - top : 0;
+}
+
+// Tries every other worker once, starting at a random one.
+struct Task* executor_steal(struct ExecutorWorker* worker) {
+    struct Executor* executor = worker->executor;
+
+    int first = (int)random_below((uint64_t)executor->worker_count);
+    for (int i = 0; i < executor->worker_count; i++) {
+        struct ExecutorWorker* victim = &executor->workers[(first + i) % executor->worker_count];
+        if (victim == worker) {
+            continue;
+        }
+
+        struct Task* task = deque_take(&victim->deque);
+        if (task != NULL) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+// Longest a worker naps when all it finds are sleeping or stalled tasks.
+const uint64_t EXECUTOR_MAX_NAP_NS = 1000 * 1000;
+
+void* run_worker(void* worker_info) {
+    struct ExecutorWorker* worker = (struct ExecutorWorker*)worker_info;
+    struct Executor* executor = worker->executor;
+    event_log_open(worker->id);
+    counters_open();
+    random_seed_thread(WorkerStream, worker->id);
+
+    // Tasks in a row that did not get anywhere (still asleep, or stalled), and the
+    // earliest of their wake up times.
+    size_t idle = 0;
+    uint64_t earliest_wake = UINT64_MAX;
+
+    while (atomic_load_explicit(&executor->remaining, memory_order_acquire) > 0) {
+        struct Task* task = deque_take(&worker->deque);
+        if (task == NULL) {
+            task = executor_steal(worker);
+        }
+
+        if (task == NULL) {
+            sched_yield();
+            continue;
+        }
+
+        // Once termination is requested, sleepers are woken up early, so that they
+        // can wrap up without keeping everybody waiting.
+        uint64_t now = now_ns();
+        enum TaskStatus status;
+        if (task->wake_ns > now && !TerminationRequested) {
+            status = TaskStalled;
+            earliest_wake = task->wake_ns < earliest_wake ? task->wake_ns : earliest_wake;
+        } else {
+            event_log_relabel(task->id);
+            status = task->step(task);
+        }
+
+        if (status == TaskDone) {
+            atomic_fetch_sub_explicit(&executor->remaining, 1, memory_order_release);
+            continue;
+        }
+        deque_push(&worker->deque, task);
+
+        if (status == TaskProgressed) {
+            idle = 0;
+            earliest_wake = UINT64_MAX;
+            continue;
+        }
+
+        // A stalled task could go at any time.
+        if (task->wake_ns <= now) {
+            earliest_wake = now;
+        }
+
+        // Once a whole lap of the deque got nowhere, nap until the earliest task is
+        // due, if they are all asleep; otherwise just let others run for a bit.
+        if (++idle > deque_size(&worker->deque)) {
+            if (earliest_wake > now) {
+                sleep_until(earliest_wake < now + EXECUTOR_MAX_NAP_NS ? earliest_wake : now + EXECUTOR_MAX_NAP_NS);
+            } else {
+                sched_yield();
+            }
+            idle = 0;
+            earliest_wake = UINT64_MAX;
+        }
+    }
+
+    return NULL;
+}
+
+// Hands out the tasks round robin and starts the workers, pinned to placement slots
+// 0, 1, 2... The tasks must stay put until executor_join returns.
+struct Executor* executor_start(struct Task** tasks, int task_count) {
+    struct Executor* executor = (struct Executor*)aligned_alloc(CACHE_LINE_SIZE, sizeof(struct Executor));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    executor->worker_count = WorkerCount > 0 ? WorkerCount : (cpus > 0 ? (int)cpus : 1);
+    executor->workers = (struct ExecutorWorker*)aligned_alloc(
+            CACHE_LINE_SIZE, sizeof(struct ExecutorWorker) * executor->worker_count);
+    executor->threads = (pthread_t*)malloc(sizeof(pthread_t) * executor->worker_count);
+    atomic_init(&executor->remaining, task_count);
+
+    size_t capacity = next_power_of_two((size_t)(task_count > 0 ? task_count : 1));
+    for (int i = 0; i < executor->worker_count; i++) {
+        struct ExecutorWorker* worker = &executor->workers[i];
+        worker->id = i;
+        worker->executor = executor;
+        deque_init(&worker->deque, capacity);
+    }
+
+    for (int i = 0; i < task_count; i++) {
+        deque_push(&executor->workers[i % executor->worker_count].deque, tasks[i]);
+    }
+
+    for (int i = 0; i < executor->worker_count; i++) {
+        pthread_create(&executor->threads[i], NULL, run_worker, (void *) &executor->workers[i]);
+        pin_thread(executor->threads[i], i);
+    }
+
+    return executor;
+}
+
+// Waits for every task to be done, then frees the executor.
+void executor_join(struct Executor* executor) {
+    for (int i = 0; i < executor->worker_count; i++) {
+        pthread_join(executor->threads[i], NULL);
+        free(executor->workers[i].deque.slots);
+    }
+
+    free(executor->threads);
+    free(executor->workers);
+    free(executor);
+}
+
+
+//========================================================
+// Fibers
+//========================================================
+
+// With --executor fibers, each actor is a fiber instead: a coroutine with a small
+// stack of its own, written as plainly as a thread, that gives way to the others
+// (fiber_yield) whenever it cannot go on, and is put to sleep (fiber_sleep) on a
+// timer wheel instead of in the kernel. A few scheduler threads (--workers, one per
+// CPU by default) each run their own share of the fibers, so a switch is a
+// swapcontext() on the same thread and no lock is ever taken to make one. That
+// lets a table seat a million philosophers.
+//
+// Fibers never move between schedulers, and nothing but their own scheduler ever
+// touches its run queue or its wheel. Whatever fibers of different schedulers
+// share (forks, say) must be taken without blocking, since blocking a fiber
+// blocks its whole scheduler thread.
+#define FIBER_STACK_SIZE (16 * 1024)
+
+struct FiberScheduler;
+
+// Fibers are embedded at the start of the models' own actor structs. Their timer
+// comes first, so that a fiber is its own timer.
+struct Fiber {
+    struct Timer timer;
+    ucontext_t context;
+    void (*body)(struct Fiber* fiber);
+    struct FiberScheduler* scheduler;
+
+    // In the run queue.
+    struct Fiber* next;
+
+    // The actor's id, for the event log.
+    int id;
+    bool done;
+};
+
+// Sleeping fibers wait on their scheduler's own timer wheel, in ticks of this long.
+const uint64_t FIBER_TICK_NS = 50 * 1000;
+
+struct FiberScheduler {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    // Where fibers switch back to when they yield, sleep or finish.
+    ucontext_t context;
+    struct Fiber* current;
+
+    struct Fiber* run_head;
+    struct Fiber* run_tail;
+    struct TimerWheel wheel;
+
+    // The scheduler's fibers, and the stacks they run on.
+    struct Fiber** fibers;
+    int fiber_count;
+    int remaining;
+    unsigned char* stacks;
+
+    uint64_t switches;
+};
+
+struct FiberPool {
+    int scheduler_count;
+    struct FiberScheduler* schedulers;
+    pthread_t* threads;
+    struct Fiber** fibers;
+};
+
+_Thread_local struct FiberScheduler* CurrentScheduler = NULL;
+
+void run_queue_push(struct FiberScheduler* scheduler, struct Fiber* fiber) {
+    fiber->next = NULL;
+    if (scheduler->run_tail == NULL) {
+        scheduler->run_head = fiber;
+    } else {
+        scheduler->run_tail->next = fiber;
+    }
+    scheduler->run_tail = fiber;
+}
+
+struct Fiber* run_queue_pop(struct FiberScheduler* scheduler) {
+    struct Fiber* fiber = scheduler->run_head;
+    if (fiber != NULL) {
+        scheduler->run_head = fiber->next;
+        if (scheduler->run_head == NULL) {
+            scheduler->run_tail = NULL;
+        }
+    }
+
+    return fiber;
+}
+
+// Puts a list of timers that came due, which are all fibers, back in the run queue.
+void fiber_wake_due(struct FiberScheduler* scheduler, struct Timer* timer) {
+    while (timer != NULL) {
+        struct Fiber* fiber = (struct Fiber*)timer;
+        timer = timer->next;
+        run_queue_push(scheduler, fiber);
+    }
+}
+
+// Gives way to the other runnable fibers, coming back once they have had a turn.
+void fiber_yield() {
+    struct FiberScheduler* scheduler = CurrentScheduler;
+    struct Fiber* fiber = scheduler->current;
+
+    run_queue_push(scheduler, fiber);
+    swapcontext(&fiber->context, &scheduler->context);
+}
+
+// Sleeps on the wheel for the given period, cut short by a termination request.
+void fiber_sleep(uint64_t period_ns) {
+    if (period_ns == 0 || TerminationRequested) {
+        return;
+    }
+
+    struct FiberScheduler* scheduler = CurrentScheduler;
+    struct Fiber* fiber = scheduler->current;
+
+    fiber->timer.tick = (now_ns() + period_ns) / FIBER_TICK_NS;
+    timer_wheel_insert(&scheduler->wheel, &fiber->timer);
+    swapcontext(&fiber->context, &scheduler->context);
+}
+
+// Where every fiber starts. When it returns, uc_link takes it back to the scheduler.
+void fiber_main() {
+    struct Fiber* fiber = CurrentScheduler->current;
+    fiber->body(fiber);
+    fiber->done = true;
+}
+
+void* run_fiber_scheduler(void* scheduler_info) {
+    struct FiberScheduler* scheduler = (struct FiberScheduler*)scheduler_info;
+    CurrentScheduler = scheduler;
+    event_log_open(scheduler->id);
+    counters_open();
+    random_seed_thread(WorkerStream, scheduler->id);
+
+    // Each stack is first touched here, so its memory is local to the scheduler.
+    for (int i = 0; i < scheduler->fiber_count; i++) {
+        struct Fiber* fiber = scheduler->fibers[i];
+        getcontext(&fiber->context);
+        fiber->context.uc_stack.ss_sp = scheduler->stacks + (size_t)i * FIBER_STACK_SIZE;
+        fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+        fiber->context.uc_link = &scheduler->context;
+        fiber->scheduler = scheduler;
+        makecontext(&fiber->context, fiber_main, 0);
+        run_queue_push(scheduler, fiber);
+    }
+    timer_wheel_init(&scheduler->wheel, now_ns() / FIBER_TICK_NS);
+
+    while (scheduler->remaining > 0) {
+        // Once termination is requested, sleepers are all woken up, so that they can
+        // wrap up. Fibers may wake up to a tick early, never late (for as long as the
+        // scheduler keeps up).
+        if (TerminationRequested) {
+            fiber_wake_due(scheduler, timer_wheel_flush(&scheduler->wheel));
+        } else {
+            fiber_wake_due(scheduler, timer_wheel_advance(&scheduler->wheel, now_ns() / FIBER_TICK_NS));
+        }
+
+        struct Fiber* fiber = run_queue_pop(scheduler);
+        if (fiber == NULL) {
+            sleep_until(timer_wheel_next_tick(&scheduler->wheel) * FIBER_TICK_NS);
+            continue;
+        }
+
+        scheduler->current = fiber;
+        event_log_relabel(fiber->id);
+        swapcontext(&scheduler->context, &fiber->context);
+        scheduler->switches++;
+
+        if (fiber->done) {
+            scheduler->remaining--;
+        }
+    }
+
+    return NULL;
+}
+
+// How many schedulers fibers_start() shares the given number of fibers among: one per
+// CPU unless --workers says otherwise, and never more than there are fibers.
+int fiber_scheduler_count(int fiber_count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = WorkerCount > 0 ? WorkerCount : (cpus > 0 ? (int)cpus : 1);
+    return count < fiber_count ? count : fiber_count;
+}
+
+// Hands out the fibers in contiguous runs, so that actors next to each other mostly
+// share a scheduler, and starts the schedulers, pinned to placement slots 0, 1,
+// 2... The fibers must stay put until fibers_join returns. Returns NULL when the
+// stacks cannot be had.
+struct FiberPool* fibers_start(struct Fiber** fibers, int fiber_count) {
+    struct FiberPool* pool = (struct FiberPool*)calloc(1, sizeof(struct FiberPool));
+    pool->scheduler_count = fiber_scheduler_count(fiber_count);
+    pool->schedulers = (struct FiberScheduler*)aligned_alloc(
+            CACHE_LINE_SIZE, sizeof(struct FiberScheduler) * pool->scheduler_count);
+    memset(pool->schedulers, 0, sizeof(struct FiberScheduler) * pool->scheduler_count);
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * pool->scheduler_count);
+
+    // The schedulers share out the caller's list, so the pool keeps its own copy.
+    pool->fibers = (struct Fiber**)malloc(sizeof(struct Fiber*) * fiber_count);
+    memcpy(pool->fibers, fibers, sizeof(struct Fiber*) * fiber_count);
+
+    for (int i = 0, first = 0; i < pool->scheduler_count; i++) {
+        struct FiberScheduler* scheduler = &pool->schedulers[i];
+        int count = fiber_count / pool->scheduler_count + (i < fiber_count % pool->scheduler_count ? 1 : 0);
+        scheduler->id = i;
+        scheduler->fibers = &pool->fibers[first];
+        scheduler->fiber_count = count;
+        scheduler->remaining = count;
+        first += count;
+
+        // Only the pages a fiber actually uses ever get backed by memory.
+        void* stacks = mmap(NULL, (size_t)count * FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        scheduler->stacks = stacks == MAP_FAILED ? NULL : (unsigned char*)stacks;
+        if (scheduler->stacks == NULL) {
+            printf("Unable to map the stacks of %d fibers.\n", count);
+            for (int j = 0; j < i; j++) {
+                munmap(pool->schedulers[j].stacks, (size_t)pool->schedulers[j].fiber_count * FIBER_STACK_SIZE);
+            }
+            free(pool->fibers);
+            free(pool->threads);
+            free(pool->schedulers);
+            free(pool);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < pool->scheduler_count; i++) {
+        pthread_create(&pool->threads[i], NULL, run_fiber_scheduler, (void *) &pool->schedulers[i]);
+        pin_thread(pool->threads[i], i);
+    }
+
+    return pool;
+}
+
+// Waits for every fiber to be done, then frees the pool. Returns the number of
+// switches to a fiber the schedulers made between them.
+uint64_t fibers_join(struct FiberPool* pool) {
+    uint64_t switches = 0;
+    for (int i = 0; i < pool->scheduler_count; i++) {
+        struct FiberScheduler* scheduler = &pool->schedulers[i];
+        pthread_join(pool->threads[i], NULL);
+        munmap(scheduler->stacks, (size_t)scheduler->fiber_count * FIBER_STACK_SIZE);
+        switches += scheduler->switches;
+    }
+
+    free(pool->fibers);
+    free(pool->threads);
+    free(pool->schedulers);
+    free(pool);
+
+    return switches;
+}
+
+
+//======================================================================================
+//
+//  Producer/Consumer.
+//
+//======================================================================================
+
+int ProducerCount = 0;
+int ConsumerCount = 0;
+
+// How many values a producer or consumer tries to move per trip to the queue.
+int BatchSize = 1;
+
+// In benchmark mode, when non-zero, the run ends after this many items have been
+// consumed instead of after BenchDurationSecs.
+long BenchItems = 0;
+
+// Bytes of payload each item carries, set with --payload.
+size_t PayloadSize = 0;
+
+// With --shards, each producer gets a queue of its own instead of all of them
+// sharing one. See the Sharded queues section.
+bool Sharded = false;
+
+// With --lanes, items come in priority classes, each with a queue (a lane) of its
+// own, and the share of the items produced into each. See the Priority lanes section.
+#define MAX_LANES 8
+
+int LaneCount = 1;
+long LaneShares[MAX_LANES] = {1};
+
+// The queue capacity requested with -q. It is rounded up to a power of two when the
+// queue is created, so that positions can be mapped to slots with a mask.
+#define MAX_QUEUE_CAPACITY ((size_t)1 << 30)
+
+size_t RequestedCapacity = 100;
+
+
+//========================================================
+// Queue backends
+//========================================================
+
+// The queue can be backed by one of three implementations, all sharing the same
+// contract (see the Queue interface section): producers block while the queue is
+// full, consumers block while it is empty, and both give up once termination has
+// been requested.
+//   - mutex: the original ring buffer, guarded by a mutex and two condvars.
+//   - spsc:  a lock-free single-producer/single-consumer ring.
+//   - mpmc:  a bounded lock-free multi-producer/multi-consumer ring with
+//            sequence-numbered slots (Dmitry Vyukov's design).
+enum QueueBackend {
+    MutexBackend,
+    SpscBackend,
+    MpmcBackend,
+    InvalidBackend
+};
+
+enum QueueBackend Backend = MutexBackend;
+
+char* BackendNames[] = {
+        "mutex",
+        "spsc",
+        "mpmc",
+        "invalid"
+};
+
+enum QueueBackend parse_backend(const char* name) {
+    for (int i = 0; i < InvalidBackend; i++) {
+        if (strcmp(name, BackendNames[i]) == 0) {
+            return (enum QueueBackend)i;
+        }
+    }
+
+    return InvalidBackend;
+}
+
+
+//========================================================
+// Queue state
+//========================================================
+
+// Producers keep writing the tail (and the value counter) while consumers keep
+// writing the head. If those share a cache line, every push and every pop steals
+// the line from the other side. With PCQUEUE_PADDING on (the default, see the
+// CMake option of the same name), each group starts on its own cache line, and
+// the read-mostly configuration gets a line of its own too.
+#ifndef PCQUEUE_PADDING
+#define PCQUEUE_PADDING 1
+#endif
+
+#if PCQUEUE_PADDING
+#define CACHE_ALIGNED _Alignas(CACHE_LINE_SIZE)
+#else
+#define CACHE_ALIGNED
+#endif
+
+// What travels through the queue: the value from the producers' counter, plus the
+// time at which it was queued so that consumers can measure how long it waited.
+// Each item is followed, in its slot, by PayloadSize bytes of payload (see
+// item_payload), standing in for the body of a real message.
+struct Item {
+    long value;
+    uint64_t enqueued_ns;
+};
+
+// Every MPMC slot carries a sequence number that tells whose turn it is. See the
+// Lock-free MPMC queue section below. The item (and its payload) follow it.
+struct MpmcSlot {
+    atomic_size_t sequence;
+    struct Item item;
+};
+
+// The Producers/Consumers  "queue" implemented as a simple array in a ring
+// buffer configuration. This data must live in the heap so that threads
+// can share it.
+//
+// The head and tail are never wrapped; they count every value ever popped and
+// pushed, and the slot is the count masked by the (power of two) capacity. That
+// leaves the number of queued values as the plain difference between the two.
+// The ring itself trails the structure, in the same allocation: slot_size bytes
+// per slot, holding an Item for the mutex and spsc backends or an MpmcSlot for the
+// mpmc backend, then the payload.
+struct PCQueue {
+    // Read-mostly configuration.
+    enum QueueBackend backend;
+    size_t capacity;
+    size_t mask;
+    size_t slot_size;
+    size_t item_offset;
+    size_t payload_size;
+
+    // Whether the queue lives in a --shm object, mapped by other processes too.
+    bool shared;
+
+    // Producer side.
+    CACHE_ALIGNED atomic_size_t tail;
+
+    // This is the "contents" produced and consumed. Just a simple counter. It is atomic
+    // since the lock-free backends do not hold any lock while producing.
+    atomic_long count;
+
+    // Consumer side.
+    CACHE_ALIGNED atomic_size_t head;
+
+    // Used only by the mutex backend. They go on a line of their own, since
+    // both sides write them. The blocked counts (written under the mutex) let the
+    // other side skip signalling a condvar nobody waits on; they are atomics, as
+    // are the wakeup counts, only so that the telemetry sampler can read them
+    // without the lock.
+    CACHE_ALIGNED pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    // With -L ticket or mcs, the lock that stands in for the mutex. There is no condvar
+    // to go with it, so the waits park on the lots below, as the lock-free backends'.
+    struct TicketLock ticket;
+    struct McsLock mcs;
+    atomic_int blocked_producers;
+    atomic_int blocked_consumers;
+    atomic_ulong producer_wakeups;
+    atomic_ulong consumer_wakeups;
+
+    // Used by the lock-free backends (and the mutex queue, with -L ticket or mcs), to
+    // block producers until there is room and consumers until there are items.
+    CACHE_ALIGNED struct ParkingLot room;
+    struct ParkingLot items;
+
+    CACHE_ALIGNED unsigned char ring[];
+};
+
+unsigned char* queue_slot(struct PCQueue* queue, size_t position) {
+    return queue->ring + (position & queue->mask) * queue->slot_size;
+}
+
+// The item at the given position, in place in the ring.
+struct Item* queue_item(struct PCQueue* queue, size_t position) {
+    return (struct Item*)(queue_slot(queue, position) + queue->item_offset);
+}
+
+unsigned char* item_payload(struct Item* item) {
+    return (unsigned char*)(item + 1);
+}
+
+struct MpmcSlot* queue_mpmc_slot(struct PCQueue* queue, size_t position) {
+    return (struct MpmcSlot*)queue_slot(queue, position);
+}
+
+
+//========================================================
+// Lock-free waits
+//========================================================
+
+// Called by the lock-free backends each time they find the queue full (or empty),
+// and by the mutex queue when its lock is a ticket or MCS lock (see -L).
+// Spins or yields as the strategy says, and when it is time to block, parks on
+// the lot until the other side notifies it. The blocked check is repeated after
+// registering as a sleeper, so that a notification cannot slip in between.
+void lock_free_wait(struct PCQueue* queue, struct ParkingLot* lot,
+                    bool (*blocked)(struct PCQueue*), struct Waiter* waiter) {
+    if (!wait_step(waiter)) {
+        return;
+    }
+
+    int key = parking_prepare(lot);
+    if (blocked(queue) && !TerminationRequested) {
+        parking_park(lot, key);
+    } else {
+        parking_cancel(lot);
+    }
+}
+
+
+//========================================================
+// Mutex queue
+//========================================================
+
+// To simulate a more non-deterministic behavior for producers and consumers, I will
+// add a random sleep period, then each actor will try to either add a datum to the
+// "queue" or remove one from it.
+
+// The head and tail are atomics only because the lock-free backends share them.
+// Here they are always accessed with the mutex held, so relaxed ordering will do.
+size_t queue_depth(struct PCQueue* queue) {
+    return atomic_load_explicit(&queue->tail, memory_order_relaxed) -
+           atomic_load_explicit(&queue->head, memory_order_relaxed);
+}
+
+bool queue_full(struct PCQueue* queue) {
+    return queue_depth(queue) == queue->capacity;
+}
+
+bool queue_empty(struct PCQueue* queue) {
+    return queue_depth(queue) == 0;
+}
+
+// A thread only ever holds one queue lock at a time, from a reserve (or acquire) to
+// its commit (or release), and never from one task step to the next, so an MCS node
+// per thread will do.
+_Thread_local struct McsNode QueueLockNode;
+
+// The mutex of a shared queue is robust: when a process dies holding it, whoever
+// locks it next gets EOWNERDEAD rather than hanging. Head and tail only move on a
+// commit (or release), under the mutex, so the queue is consistent as it is: what
+// the dead process had reserved is reused, and what it had acquired but not
+// released is delivered again.
+void recover_queue_mutex(struct PCQueue* queue, int result) {
+    if (result == EOWNERDEAD) {
+        printf("Recovered the queue lock from a process that died holding it.\n");
+        pthread_mutex_consistent(&queue->mutex);
+    }
+}
+
+void queue_lock(struct PCQueue* queue) {
+    switch (Locking) {
+        case TicketLocks:
+            ticket_lock(&queue->ticket);
+            break;
+
+        case McsLocks:
+            mcs_lock(&queue->mcs, &QueueLockNode);
+            break;
+
+        default:
+            recover_queue_mutex(queue, lock_mutex(&queue->mutex));
+            break;
+    }
+}
+
+void queue_unlock(struct PCQueue* queue) {
+    switch (Locking) {
+        case TicketLocks:
+            ticket_unlock(&queue->ticket);
+            break;
+
+        case McsLocks:
+            mcs_unlock(&queue->mcs, &QueueLockNode);
+            break;
+
+        default:
+            unlock_mutex(&queue->mutex);
+            break;
+    }
+}
+
+// Called with the lock held, when the queue is blocked (full for a producer, empty for
+// a consumer). Returns with the lock held again, once the other side may have made
+// progress, and the caller checks again.
+void mutex_queue_wait(struct PCQueue* queue, pthread_cond_t* condition, struct ParkingLot* lot,
+                      bool (*blocked)(struct PCQueue*), struct Waiter* waiter) {
+    if (Locking == NativeLocks) {
+        recover_queue_mutex(queue, wait_condition(condition, &queue->mutex));
+        return;
+    }
+
+    queue_unlock(queue);
+    lock_free_wait(queue, lot, blocked, waiter);
+    queue_lock(queue);
+}
+
+// Wakes the other side after a commit (or release), with the lock released.
+void mutex_queue_notify(pthread_cond_t* condition, struct ParkingLot* lot, bool wake, int count) {
+    if (Locking != NativeLocks) {
+        parking_notify(lot);
+    } else if (wake && count > 1) {
+        // More than one thread on the other side may be able to make progress now.
+        pthread_cond_broadcast(condition);
+    } else if (wake) {
+        pthread_cond_signal(condition);
+    }
+}
+
+// Before taking the lock, polls the queue (whose head and tail are atomics, so this
+// is safe without the lock) for as long as the wait strategy allows; then takes
+// the lock. Returns with the lock held and either the queue no longer full, or
+// termination requested, or the strategy ready to block.
+void mutex_queue_lock_when(struct PCQueue* queue, bool (*blocked)(struct PCQueue*), struct Waiter* waiter) {
+    bool block = false;
+
+    for (;;) {
+        while (blocked(queue) && !TerminationRequested && !block) {
+            block = wait_step(waiter);
+        }
+
+        queue_lock(queue);
+        if (!blocked(queue) || TerminationRequested || block) {
+            return;
+        }
+        queue_unlock(queue);
+    }
+}
+
+// Reserves up to count slots under a single lock acquisition, and keeps holding the
+// lock while the caller writes them, until mutex_queue_commit. Waits only until
+// there is room for at least one of them, so the caller may get fewer than it asked
+// for. Without wait, gives up right away if the queue is full. Returns with the
+// lock released if nothing was reserved.
+int mutex_queue_reserve(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    struct Waiter waiter = WAITER_INIT;
+    if (wait) {
+        mutex_queue_lock_when(queue, queue_full, &waiter);
+    } else {
+        queue_lock(queue);
+    }
+
+    while (queue_full(queue)) {
+        if (!wait || TerminationRequested) {
+            queue_unlock(queue);
+            return 0;
+        }
+        log_event(QueueFullEvent, 0);
+        atomic_fetch_add_explicit(&queue->blocked_producers, 1, memory_order_relaxed);
+        mutex_queue_wait(queue, &queue->not_full, &queue->room, queue_full, &waiter);
+        atomic_fetch_sub_explicit(&queue->blocked_producers, 1, memory_order_relaxed);
+    }
+
+    size_t room = queue->capacity - queue_depth(queue);
+    *position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    return count < (int)room ? count : (int)room;
+}
+
+void mutex_queue_commit(struct PCQueue* queue, size_t position, int count) {
+    atomic_store_explicit(&queue->tail, position + count, memory_order_relaxed);
+    bool wake = atomic_load_explicit(&queue->blocked_consumers, memory_order_relaxed) > 0;
+    if (wake) {
+        atomic_fetch_add_explicit(&queue->consumer_wakeups, 1, memory_order_relaxed);
+    }
+    queue_unlock(queue);
+
+    mutex_queue_notify(&queue->not_empty, &queue->items, wake, count);
+}
+
+int mutex_queue_acquire(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    struct Waiter waiter = WAITER_INIT;
+    if (wait) {
+        mutex_queue_lock_when(queue, queue_empty, &waiter);
+    } else {
+        queue_lock(queue);
+    }
+
+    while (queue_empty(queue)) {
+        if (!wait || TerminationRequested) {
+            queue_unlock(queue);
+            return 0;
+        }
+        log_event(QueueEmptyEvent, 0);
+        atomic_fetch_add_explicit(&queue->blocked_consumers, 1, memory_order_relaxed);
+        mutex_queue_wait(queue, &queue->not_empty, &queue->items, queue_empty, &waiter);
+        atomic_fetch_sub_explicit(&queue->blocked_consumers, 1, memory_order_relaxed);
+    }
+
+    size_t available = queue_depth(queue);
+    *position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    return count < (int)available ? count : (int)available;
+}
+
+void mutex_queue_release(struct PCQueue* queue, size_t position, int count) {
+    atomic_store_explicit(&queue->head, position + count, memory_order_relaxed);
+    bool wake = atomic_load_explicit(&queue->blocked_producers, memory_order_relaxed) > 0;
+    if (wake) {
+        atomic_fetch_add_explicit(&queue->producer_wakeups, 1, memory_order_relaxed);
+    }
+    queue_unlock(queue);
+
+    mutex_queue_notify(&queue->not_full, &queue->room, wake, count);
+}
+
+
+//========================================================
+// Lock-free SPSC queue
+//========================================================
+
+// With exactly one producer and one consumer, each index has a single writer, so
+// no read-modify-write operations are needed at all. The release store on the
+// tail publishes the values to the consumer, and the release store on the head
+// hands the slots back to the producer. A batch costs the same single store as
+// one value. Reserving (or acquiring) slots is only a matter of reading the other
+// side's index: the slots are the caller's until it moves its own index past them.
+int spsc_queue_reserve(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    struct Waiter waiter = WAITER_INIT;
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t room;
+
+    while ((room = queue->capacity - (tail - atomic_load_explicit(&queue->head, memory_order_acquire))) == 0) {
+        if (!wait || TerminationRequested) {
+            return 0;
+        }
+        lock_free_wait(queue, &queue->room, queue_full, &waiter);
+    }
+
+    *position = tail;
+    return count < (int)room ? count : (int)room;
+}
+
+void spsc_queue_commit(struct PCQueue* queue, size_t position, int count) {
+    atomic_store_explicit(&queue->tail, position + count, memory_order_release);
+    parking_notify(&queue->items);
+}
+
+int spsc_queue_acquire(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    struct Waiter waiter = WAITER_INIT;
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t available;
+
+    while ((available = atomic_load_explicit(&queue->tail, memory_order_acquire) - head) == 0) {
+        if (!wait || TerminationRequested) {
+            return 0;
+        }
+        lock_free_wait(queue, &queue->items, queue_empty, &waiter);
+    }
+
+    *position = head;
+    return count < (int)available ? count : (int)available;
+}
+
+void spsc_queue_release(struct PCQueue* queue, size_t position, int count) {
+    atomic_store_explicit(&queue->head, position + count, memory_order_release);
+    parking_notify(&queue->room);
+}
+
+
+//========================================================
+// Lock-free MPMC queue
+//========================================================
+
+// Every slot carries a sequence number that tells whose turn it is:
+//   - sequence == position:     the slot is free for the producer holding that ticket.
+//   - sequence == position + 1: the slot holds a value for the consumer holding that ticket.
+// Producers and consumers claim tickets with a CAS on their own position counter
+// (the tail and the head, respectively), then publish the slot to the other side
+// by bumping its sequence number.
+//
+// A batch is claimed with one CAS: the caller first counts how many consecutive
+// slots, starting at its position, are ready for it, then moves the position
+// counter past all of them at once. Between the claim and the publication, the
+// slots belong to the caller alone, which is what lets it work on them in place.
+void mpmc_queue_init(struct PCQueue* queue) {
+    for (size_t i = 0; i < queue->capacity; i++) {
+        atomic_init(&queue_mpmc_slot(queue, i)->sequence, i);
+    }
+}
+
+// Counts how many slots starting at pos have the expected sequence number (pos + i
+// + offset), up to count. Sets *behind when the very first slot is still a lap
+// behind, meaning the queue is full (for producers) or empty (for consumers).
+int mpmc_ready_slots(struct PCQueue* queue, size_t pos, size_t offset, int count, bool* behind) {
+    int ready = 0;
+    *behind = false;
+
+    while (ready < count) {
+        struct MpmcSlot* slot = queue_mpmc_slot(queue, pos + ready);
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(pos + ready + offset);
+
+        if (difference != 0) {
+            *behind = ready == 0 && difference < 0;
+            break;
+        }
+        ready++;
+    }
+
+    return ready;
+}
+
+// Claims up to count slots past the given position counter (offset 0 for the tail,
+// 1 for the head, see mpmc_ready_slots). Waits on the lot while the very first one
+// is not ready, unless told not to wait.
+int mpmc_queue_claim(struct PCQueue* queue, atomic_size_t* counter, size_t offset, struct ParkingLot* lot,
+                     bool (*blocked)(struct PCQueue*), int count, size_t* position, bool wait) {
+    struct Waiter waiter = WAITER_INIT;
+    size_t pos = atomic_load_explicit(counter, memory_order_relaxed);
+
+    for (;;) {
+        bool behind;
+        int claimed = mpmc_ready_slots(queue, pos, offset, count, &behind);
+
+        if (claimed > 0) {
+            if (atomic_compare_exchange_weak_explicit(counter, &pos, pos + claimed,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *position = pos;
+                return claimed;
+            }
+        } else if (behind) {
+            // The slot is still a lap behind: the queue is full (or empty).
+            if (!wait || TerminationRequested) {
+                return 0;
+            }
+            lock_free_wait(queue, lot, blocked, &waiter);
+            pos = atomic_load_explicit(counter, memory_order_relaxed);
+        } else {
+            // Another producer (or consumer) got this ticket first.
+            pos = atomic_load_explicit(counter, memory_order_relaxed);
+        }
+    }
+}
+
+int mpmc_queue_reserve(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    return mpmc_queue_claim(queue, &queue->tail, 0, &queue->room, queue_full, count, position, wait);
+}
+
+void mpmc_queue_commit(struct PCQueue* queue, size_t position, int count) {
+    for (int i = 0; i < count; i++) {
+        atomic_store_explicit(&queue_mpmc_slot(queue, position + i)->sequence, position + i + 1,
+                              memory_order_release);
+    }
+    parking_notify(&queue->items);
+}
+
+int mpmc_queue_acquire(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    return mpmc_queue_claim(queue, &queue->head, 1, &queue->items, queue_empty, count, position, wait);
+}
+
+void mpmc_queue_release(struct PCQueue* queue, size_t position, int count) {
+    for (int i = 0; i < count; i++) {
+        atomic_store_explicit(&queue_mpmc_slot(queue, position + i)->sequence, position + i + queue->capacity,
+                              memory_order_release);
+    }
+    parking_notify(&queue->room);
+}
+
+
+//========================================================
+// Queue interface
+//========================================================
+
+// The largest payload -z accepts.
+#define MAX_PAYLOAD_SIZE ((size_t)64 * 1024)
+
+// Slots are rounded up to a multiple of 8 bytes, so that every item stays aligned.
+size_t queue_slot_size(enum QueueBackend backend, size_t payload_size) {
+    size_t header_size = backend == MpmcBackend ? sizeof(struct MpmcSlot) : sizeof(struct Item);
+    return (header_size + payload_size + 7) & ~(size_t)7;
+}
+
+// The size of a queue of the given (power of two) capacity, ring included, rounded
+// up to whole cache lines: aligned_alloc wants the size to be a multiple of the
+// alignment.
+size_t queue_size(enum QueueBackend backend, size_t capacity, size_t payload_size) {
+    size_t size = sizeof(struct PCQueue) + queue_slot_size(backend, payload_size) * capacity;
+    return (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+// Sets up a queue in memory of queue_size bytes. A shared queue's mutex and condvars
+// work across processes, and its mutex is robust (see recover_queue_mutex).
+void queue_init(struct PCQueue* queue, enum QueueBackend backend, size_t capacity, size_t payload_size,
+                bool shared) {
+    size_t slot_size = queue_slot_size(backend, payload_size);
+    queue->backend = backend;
+    queue->capacity = capacity;
+    queue->mask = capacity - 1;
+    queue->slot_size = slot_size;
+    queue->item_offset = backend == MpmcBackend ? offsetof(struct MpmcSlot, item) : 0;
+    queue->payload_size = payload_size;
+    queue->shared = shared;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->count, 0);
+    atomic_init(&queue->head, 0);
+
+    pthread_mutexattr_t mutex_attributes;
+    pthread_condattr_t condition_attributes;
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_condattr_init(&condition_attributes);
+    if (shared) {
+        pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_condattr_setpshared(&condition_attributes, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&queue->mutex, &mutex_attributes);
+    pthread_cond_init(&queue->not_empty, &condition_attributes);
+    pthread_cond_init(&queue->not_full, &condition_attributes);
+    pthread_condattr_destroy(&condition_attributes);
+    pthread_mutexattr_destroy(&mutex_attributes);
+
+    ticket_lock_init(&queue->ticket);
+    mcs_lock_init(&queue->mcs);
+    atomic_init(&queue->blocked_producers, 0);
+    atomic_init(&queue->blocked_consumers, 0);
+    atomic_init(&queue->producer_wakeups, 0);
+    atomic_init(&queue->consumer_wakeups, 0);
+    parking_init(&queue->room);
+    parking_init(&queue->items);
+
+    // Touch the whole ring now, so that its pages are placed (on first touch) on the
+    // NUMA node of the calling thread, rather than wherever the first push happens.
+    memset(queue->ring, 0, slot_size * capacity);
+    if (backend == MpmcBackend) {
+        mpmc_queue_init(queue);
+    }
+}
+
+// Allocates a queue for the given backend, with its ring in the same allocation.
+// The capacity is rounded up to a power of two.
+struct PCQueue* queue_create(enum QueueBackend backend, size_t requested_capacity, size_t payload_size) {
+    size_t capacity = next_power_of_two(requested_capacity);
+    struct PCQueue* queue = (struct PCQueue*)aligned_alloc(CACHE_LINE_SIZE,
+                                                           queue_size(backend, capacity, payload_size));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue_init(queue, backend, capacity, payload_size, false);
+    return queue;
+}
+
+void queue_destroy(struct PCQueue* queue) {
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue);
+}
+
+// Items are not copied in and out of the queue; they are written and read in place:
+//   - a producer reserves slots, fills in the items (see queue_item) and commits
+//     them, and only then can consumers see them.
+//   - a consumer acquires slots, reads the items and releases them, and only then
+//     can producers reuse them.
+// Reserving (or acquiring) waits until there is room for (or there is) at least one
+// item, and gets as many of the count asked for as are available, from consecutive
+// positions starting at *position. It returns how many; zero only if termination was
+// requested while waiting, or if it was told not to wait (for executor tasks, which
+// must not block) and there was nothing to get. Whatever was reserved (or
+// acquired) must then be committed (or released), and soon: with the mutex backend,
+// the lock is held in between.
+int queue_reserve(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    switch (queue->backend) {
+        case SpscBackend:
+            return spsc_queue_reserve(queue, count, position, wait);
+
+        case MpmcBackend:
+            return mpmc_queue_reserve(queue, count, position, wait);
+
+        default:
+            return mutex_queue_reserve(queue, count, position, wait);
+    }
+}
+
+void queue_commit(struct PCQueue* queue, size_t position, int count) {
+    switch (queue->backend) {
+        case SpscBackend:
+            spsc_queue_commit(queue, position, count);
+            break;
+
+        case MpmcBackend:
+            mpmc_queue_commit(queue, position, count);
+            break;
+
+        default:
+            mutex_queue_commit(queue, position, count);
+    }
+}
+
+int queue_acquire(struct PCQueue* queue, int count, size_t* position, bool wait) {
+    switch (queue->backend) {
+        case SpscBackend:
+            return spsc_queue_acquire(queue, count, position, wait);
+
+        case MpmcBackend:
+            return mpmc_queue_acquire(queue, count, position, wait);
+
+        default:
+            return mutex_queue_acquire(queue, count, position, wait);
+    }
+}
+
+void queue_release(struct PCQueue* queue, size_t position, int count) {
+    switch (queue->backend) {
+        case SpscBackend:
+            spsc_queue_release(queue, position, count);
+            break;
+
+        case MpmcBackend:
+            mpmc_queue_release(queue, position, count);
+            break;
+
+        default:
+            mutex_queue_release(queue, position, count);
+    }
+}
+
+
+//========================================================
+// Shared-memory queues
+//========================================================
+
+// With --shm NAME, the Producer/Consumer queue lives in a POSIX shared memory object
+// instead of the heap, so that the producers and the consumers can be processes of
+// their own: --role producers in one, --role consumers in another, each stopped and
+// restarted on its own while the queue, and whatever is queued, stays put. Items are
+// still written and read in place, so they go from one process to the other without
+// a copy or a system call; only a side that has to block makes one, on a futex or
+// condvar shared between the processes. With the default --role both, the run forks
+// a process for each side and removes the object when they are done; otherwise the
+// object outlives the run, for the next one (remove /dev/shm/NAME to start afresh).
+//
+// Only the mutex backend copes with a process dying in the middle of an operation
+// (see recover_queue_mutex). With the lock-free ones, a producer that dies between
+// a reserve and its commit leaves the consumers waiting on that slot for good.
+enum SharedRole {
+    BothRoles,
+    ProducerRole,
+    ConsumerRole,
+    InvalidRole
+};
+
+enum SharedRole SharedQueueRole = BothRoles;
+
+char* SharedRoleNames[] = {
+        "both",
+        "producers",
+        "consumers",
+        "invalid"
+};
+
+enum SharedRole parse_shared_role(const char* name) {
+    for (int i = 0; i < InvalidRole; i++) {
+        if (strcmp(name, SharedRoleNames[i]) == 0) {
+            return (enum SharedRole)i;
+        }
+    }
+
+    return InvalidRole;
+}
+
+// The name of the object, NULL without --shm.
+char* SharedQueueName = NULL;
+
+// Whoever finds the object already there polls this often, for up to the timeout,
+// until its creator has sized it and set up the queue.
+#define SHARED_QUEUE_POLL_NS (1000 * 1000)
+#define SHARED_QUEUE_ATTACH_TIMEOUT_NS (5 * NANOS_PER_SEC)
+
+// The object starts with this header, on a line of its own, and the queue follows.
+// The creator sets ready last, once the queue is all set up; everyone else checks
+// the parameters against their own before touching the queue.
+struct SharedQueueHeader {
+    _Alignas(CACHE_LINE_SIZE) atomic_int ready;
+    enum QueueBackend backend;
+    size_t capacity;
+    size_t payload_size;
+};
+
+size_t shared_queue_mapping_size(enum QueueBackend backend, size_t capacity, size_t payload_size) {
+    return sizeof(struct SharedQueueHeader) + queue_size(backend, capacity, payload_size);
+}
+
+// Waits for the creator to size the object. Returns its size, or 0 if that did not
+// happen in time.
+size_t shared_queue_wait_sized(int descriptor) {
+    uint64_t deadline = now_ns() + SHARED_QUEUE_ATTACH_TIMEOUT_NS;
+    struct stat status;
+    while (fstat(descriptor, &status) == 0) {
+        if (status.st_size > 0) {
+            return (size_t)status.st_size;
+        }
+        if (now_ns() >= deadline || TerminationRequested) {
+            break;
+        }
+        sleep_until(now_ns() + SHARED_QUEUE_POLL_NS);
+    }
+
+    return 0;
+}
+
+// Maps the object and returns the queue in it, creating and setting it up if the
+// object does not exist yet; *created says which. Returns NULL, after saying why,
+// when the object cannot be opened, or holds a queue other than the one asked for.
+struct PCQueue* shared_queue_open(const char* name, enum QueueBackend backend, size_t requested_capacity,
+                                  size_t payload_size, bool* created) {
+    size_t capacity = next_power_of_two(requested_capacity);
+    size_t size = shared_queue_mapping_size(backend, capacity, payload_size);
+
+    int descriptor = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    *created = descriptor >= 0;
+    if (descriptor < 0 && errno == EEXIST) {
+        descriptor = shm_open(name, O_RDWR, 0);
+    }
+    if (descriptor < 0) {
+        printf("Unable to open the shared memory object %s: %s.\n", name, strerror(errno));
+        return NULL;
+    }
+
+    size_t found = *created ? (ftruncate(descriptor, (off_t)size) == 0 ? size : 0)
+                            : shared_queue_wait_sized(descriptor);
+    void* mapping = found == size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0)
+                                  : MAP_FAILED;
+    close(descriptor);
+
+    if (mapping == MAP_FAILED && *created) {
+        printf("Unable to map %zu bytes of the shared memory object %s.\n", size, name);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    struct SharedQueueHeader* header = (struct SharedQueueHeader*)mapping;
+    struct PCQueue* queue = (struct PCQueue*)(header + 1);
+    if (*created) {
+        header->backend = backend;
+        header->capacity = capacity;
+        header->payload_size = payload_size;
+        queue_init(queue, backend, capacity, payload_size, true);
+        atomic_store_explicit(&header->ready, 1, memory_order_release);
+        return queue;
+    }
+
+    uint64_t deadline = now_ns() + SHARED_QUEUE_ATTACH_TIMEOUT_NS;
+    while (mapping != MAP_FAILED && atomic_load_explicit(&header->ready, memory_order_acquire) == 0 &&
+           now_ns() < deadline && !TerminationRequested) {
+        sleep_until(now_ns() + SHARED_QUEUE_POLL_NS);
+    }
+
+    if (mapping == MAP_FAILED || atomic_load_explicit(&header->ready, memory_order_acquire) == 0 ||
+        header->backend != backend || header->capacity != capacity || header->payload_size != payload_size) {
+        printf("The shared memory object %s does not hold a %s queue of capacity %zu with %zu byte payloads; "
+               "the -Q, -q and --payload options must match those of the process that created it.\n",
+               name, BackendNames[backend], capacity, payload_size);
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, size);
+        }
+        return NULL;
+    }
+
+    return queue;
+}
+
+// Unmaps the queue. The object itself stays, for the other processes and the next
+// run; shm_unlink removes it.
+void shared_queue_close(struct PCQueue* queue) {
+    munmap((struct SharedQueueHeader*)queue - 1,
+           shared_queue_mapping_size(queue->backend, queue->capacity, queue->payload_size));
+}
+
+
+//========================================================
+// Producer/Consumer tasks
+//========================================================
+
+// Per-thread bookkeeping for producers and consumers. Each one sits on its own cache
+// line, since its owner updates it continuously during a benchmark run.
+struct ProdConActor {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    // The instance the actor belongs to. Pipeline workers have none.
+    struct ProdConModel* model;
+
+    // The shard a producer writes to, or where a consumer starts looking.
+    int shard;
+
+    long items;
+    uint64_t elapsed_ns;
+
+    // Consumers only, and only in benchmark mode: enqueue-to-dequeue latencies.
+    struct Histogram* latency;
+
+    // Consumers only: a running sum of every payload read, so that the reads
+    // cannot be optimized away.
+    uint64_t checksum;
+
+    // Consumers only, with --shards: how many of the items were taken from shards
+    // the consumer does not own.
+    long stolen;
+
+    // Consumers only, with --drain: how many of the items were taken after the
+    // termination request.
+    long drained;
+
+    // Consumers only, with --lanes: the lane being served in weighted round-robin and
+    // the batches it has left this turn, and in benchmark mode a latency histogram
+    // per lane (instead of the one above).
+    int lane;
+    long lane_credit;
+    struct Histogram* lane_latency;
+};
+
+// With --drain, consumers do not stop at the termination request: they go on, at
+// full speed, until the producers are all gone and the queues are empty.
+bool DrainOnShutdown = false;
+
+// Everything the actors of one Producer/Consumer instance share. None of it is
+// global, so that with --instances each instance only ever touches its own queues
+// and counters. It starts on a line of its own, like the actors.
+struct ProdConModel {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    // The placement slot of the instance's first actor. Instances take consecutive
+    // runs of slots, one per actor.
+    int first_slot;
+
+    // The queues between the producers and the consumers: a single one shared by
+    // all of them, one per producer with --shards, or one per lane with --lanes.
+    struct PCQueue** shards;
+    int shard_count;
+
+    // Consumers of sharded queues never sleep on a single shard, as items may show
+    // up in any of them; they park here instead, and producers notify it on every
+    // commit.
+    struct ParkingLot shard_items;
+
+    // Items consumed so far, across all consumers. Only kept when the benchmark
+    // runs for a fixed number of items.
+    atomic_long consumed_items;
+
+    // Producers count themselves out here as they leave, so that draining
+    // consumers know when nothing more is coming.
+    atomic_int active_producers;
+
+    struct ProdConActor* producers;
+    struct ProdConActor* consumers;
+    pthread_t* producer_threads;
+    pthread_t* consumer_threads;
+
+    // Where the shard list, the actors, their threads' handles and the consumers'
+    // histograms come from. The queues are allocated on their own, each on the CPU of
+    // its first producer (or in shared memory).
+    struct Arena arena;
+
+    // With --executor pool, the instance's own executor and the tasks it runs.
+    struct Executor* executor;
+    struct ProdConTask* tasks;
+};
+
+// Wakes every thread asleep on the queue, so that it notices a termination request.
+void wake_queue(struct PCQueue* queue) {
+    recover_queue_mutex(queue, lock_mutex(&queue->mutex));
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    unlock_mutex(&queue->mutex);
+
+    parking_wake_all(&queue->room);
+    parking_wake_all(&queue->items);
+}
+
+// Sets the termination flag and makes sure no thread of the instance stays asleep
+// on any of its queues.
+void request_prodcon_termination(struct ProdConModel* model) {
+    request_termination();
+
+    for (int i = 0; i < model->shard_count; i++) {
+        wake_queue(model->shards[i]);
+    }
+    parking_wake_all(&model->shard_items);
+}
+
+// A batch of values a producer has taken from its shard's counter, and how many of
+// them it has put in the queue so far.
+struct Batch {
+    int shard;
+    long first;
+    int count;
+    int written;
+};
+
+// Each shard counts on its own, and the value of its nth item is
+// n * shard_count + shard, so values stay unique across shards. That gives shard k
+// every shard_count-th value from k on, and so its share of BenchItems.
+long shard_value(struct ProdConModel* model, int shard, long index) {
+    return index * model->shard_count + shard;
+}
+
+long shard_item_limit(struct ProdConModel* model, int shard) {
+    return (BenchItems - shard + model->shard_count - 1) / model->shard_count;
+}
+
+// Takes the shard's next BatchSize values (fewer when the benchmark is about to run
+// out of items). Returns false when there are no more items to produce.
+bool next_batch(struct ProdConModel* model, int shard, struct Batch* batch) {
+    long first = atomic_fetch_add_explicit(&model->shards[shard]->count, BatchSize, memory_order_relaxed);
+    int count = BatchSize;
+    if (BenchItems > 0) {
+        long limit = shard_item_limit(model, shard);
+        if (first >= limit) {
+            return false;
+        }
+        if (first + count > limit) {
+            count = (int)(limit - first);
+        }
+    }
+
+    batch->shard = shard;
+    batch->first = first;
+    batch->count = count;
+    batch->written = 0;
+
+    return true;
+}
+
+// Stands in for writing a real message: every payload byte gets written.
+void write_item(struct PCQueue* queue, struct Item* item, long value, uint64_t timestamp) {
+    item->value = value;
+    item->enqueued_ns = timestamp;
+    memset(item_payload(item), (unsigned char)value, queue->payload_size);
+}
+
+// Stands in for reading a real message: every payload byte gets read.
+uint64_t payload_checksum(struct PCQueue* queue, struct Item* item) {
+    const unsigned char* payload = item_payload(item);
+    size_t size = queue->payload_size;
+    uint64_t sum = 0;
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, payload + i, sizeof(word));
+        sum += word;
+    }
+    for (; i < size; i++) {
+        sum += payload[i];
+    }
+
+    return sum;
+}
+
+// Writes as many of the batch's outstanding values as the queue will take, in
+// place, and commits them. The queue may take a batch in several pieces when it
+// is nearly full. Returns how many got in.
+int write_batch(struct ProdConActor* actor, struct Batch* batch, bool wait) {
+    struct ProdConModel* model = actor->model;
+    struct PCQueue* queue = model->shards[batch->shard];
+    size_t position;
+    int reserved = queue_reserve(queue, batch->count - batch->written, &position, wait);
+    if (reserved == 0) {
+        return 0;
+    }
+
+    long first = batch->first + batch->written;
+    uint64_t timestamp = BenchMode ? now_ns() : 0;
+    for (int i = 0; i < reserved; i++) {
+        write_item(queue, queue_item(queue, position + i), shard_value(model, batch->shard, first + i), timestamp);
+    }
+    queue_commit(queue, position, reserved);
+    if (Sharded || LaneCount > 1) {
+        parking_notify(&model->shard_items);
+    }
+
+    for (int i = 0; i < reserved; i++) {
+        log_event(ProducedEvent, shard_value(model, batch->shard, first + i));
+    }
+    batch->written += reserved;
+    actor->items += reserved;
+
+    return reserved;
+}
+
+// Takes up to BatchSize items off the given queue of the instance, reads them in
+// place and releases their slots; then ends a benchmark that has consumed all of its
+// items. Returns how many were taken.
+int read_batch(struct ProdConActor* actor, int shard, bool wait) {
+    struct PCQueue* queue = actor->model->shards[shard];
+    struct Histogram* latency = actor->lane_latency != NULL ? &actor->lane_latency[shard] : actor->latency;
+    size_t position;
+    int acquired = queue_acquire(queue, BatchSize, &position, wait);
+    if (acquired == 0) {
+        return 0;
+    }
+
+    uint64_t now = BenchMode ? now_ns() : 0;
+    uint64_t checksum = actor->checksum;
+    for (int i = 0; i < acquired; i++) {
+        struct Item* item = queue_item(queue, position + i);
+        log_event(ConsumedEvent, item->value);
+        if (BenchMode) {
+            histogram_record(latency, now - item->enqueued_ns);
+        }
+        checksum += payload_checksum(queue, item);
+    }
+    queue_release(queue, position, acquired);
+
+    actor->checksum = checksum;
+    actor->items += acquired;
+
+    if (BenchMode && BenchItems > 0 &&
+        atomic_fetch_add_explicit(&actor->model->consumed_items, acquired, memory_order_relaxed) + acquired >=
+        BenchItems) {
+        request_prodcon_termination(actor->model);
+    }
+
+    return acquired;
+}
+
+
+//========================================================
+// Priority lanes
+//========================================================
+
+// With --lanes, say 1:9, the items come in classes, lane 0 being the most urgent,
+// and each lane is a queue of its own of the -Q backend: the producers draw a lane
+// for each batch, in proportion to the shares given (here one batch in ten goes to
+// lane 0), and the consumers take from the lanes by --lane-policy:
+//   - strict: always from the most urgent lane that has anything. Urgent items
+//             never wait behind bulk ones, but bulk ones starve while urgent
+//             traffic keeps the consumers busy.
+//   - wrr:    weighted round-robin. Each lane in turn gets up to its --lane-weights
+//             batches (one each by default) before the next, skipping empty ones,
+//             so that every lane gets its share of the consumers.
+// Like consumers of shards, consumers of lanes park on the instance's shard_items
+// lot when every lane is empty. In benchmark mode, the report gives the latency
+// percentiles of each lane, so that the urgent lane's can be watched while bulk
+// traffic saturates the consumers.
+enum LanePolicy {
+    StrictLanes,
+    WeightedLanes,
+    InvalidLanes
+};
+
+enum LanePolicy LaneScheduling = StrictLanes;
+
+char* LanePolicyNames[] = {
+        "strict",
+        "wrr",
+        "invalid"
+};
+
+enum LanePolicy parse_lane_policy(const char* name) {
+    for (int i = 0; i < InvalidLanes; i++) {
+        if (strcmp(name, LanePolicyNames[i]) == 0) {
+            return (enum LanePolicy)i;
+        }
+    }
+
+    return InvalidLanes;
+}
+
+// The batches each lane may give a consumer per turn under wrr. Without
+// --lane-weights, one each (see validate_options).
+long LaneWeights[MAX_LANES];
+int LaneWeightCount = 0;
+
+long LaneShareTotal = 1;
+
+// The queue a producer's next batch goes to: with --lanes, a lane drawn at random by
+// the lanes' shares; otherwise its own shard (the only queue, without --shards).
+int next_queue(struct ProdConActor* actor) {
+    if (LaneCount == 1) {
+        return actor->shard;
+    }
+
+    long draw = (long)random_below((uint64_t)LaneShareTotal);
+    int lane = 0;
+    while (draw >= LaneShares[lane]) {
+        draw -= LaneShares[lane++];
+    }
+
+    return lane;
+}
+
+// Tries the lanes in the order the policy says. Never waits, and skips the lanes
+// that look empty without touching their locks. Returns how many items were taken.
+int read_lanes(struct ProdConActor* actor) {
+    struct ProdConModel* model = actor->model;
+
+    if (LaneScheduling == StrictLanes) {
+        for (int lane = 0; lane < LaneCount; lane++) {
+            if (!queue_empty(model->shards[lane])) {
+                int acquired = read_batch(actor, lane, false);
+                if (acquired > 0) {
+                    return acquired;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // One more than a full turn, so that the lane the turn started on gets another
+    // go once its credit has been topped up.
+    for (int i = 0; i <= LaneCount; i++) {
+        if (actor->lane_credit > 0 && !queue_empty(model->shards[actor->lane])) {
+            int acquired = read_batch(actor, actor->lane, false);
+            if (acquired > 0) {
+                actor->lane_credit--;
+                return acquired;
+            }
+        }
+
+        actor->lane = (actor->lane + 1) % LaneCount;
+        actor->lane_credit = LaneWeights[actor->lane];
+    }
+
+    return 0;
+}
+
+// Prints a list of lane values, such as 1:9.
+void print_lane_list(const long* values) {
+    for (int i = 0; i < LaneCount; i++) {
+        printf("%s%ld", i > 0 ? ":" : "", values[i]);
+    }
+}
+
+
+//========================================================
+// Sharded queues
+//========================================================
+
+// With a single queue, every producer fights over its tail (and every consumer over
+// its head), whatever the backend. With --shards, each producer has a queue of its
+// own, so producers never touch each other's lines. Each consumer owns some of the
+// shards and drains them first; only when they are all empty does it go and steal
+// from the other shards, so that no items are left behind on shards whose owners
+// are busy (or that have no owner, with fewer consumers than producers).
+
+// With at least as many shards as consumers, consumer j owns shards j, j + c, j + 2c
+// and so on. With fewer, shard j % shard_count is shared by several consumers.
+bool consumer_owns_shard(struct ProdConModel* model, int consumer, int shard) {
+    if (model->shard_count >= ConsumerCount) {
+        return shard % ConsumerCount == consumer;
+    }
+
+    return shard == consumer % model->shard_count;
+}
+
+// Tries the consumer's own shards and then the others, starting after its first
+// one so that idle consumers do not all raid the same shard. Never waits. Shards
+// that look empty are skipped without touching their locks. Returns how many items
+// were taken.
+int read_shards(struct ProdConActor* actor) {
+    struct ProdConModel* model = actor->model;
+    int shard_count = model->shard_count;
+
+    for (int i = 0; i < shard_count; i++) {
+        int shard = (actor->shard + i) % shard_count;
+        if (consumer_owns_shard(model, actor->id, shard) && !queue_empty(model->shards[shard])) {
+            int acquired = read_batch(actor, shard, false);
+            if (acquired > 0) {
+                return acquired;
+            }
+        }
+    }
+
+    for (int i = 1; i <= shard_count; i++) {
+        int shard = (actor->shard + i) % shard_count;
+        if (!consumer_owns_shard(model, actor->id, shard) && !queue_empty(model->shards[shard])) {
+            int acquired = read_batch(actor, shard, false);
+            if (acquired > 0) {
+                actor->stolen += acquired;
+                return acquired;
+            }
+        }
+    }
+
+    return 0;
+}
+
+bool all_shards_empty(struct ProdConModel* model) {
+    for (int i = 0; i < model->shard_count; i++) {
+        if (!queue_empty(model->shards[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// What a consumer calls to take its next batch, from one queue, shards or lanes.
+// Waiting on several queues is done here, as the backends can only wait on one
+// queue at a time.
+int consume_batch(struct ProdConActor* actor, bool wait) {
+    struct ProdConModel* model = actor->model;
+    if (!Sharded && LaneCount == 1) {
+        return read_batch(actor, 0, wait);
+    }
+
+    struct Waiter waiter = WAITER_INIT;
+    while (true) {
+        int acquired = Sharded ? read_shards(actor) : read_lanes(actor);
+        if (acquired > 0 || !wait || TerminationRequested) {
+            return acquired;
+        }
+
+        if (wait_step(&waiter)) {
+            int key = parking_prepare(&model->shard_items);
+            if (all_shards_empty(model) && !TerminationRequested) {
+                parking_park(&model->shard_items, key);
+            } else {
+                parking_cancel(&model->shard_items);
+            }
+        }
+    }
+}
+
+// Takes one more batch while draining, without waiting. Returns false once the
+// queues are known to be empty for good: no producer was left when the attempt
+// started (so everything they committed on their way out is in) and it found
+// nothing.
+bool drain_batch(struct ProdConActor* actor) {
+    bool producing = atomic_load(&actor->model->active_producers) > 0;
+    int acquired = consume_batch(actor, false);
+    actor->drained += acquired;
+    if (acquired == 0 && producing && Execution == ThreadExecutor) {
+        sched_yield();
+    }
+
+    return acquired > 0 || producing;
+}
+
+void* produce(void* actor_info) {
+    struct ProdConActor* actor = (struct ProdConActor*)actor_info;
+    int my_id = actor->id;
+    printf("Starting producer %d\n", my_id);
+    event_log_open(my_id);
+    counters_open();
+    random_seed_thread(ProducerStream, my_id);
+
+    struct Batch batch;
+    uint64_t start = now_ns();
+
+    while (!TerminationRequested) {
+        if (!BenchMode) {
+            random_sleep(PROD_CON_MAX_SLEEP_TIME_MS);
+        }
+
+        if (!next_batch(actor->model, next_queue(actor), &batch)) {
+            break;
+        }
+
+        while (batch.written < batch.count && write_batch(actor, &batch, true) > 0) {
+            // Keep going until the whole batch is in.
+        }
+    }
+
+    actor->elapsed_ns = now_ns() - start;
+    atomic_fetch_sub(&actor->model->active_producers, 1);
+    printf("Producer %d exiting.\n", my_id);
+
+    return NULL;
+}
+
+void* consume(void* actor_info) {
+    struct ProdConActor* actor = (struct ProdConActor*)actor_info;
+    int my_id = actor->id;
+    printf("Starting consumer %d\n", my_id);
+    event_log_open(my_id);
+    counters_open();
+    random_seed_thread(ConsumerStream, my_id);
+
+    uint64_t start = now_ns();
+
+    while (!TerminationRequested) {
+        if (!BenchMode) {
+            random_sleep(PROD_CON_MAX_SLEEP_TIME_MS);
+        }
+
+        consume_batch(actor, true);
+    }
+
+    while (DrainOnShutdown && drain_batch(actor)) {
+        // Keep going until there is nothing left.
+    }
+
+    actor->elapsed_ns = now_ns() - start;
+    printf("Consumer %d exiting.\n", my_id);
+
+    return NULL;
+}
+
+
+//========================================================
+// Producer/Consumer executor tasks
+//========================================================
+
+// On the executor, producers and consumers are tasks that reserve (or acquire)
+// without waiting. A producer's batch may take several steps to get into the queue,
+// so the task keeps it between steps.
+struct ProdConTask {
+    struct Task task;
+
+    struct ProdConActor* actor;
+    uint64_t start;
+
+    struct Batch batch;
+};
+
+// Outside of benchmark mode, actors take a random nap between trips to the queue.
+void prodcon_task_nap(struct Task* task) {
+    if (!BenchMode) {
+        task->wake_ns = now_ns() + random_below(PROD_CON_MAX_SLEEP_TIME_MS) * 1000000;
+    }
+}
+
+enum TaskStatus finish_prodcon_task(struct ProdConTask* prodcon) {
+    prodcon->actor->elapsed_ns = now_ns() - prodcon->start;
+    return TaskDone;
+}
+
+enum TaskStatus finish_producer_task(struct ProdConTask* producer) {
+    atomic_fetch_sub(&producer->actor->model->active_producers, 1);
+    return finish_prodcon_task(producer);
+}
+
+enum TaskStatus produce_step(struct Task* task) {
+    struct ProdConTask* producer = (struct ProdConTask*)task;
+    struct Batch* batch = &producer->batch;
+
+    if (batch->written == batch->count) {
+        if (TerminationRequested || !next_batch(producer->actor->model, next_queue(producer->actor), batch)) {
+            return finish_producer_task(producer);
+        }
+    }
+
+    if (write_batch(producer->actor, batch, false) == 0) {
+        return TerminationRequested ? finish_producer_task(producer) : TaskStalled;
+    }
+
+    if (batch->written == batch->count) {
+        prodcon_task_nap(task);
+    }
+    return TaskProgressed;
+}
+
+enum TaskStatus consume_step(struct Task* task) {
+    struct ProdConTask* consumer = (struct ProdConTask*)task;
+
+    if (TerminationRequested && DrainOnShutdown) {
+        return drain_batch(consumer->actor) ? TaskProgressed : finish_prodcon_task(consumer);
+    }
+    if (TerminationRequested) {
+        return finish_prodcon_task(consumer);
+    }
+
+    if (consume_batch(consumer->actor, false) == 0) {
+        return TaskStalled;
+    }
+
+    prodcon_task_nap(task);
+    return TaskProgressed;
+}
+
+// Builds a task for each of the instance's producers and consumers (consumers first,
+// as with threads) and starts them on an executor of its own. The tasks must be
+// freed after executor_join.
+void start_prodcon_tasks(struct ProdConModel* model) {
+    struct ProdConActor* producers = model->producers;
+    struct ProdConActor* consumers = model->consumers;
+    int count = ProducerCount + ConsumerCount;
+    struct ProdConTask* prodcon = (struct ProdConTask*)calloc(count, sizeof(struct ProdConTask));
+    struct Task** queue = (struct Task**)malloc(sizeof(struct Task*) * count);
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < count; i++) {
+        bool consumer = i < ConsumerCount;
+        prodcon[i].actor = consumer ? &consumers[i] : &producers[i - ConsumerCount];
+        prodcon[i].task.step = consumer ? consume_step : produce_step;
+        prodcon[i].task.id = prodcon[i].actor->id;
+        prodcon[i].start = start;
+        queue[i] = &prodcon[i].task;
+    }
+
+    model->executor = executor_start(queue, count);
+    free(queue);
+
+    model->tasks = prodcon;
+}
+
+
+//========================================================
+// Producer/Consumer benchmark report
+//========================================================
+
+// Whatever the strategy, what was still queued when the last thread left is lost.
+void report_queue_shutdown(long drained, struct PCQueue** queues, int queue_count) {
+    size_t left = 0;
+    for (int i = 0; i < queue_count; i++) {
+        left += queue_depth(queues[i]);
+    }
+
+    if (DrainOnShutdown) {
+        printf("Drained %ld items on the way out, %zu left in the queues.\n", drained, left);
+    } else {
+        printf("%zu items left in the queues.\n", left);
+    }
+}
+
+// Across all the instances, when there are several.
+void report_prodcon_shutdown(struct ProdConModel* models, int count) {
+    long drained = 0;
+    int queue_count = 0;
+    struct PCQueue** queues = (struct PCQueue**)malloc(sizeof(struct PCQueue*) * count * models[0].shard_count);
+    for (int m = 0; m < count; m++) {
+        for (int i = 0; i < ConsumerCount; i++) {
+            drained += models[m].consumers[i].drained;
+        }
+        for (int i = 0; i < models[m].shard_count; i++) {
+            queues[queue_count++] = models[m].shards[i];
+        }
+    }
+
+    report_queue_shutdown(drained, queues, queue_count);
+    free(queues);
+}
+
+double items_per_sec(long items, uint64_t elapsed_ns) {
+    return elapsed_ns > 0 ? (double)items * (double)NANOS_PER_SEC / (double)elapsed_ns : 0.0;
+}
+
+// Each lane's latencies, across the consumers, which it also adds to the overall
+// ones.
+void report_lanes(struct ProdConModel* model, struct Histogram* overall) {
+    struct Histogram* lane = (struct Histogram*)malloc(sizeof(struct Histogram));
+    for (int l = 0; l < LaneCount; l++) {
+        memset(lane, 0, sizeof(struct Histogram));
+        for (int i = 0; i < ConsumerCount; i++) {
+            histogram_merge(lane, &model->consumers[i].lane_latency[l]);
+        }
+        histogram_merge(overall, lane);
+
+        char label[64];
+        snprintf(label, sizeof(label), "Lane %d (share %ld) latency", l, LaneShares[l]);
+        print_latency_percentiles(label, lane);
+    }
+    free(lane);
+}
+
+void report_prodcon(struct ProdConModel* model, uint64_t elapsed_ns) {
+    struct ProdConActor* producers = model->producers;
+    struct ProdConActor* consumers = model->consumers;
+    event_log_drain();
+    if (InstanceCount > 1) {
+        printf("\nInstance %d benchmark results over %.3f s:\n", model->id, (double)elapsed_ns / (double)NANOS_PER_SEC);
+    } else {
+        printf("\nBenchmark results over %.3f s:\n", (double)elapsed_ns / (double)NANOS_PER_SEC);
+    }
+
+    long produced = 0;
+    for (int i = 0; i < ProducerCount; i++) {
+        if (ProducerCount <= MAX_REPORTED_ACTORS) {
+            printf("  Producer %d: %ld items, %.0f items/sec\n",
+                   i, producers[i].items, items_per_sec(producers[i].items, producers[i].elapsed_ns));
+        }
+        produced += producers[i].items;
+    }
+
+    long consumed = 0;
+    long stolen = 0;
+    struct Histogram* latency = (struct Histogram*)calloc(1, sizeof(struct Histogram));
+    for (int i = 0; i < ConsumerCount; i++) {
+        if (ConsumerCount <= MAX_REPORTED_ACTORS) {
+            printf("  Consumer %d: %ld items, %.0f items/sec",
+                   i, consumers[i].items, items_per_sec(consumers[i].items, consumers[i].elapsed_ns));
+            if (Sharded) {
+                printf(", %ld stolen", consumers[i].stolen);
+            }
+            printf("\n");
+        }
+        consumed += consumers[i].items;
+        stolen += consumers[i].stolen;
+        if (LaneCount == 1) {
+            histogram_merge(latency, consumers[i].latency);
+        }
+    }
+
+    // A process that only runs the producers of a shared queue can only tell how fast
+    // they went.
+    long delivered = SharedQueueRole == ProducerRole ? produced : consumed;
+    printf("  Total: %ld items produced, %ld consumed, %.0f items/sec\n",
+           produced, consumed, items_per_sec(delivered, elapsed_ns));
+    if (Sharded) {
+        printf("  Shards: %ld items taken locally, %ld stolen (%.1f%%)\n",
+               consumed - stolen, stolen, consumed > 0 ? 100.0 * (double)stolen / (double)consumed : 0.0);
+    }
+    if (PayloadSize > 0) {
+        printf("  Payload: %.1f MB/sec\n",
+               items_per_sec(delivered, elapsed_ns) * (double)PayloadSize / 1E6);
+    }
+    if (LaneCount > 1) {
+        report_lanes(model, latency);
+    }
+    if (SharedQueueRole != ProducerRole) {
+        print_latency_percentiles("Enqueue to dequeue latency", latency);
+    }
+    record_run(delivered, elapsed_ns, latency);
+
+    free(latency);
+}
+
+
+//========================================================
+// Queue telemetry
+//========================================================
+
+// With --telemetry, a sampler thread wakes up every --sample-ms milliseconds and
+// reads, across all the queues of the run, how many items are queued, how many
+// producers and consumers are blocked, and how many times blocked ones were woken
+// since the last sample. It only ever reads counters the queues keep anyway, so it
+// costs the actors nothing but the odd cache miss. The samples go into histograms
+// that are printed when the run ends (on SIGINT as well), and with csv or json
+// each sample is also streamed as a line, to standard output or --telemetry-file.
+//
+// The blocked counts and wakeups come from the condvar bookkeeping with the mutex
+// backend, and from the parking lots with the lock-free ones, whose sequence
+// numbers are bumped once per wakeup.
+enum TelemetryMode {
+    NoTelemetry,
+    SummaryTelemetry,
+    CsvTelemetry,
+    JsonTelemetry,
+    InvalidTelemetry
+};
+
+enum TelemetryMode TelemetryOutput = NoTelemetry;
+
+char* TelemetryModeNames[] = {
+        "none",
+        "summary",
+        "csv",
+        "json",
+        "invalid"
+};
+
+enum TelemetryMode parse_telemetry_mode(const char* name) {
+    for (int i = 0; i < InvalidTelemetry; i++) {
+        if (strcmp(name, TelemetryModeNames[i]) == 0) {
+            return (enum TelemetryMode)i;
+        }
+    }
+
+    return InvalidTelemetry;
+}
+
+#define MAX_SAMPLE_INTERVAL_MS 10000.0
+
+double SampleIntervalMs = 10.0;
+char* TelemetryPath = NULL;
+
+// What one sample reads, summed over the queues.
+struct QueueGauges {
+    size_t depth;
+    size_t capacity;
+    int blocked_producers;
+    int blocked_consumers;
+    uint64_t producer_wakeups;
+    uint64_t consumer_wakeups;
+};
+
+struct Telemetry {
+    pthread_t thread;
+    atomic_bool running;
+
+    struct PCQueue** queues;
+    int queue_count;
+
+    // Where sharded consumers sleep, if they do.
+    struct ParkingLot* consumer_lot;
+
+    FILE* stream;
+    uint64_t start_ns;
+    struct QueueGauges last;
+
+    uint64_t samples;
+    struct Histogram depth;
+    struct Histogram blocked_producers;
+    struct Histogram blocked_consumers;
+    struct Histogram producer_wakeups;
+    struct Histogram consumer_wakeups;
+};
+
+void read_queue_gauges(struct Telemetry* telemetry, struct QueueGauges* gauges) {
+    memset(gauges, 0, sizeof(struct QueueGauges));
+
+    for (int i = 0; i < telemetry->queue_count; i++) {
+        struct PCQueue* queue = telemetry->queues[i];
+        gauges->depth += queue_depth(queue);
+        gauges->capacity += queue->capacity;
+
+        if (queue->backend == MutexBackend) {
+            gauges->blocked_producers += atomic_load_explicit(&queue->blocked_producers, memory_order_relaxed);
+            gauges->blocked_consumers += atomic_load_explicit(&queue->blocked_consumers, memory_order_relaxed);
+            gauges->producer_wakeups += atomic_load_explicit(&queue->producer_wakeups, memory_order_relaxed);
+            gauges->consumer_wakeups += atomic_load_explicit(&queue->consumer_wakeups, memory_order_relaxed);
+        } else {
+            gauges->blocked_producers += atomic_load_explicit(&queue->room.sleepers, memory_order_relaxed);
+            gauges->blocked_consumers += atomic_load_explicit(&queue->items.sleepers, memory_order_relaxed);
+            gauges->producer_wakeups += (unsigned)atomic_load_explicit(&queue->room.sequence, memory_order_relaxed);
+            gauges->consumer_wakeups += (unsigned)atomic_load_explicit(&queue->items.sequence, memory_order_relaxed);
+        }
+    }
+
+    struct ParkingLot* lot = telemetry->consumer_lot;
+    if (lot != NULL) {
+        gauges->blocked_consumers += atomic_load_explicit(&lot->sleepers, memory_order_relaxed);
+        gauges->consumer_wakeups += (unsigned)atomic_load_explicit(&lot->sequence, memory_order_relaxed);
+    }
+}
+
+void telemetry_sample(struct Telemetry* telemetry) {
+    struct QueueGauges gauges;
+    read_queue_gauges(telemetry, &gauges);
+
+    uint64_t producer_wakeups = gauges.producer_wakeups - telemetry->last.producer_wakeups;
+    uint64_t consumer_wakeups = gauges.consumer_wakeups - telemetry->last.consumer_wakeups;
+    telemetry->last = gauges;
+
+    telemetry->samples++;
+    histogram_record(&telemetry->depth, gauges.depth);
+    histogram_record(&telemetry->blocked_producers, (uint64_t)gauges.blocked_producers);
+    histogram_record(&telemetry->blocked_consumers, (uint64_t)gauges.blocked_consumers);
+    histogram_record(&telemetry->producer_wakeups, producer_wakeups);
+    histogram_record(&telemetry->consumer_wakeups, consumer_wakeups);
+
+    double time_ms = (double)(now_ns() - telemetry->start_ns) / 1E6;
+    if (TelemetryOutput == CsvTelemetry) {
+        fprintf(telemetry->stream, "%.3f,%zu,%zu,%d,%d,%llu,%llu\n",
+                time_ms, gauges.depth, gauges.capacity, gauges.blocked_producers, gauges.blocked_consumers,
+                (unsigned long long)producer_wakeups, (unsigned long long)consumer_wakeups);
+    } else if (TelemetryOutput == JsonTelemetry) {
+        fprintf(telemetry->stream,
+                "{\"time_ms\": %.3f, \"depth\": %zu, \"capacity\": %zu, \"blocked_producers\": %d, "
+                "\"blocked_consumers\": %d, \"producer_wakeups\": %llu, \"consumer_wakeups\": %llu}\n",
+                time_ms, gauges.depth, gauges.capacity, gauges.blocked_producers, gauges.blocked_consumers,
+                (unsigned long long)producer_wakeups, (unsigned long long)consumer_wakeups);
+    }
+}
+
+// The sampler keeps going after a termination request, until telemetry_stop, so
+// that it sees the queues drain. It sleeps on absolute deadlines, so that the time
+// spent sampling does not make the interval drift.
+void* run_telemetry(void* telemetry_info) {
+    struct Telemetry* telemetry = (struct Telemetry*)telemetry_info;
+    uint64_t interval_ns = (uint64_t)(SampleIntervalMs * 1E6);
+    uint64_t next = telemetry->start_ns;
+
+    while (atomic_load(&telemetry->running)) {
+        telemetry_sample(telemetry);
+
+        next += interval_ns;
+        struct timespec deadline = {(time_t)(next / NANOS_PER_SEC), (long)(next % NANOS_PER_SEC)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+            // Keep sleeping.
+        }
+    }
+
+    return NULL;
+}
+
+// Starts sampling the given queues, and consumer_lot if not NULL. Returns NULL when
+// telemetry is off, or when the stream cannot be opened.
+struct Telemetry* telemetry_start(struct PCQueue** queues, int queue_count, struct ParkingLot* consumer_lot) {
+    if (TelemetryOutput == NoTelemetry) {
+        return NULL;
+    }
+
+    FILE* stream = stdout;
+    if (TelemetryPath != NULL && TelemetryOutput != SummaryTelemetry) {
+        stream = fopen(TelemetryPath, "w");
+        if (stream == NULL) {
+            printf("Unable to open %s for the telemetry: %s.\n", TelemetryPath, strerror(errno));
+            return NULL;
+        }
+        setvbuf(stream, NULL, _IOLBF, 0);
+    }
+
+    struct Telemetry* telemetry = (struct Telemetry*)calloc(1, sizeof(struct Telemetry));
+    telemetry->queues = queues;
+    telemetry->queue_count = queue_count;
+    telemetry->consumer_lot = consumer_lot;
+    telemetry->stream = stream;
+    telemetry->start_ns = now_ns();
+    read_queue_gauges(telemetry, &telemetry->last);
+    atomic_init(&telemetry->running, true);
+
+    if (TelemetryOutput == CsvTelemetry) {
+        fprintf(stream, "time_ms,depth,capacity,blocked_producers,blocked_consumers,"
+                        "producer_wakeups,consumer_wakeups\n");
+    }
+
+    pthread_create(&telemetry->thread, NULL, run_telemetry, telemetry);
+
+    return telemetry;
+}
+
+// Stops the sampler, prints the summary and frees it all. Does nothing for NULL.
+void telemetry_stop(struct Telemetry* telemetry) {
+    if (telemetry == NULL) {
+        return;
+    }
+
+    atomic_store(&telemetry->running, false);
+    pthread_join(telemetry->thread, NULL);
+    if (telemetry->stream != stdout) {
+        fclose(telemetry->stream);
+    }
+
+    event_log_drain();
+    printf("\nQueue telemetry, %llu samples every %.1f ms:\n",
+           (unsigned long long)telemetry->samples, SampleIntervalMs);
+    printf("  Capacity: %zu slots\n", telemetry->last.capacity);
+    print_count_percentiles("Queued items", &telemetry->depth);
+    print_count_percentiles("Blocked producers", &telemetry->blocked_producers);
+    print_count_percentiles("Blocked consumers", &telemetry->blocked_consumers);
+    print_count_percentiles("Producer wakeups per sample", &telemetry->producer_wakeups);
+    print_count_percentiles("Consumer wakeups per sample", &telemetry->consumer_wakeups);
+
+    free(telemetry);
+}
+
+
+//========================================================
+// Producer/Consumer runner
+//========================================================
+
+void destroy_prodcon(struct ProdConModel* model) {
+    for (int i = 0; i < model->shard_count; i++) {
+        if (model->shards[i]->shared) {
+            shared_queue_close(model->shards[i]);
+        } else {
+            queue_destroy(model->shards[i]);
+        }
+    }
+
+    free(model->tasks);
+    arena_release(&model->arena);
+
+    memset(model, 0, sizeof(struct ProdConModel));
+}
+
+// Builds the instance's queues and bookkeeping. Returns false when a queue or the
+// arena cannot be allocated; destroy_prodcon must be called either way.
+bool create_prodcon(struct ProdConModel* model, int id) {
+    memset(model, 0, sizeof(struct ProdConModel));
+    model->id = id;
+    model->first_slot = id * (ProducerCount + ConsumerCount);
+    parking_init(&model->shard_items);
+    atomic_init(&model->consumed_items, 0);
+    atomic_init(&model->active_producers, ProducerCount);
+
+    // Producer i and consumer i take adjacent placement slots, so that with compact
+    // placement each pair shares a core (or at least a cache). Whoever is left over
+    // once the pairs run out takes the following slots.
+    int pairs = ProducerCount < ConsumerCount ? ProducerCount : ConsumerCount;
+
+    // Each thread gets its own bookkeeping slot; handing out the address of the
+    // loop counter as the id would let it change before the thread gets to read it.
+    // With the executor there can be far too many of them for the stack.
+    int shard_count = Sharded ? ProducerCount : LaneCount;
+    size_t size = arena_bytes(sizeof(struct PCQueue*) * shard_count) +
+                  arena_bytes(sizeof(pthread_t) * ProducerCount) +
+                  arena_bytes(sizeof(pthread_t) * ConsumerCount) +
+                  arena_bytes(sizeof(struct ProdConActor) * ProducerCount) +
+                  arena_bytes(sizeof(struct ProdConActor) * ConsumerCount) +
+                  (BenchMode ? ConsumerCount * arena_bytes(sizeof(struct Histogram) * LaneCount) : 0);
+    if (!arena_init(&model->arena, size)) {
+        printf("Unable to allocate the bookkeeping of %d producers and %d consumers.\n",
+               ProducerCount, ConsumerCount);
+        return false;
+    }
+    model->shards = (struct PCQueue**)arena_alloc(&model->arena, sizeof(struct PCQueue*) * shard_count);
+    model->producer_threads = (pthread_t*)arena_alloc(&model->arena, sizeof(pthread_t) * ProducerCount);
+    model->consumer_threads = (pthread_t*)arena_alloc(&model->arena, sizeof(pthread_t) * ConsumerCount);
+    model->producers = (struct ProdConActor*)arena_alloc(
+            &model->arena, sizeof(struct ProdConActor) * ProducerCount);
+    model->consumers = (struct ProdConActor*)arena_alloc(
+            &model->arena, sizeof(struct ProdConActor) * ConsumerCount);
+
+    // Each queue is built while running on the CPU of its first producer (the
+    // first producer and consumer sit in slots 0 and 1), so its memory is local.
+    for (; model->shard_count < shard_count; model->shard_count++) {
+        int shard = model->shard_count;
+        cpu_set_t previous_affinity;
+        int slot = model->first_slot + (shard < pairs ? 2 * shard : pairs + shard);
+        bool moved = move_current_thread(slot, &previous_affinity);
+        bool created = false;
+        model->shards[shard] = SharedQueueName != NULL
+                ? shared_queue_open(SharedQueueName, Backend, RequestedCapacity, PayloadSize, &created)
+                : queue_create(Backend, RequestedCapacity, PayloadSize);
+        if (moved) {
+            restore_current_thread(&previous_affinity);
+        }
+
+        // shared_queue_open says why itself.
+        if (model->shards[shard] == NULL) {
+            if (SharedQueueName == NULL) {
+                printf("Unable to allocate a queue of capacity %zu with %zu byte payloads.\n",
+                       RequestedCapacity, PayloadSize);
+            }
+            return false;
+        }
+    }
+
+    for (int i = 0; i < ProducerCount; i++) {
+        model->producers[i].id = i;
+        model->producers[i].model = model;
+        model->producers[i].shard = i % model->shard_count;
+    }
+    for (int i = 0; i < ConsumerCount; i++) {
+        model->consumers[i].id = i;
+        model->consumers[i].model = model;
+        model->consumers[i].shard = i % model->shard_count;
+        model->consumers[i].lane_credit = LaneWeights[0];
+        if (BenchMode && LaneCount == 1) {
+            model->consumers[i].latency = (struct Histogram*)arena_alloc(&model->arena, sizeof(struct Histogram));
+        } else if (BenchMode) {
+            model->consumers[i].lane_latency = (struct Histogram*)arena_alloc(
+                    &model->arena, sizeof(struct Histogram) * LaneCount);
+        }
+    }
+
+    return true;
+}
+
+void start_prodcon(struct ProdConModel* model) {
+    if (Execution == PoolExecutor) {
+        start_prodcon_tasks(model);
+        printf("Running as tasks on %d workers.\n", model->executor->worker_count);
+        return;
+    }
+
+    int pairs = ProducerCount < ConsumerCount ? ProducerCount : ConsumerCount;
+
+    // Start consumers first, to avoid choking the queue.
+    for (int i = 0; i < ConsumerCount; i++) {
+        pthread_create(&model->consumer_threads[i], NULL, consume, (void *) &model->consumers[i]);
+        pin_thread(model->consumer_threads[i], model->first_slot + (i < pairs ? 2 * i + 1 : pairs + i));
+    }
+
+    // Then the producers.
+    for (int i = 0; i < ProducerCount; i++) {
+        pthread_create(&model->producer_threads[i], NULL, produce, (void *) &model->producers[i]);
+        pin_thread(model->producer_threads[i], model->first_slot + (i < pairs ? 2 * i : pairs + i));
+    }
+}
+
+// Normally, this would be the right order:
+//    Stop the producers, so the consumers have a chance to dry up the
+//    queue. Then stop the consumers.
+// In this case, I am keeping it simple and just stopping everything
+// at the same time. Nonetheless, I preserve the order for the sake of example.
+void join_prodcon(struct ProdConModel* model) {
+    if (model->executor != NULL) {
+        executor_join(model->executor);
+        model->executor = NULL;
+        return;
+    }
+
+    for (int i = 0; i < ProducerCount; i++) {
+        pthread_join(model->producer_threads[i], NULL);
+    }
+    for (int i = 0; i < ConsumerCount; i++) {
+        pthread_join(model->consumer_threads[i], NULL);
+    }
+}
+
+// With several instances, what they got through between them.
+void report_instances(struct ProdConModel* models, int count, uint64_t elapsed_ns) {
+    long consumed = 0;
+    long fewest = -1;
+    long most = 0;
+    for (int m = 0; m < count; m++) {
+        long items = 0;
+        for (int i = 0; i < ConsumerCount; i++) {
+            items += models[m].consumers[i].items;
+        }
+        consumed += items;
+        fewest = fewest < 0 || items < fewest ? items : fewest;
+        most = items > most ? items : most;
+    }
+
+    printf("\nAll %d instances: %ld items consumed, %.0f items/sec; per instance fewest %ld, most %ld\n",
+           count, consumed, items_per_sec(consumed, elapsed_ns), fewest, most);
+}
+
+void run_prodcon() {
+    struct ProdConModel* models = (struct ProdConModel*)aligned_alloc(
+            CACHE_LINE_SIZE, sizeof(struct ProdConModel) * InstanceCount);
+    for (int i = 0; i < InstanceCount; i++) {
+        if (!create_prodcon(&models[i], i)) {
+            for (int j = 0; j <= i; j++) {
+                destroy_prodcon(&models[j]);
+            }
+            free(models);
+            return;
+        }
+    }
+
+    int shard_count = models[0].shard_count;
+    printf("Running Producer/Consumer with %d producers and %d consumers on %d %s queue%s "
+           "(capacity %zu, %s, %zu byte payloads), batches of %d, %s waits.\n",
+           ProducerCount, ConsumerCount, shard_count, BackendNames[Backend], shard_count > 1 ? "s" : "",
+           models[0].shards[0]->capacity, PCQUEUE_PADDING ? "padded" : "unpadded", PayloadSize, BatchSize,
+           WaitStrategyNames[Waiting]);
+    if (Locking != NativeLocks) {
+        printf("The queue locks are %s locks.\n", LockKindNames[Locking]);
+    }
+    if (InstanceCount > 1) {
+        printf("Running %d independent instances of it side by side.\n", InstanceCount);
+    }
+    if (LaneCount > 1) {
+        printf("Items go to %d priority lanes in shares of ", LaneCount);
+        print_lane_list(LaneShares);
+        if (LaneScheduling == WeightedLanes) {
+            printf(", taken by weighted round-robin with weights ");
+            print_lane_list(LaneWeights);
+            printf(".\n");
+        } else {
+            printf(", taken by strict priority.\n");
+        }
+    }
+    if (SharedQueueName != NULL) {
+        printf("The queue is in the shared memory object %s, with %zu items in it; this process runs the %s.\n",
+               SharedQueueName, queue_depth(models[0].shards[0]), SharedRoleNames[SharedQueueRole]);
+    }
+
+    if (BenchMode) {
+        if (BenchItems > 0) {
+            printf("Benchmark mode: running until %ld items have been consumed.\n", BenchItems);
+        } else {
+            printf("Benchmark mode: running for %.3f seconds.\n", BenchDurationSecs);
+        }
+    }
+
+    print_affinity();
+    uint64_t start = now_ns();
+
+    // Telemetry is only allowed with a single instance (see parse_command_line).
+    struct Telemetry* telemetry = telemetry_start(models[0].shards, shard_count,
+                                                  Sharded || LaneCount > 1 ? &models[0].shard_items : NULL);
+
+    for (int i = 0; i < InstanceCount; i++) {
+        start_prodcon(&models[i]);
+    }
+
+    // A timed benchmark is ended from here; otherwise it is SIGINT, or the consumer
+    // that takes the last item, that ends the run. Either way, this thread then
+    // wakes up everyone asleep on a queue, since a signal handler cannot.
+    uint64_t deadline = BenchMode && BenchItems == 0
+            ? start + (uint64_t)(BenchDurationSecs * (double)NANOS_PER_SEC)
+            : UINT64_MAX;
+    sleep_until(deadline);
+    for (int i = 0; i < InstanceCount; i++) {
+        request_prodcon_termination(&models[i]);
+    }
+
+    // At this point, this function has nothing else to do. So the logical
+    // next step is to make it wait for the threads to finish their work.
+    // The join call below will block the main thread, which is exactly what
+    // I want.
+    for (int i = 0; i < InstanceCount; i++) {
+        join_prodcon(&models[i]);
+    }
+
+    report_shutdown();
+    report_prodcon_shutdown(models, InstanceCount);
+    if (BenchMode) {
+        uint64_t elapsed_ns = now_ns() - start;
+        for (int i = 0; i < InstanceCount; i++) {
+            report_prodcon(&models[i], elapsed_ns);
+        }
+        if (InstanceCount > 1) {
+            report_instances(models, InstanceCount, elapsed_ns);
+        }
+        report_counters("item");
+    }
+    telemetry_stop(telemetry);
+
+    for (int i = 0; i < InstanceCount; i++) {
+        destroy_prodcon(&models[i]);
+    }
+    free(models);
+}
+
+
+// With --shm and --role both, sets up the shared queue and forks a process for the
+// producers and one for the consumers, each of which returns from here with its role
+// set and runs the model as usual. The parent waits for both, passing on a SIGINT
+// sent to it alone (one from the terminal reaches the whole process group anyway),
+// and removes the object if it created it. Returns the parent's exit status, or -1
+// in the children.
+int run_shared_roles() {
+    bool created;
+    struct PCQueue* queue = shared_queue_open(SharedQueueName, Backend, RequestedCapacity, PayloadSize, &created);
+    if (queue == NULL) {
+        return 1;
+    }
+    shared_queue_close(queue);
+
+    enum SharedRole roles[] = {ConsumerRole, ProducerRole};
+    pid_t children[2];
+    int started = 0;
+    fflush(stdout);
+    for (; started < 2; started++) {
+        children[started] = fork();
+        if (children[started] < 0) {
+            printf("Unable to start the %s process.\n", SharedRoleNames[roles[started]]);
+            request_termination();
+            break;
+        }
+        if (children[started] == 0) {
+            // Both processes write to the same output; whole lines keep it readable.
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            SharedQueueRole = roles[started];
+            if (SharedQueueRole == ProducerRole) {
+                ConsumerCount = 0;
+            } else {
+                ProducerCount = 0;
+            }
+            return -1;
+        }
+    }
+
+    int status = started == 2 ? 0 : 1;
+    int running = started;
+    bool forwarded = false;
+    while (running > 0) {
+        if (TerminationRequested && !forwarded) {
+            for (int i = 0; i < started; i++) {
+                kill(children[i], SIGINT);
+            }
+            forwarded = true;
+        }
+
+        int child_status;
+        pid_t child = waitpid(-1, &child_status, WNOHANG);
+        if (child < 0) {
+            break;
+        }
+        if (child == 0) {
+            struct timespec timespec = {0, 10 * 1000 * 1000};
+            nanosleep(&timespec, NULL);
+            continue;
+        }
+
+        running--;
+        if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+            status = 1;
+        }
+    }
+
+    if (created) {
+        shm_unlink(SharedQueueName);
+    }
+
+    return status;
+}
+
+
+//========================================================
+// Pipeline
+//========================================================
+
+// With -P, the Producer/Consumer becomes a pipeline: a group of threads per stage,
+// and a queue between each stage and the next, all of the -Q backend and -q
+// capacity. The first stage makes the items, as producers do; the last one takes
+// them, as consumers do; the ones in between take items from the previous queue and
+// pass them on to the next. Each stage does a fixed amount of synthetic work per
+// item (--work), so that the stages can be given different costs, and the report
+// shows what each stage got through as well as how full each queue ran: the queue
+// in front of the slowest stage is the one that fills up.
+#define MAX_PIPELINE_STAGES 16
+#define MAX_STAGE_THREADS 1024
+
+// The number of stages, 0 unless -P was given.
+int PipelineStageCount = 0;
+long StageThreads[MAX_PIPELINE_STAGES];
+
+// Rounds of synthetic work per item, for each stage. A single --work value applies
+// to all of them.
+int StageWorkCount = 0;
+long StageWork[MAX_PIPELINE_STAGES];
+
+// How often the main thread samples the depth of the queues.
+const uint64_t PIPELINE_SAMPLE_INTERVAL_NS = 1000 * 1000;
+
+// Parses a list of up to max colon-separated integers, each at least minimum.
+// Returns how many there were, or -1 when the list is not valid.
+int parse_stage_list(const char* text, long* values, int max, long minimum) {
+    int count = 0;
+    const char* next = text;
+
+    while (true) {
+        char* end;
+        long value = strtol(next, &end, 10);
+        if (end == next || value < minimum || count == max) {
+            return -1;
+        }
+        values[count++] = value;
+
+        if (*end == '\0') {
+            return count;
+        }
+        if (*end != ':') {
+            return -1;
+        }
+        next = end + 1;
+    }
+}
+
+struct PipelineStage {
+    int index;
+    int thread_count;
+    long work;
+
+    // The queues the stage takes items from and passes them to. The first stage has
+    // no in queue, and the last one has no out queue.
+    struct PCQueue* in;
+    struct PCQueue* out;
+
+    // First stage only: the next value to produce.
+    atomic_long next_value;
+
+    // Threads of the stage still running. With --drain, a stage stops only once
+    // the one before it is gone and its in queue is empty.
+    atomic_int active;
+
+    // Samples of the out queue's depth, taken by the main thread.
+    uint64_t depth_total;
+    uint64_t depth_samples;
+    size_t max_depth;
+};
+
+// The stages of one pipeline, and what they share.
+struct Pipeline {
+    int stage_count;
+    struct PipelineStage stages[MAX_PIPELINE_STAGES];
+
+    // Items taken by the last stage so far. Only kept when the benchmark runs for a
+    // fixed number of items.
+    atomic_long consumed_items;
+};
+
+// Each thread's bookkeeping, plus the pipeline and stage it works for.
+struct PipelineActor {
+    struct ProdConActor actor;
+    struct Pipeline* pipeline;
+    struct PipelineStage* stage;
+};
+
+void request_pipeline_termination(struct Pipeline* pipeline) {
+    request_termination();
+
+    for (int i = 0; i < pipeline->stage_count - 1; i++) {
+        wake_queue(pipeline->stages[i].out);
+    }
+}
+
+// Stands in for whatever a real stage would compute from an item: rounds of a
+// 64-bit mix, each depending on the one before, so that they can neither be
+// overlapped nor optimized away.
+uint64_t synthetic_work(uint64_t x, long rounds) {
+    for (long i = 0; i < rounds; i++) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 29;
+    }
+
+    return x;
+}
+
+uint64_t work_on_item(struct PipelineStage* stage, struct PCQueue* queue, struct Item* item) {
+    return synthetic_work((uint64_t)item->value + payload_checksum(queue, item), stage->work);
+}
+
+// The first stage: takes the next values, builds and works on their items in
+// staging, then copies them into the out queue. Working on them in their slots
+// instead would hold the mutex backend's lock for the whole of the work, and the
+// stage's threads would take turns rather than work side by side. Returns how many
+// went in, or -1 once a benchmark has run out of items.
+int pipeline_source(struct PipelineActor* worker, unsigned char* staging, size_t item_size) {
+    struct ProdConActor* actor = &worker->actor;
+    struct PipelineStage* stage = worker->stage;
+    size_t item_bytes = sizeof(struct Item) + stage->out->payload_size;
+
+    long first = atomic_fetch_add_explicit(&stage->next_value, BatchSize, memory_order_relaxed);
+    int count = BatchSize;
+    if (BenchItems > 0) {
+        if (first >= BenchItems) {
+            return -1;
+        }
+        if (first + count > BenchItems) {
+            count = (int)(BenchItems - first);
+        }
+    }
+
+    uint64_t timestamp = BenchMode ? now_ns() : 0;
+    uint64_t checksum = actor->checksum;
+    for (int i = 0; i < count; i++) {
+        struct Item* item = (struct Item*)(staging + i * item_size);
+        write_item(stage->out, item, first + i, timestamp);
+        checksum += work_on_item(stage, stage->out, item);
+    }
+    actor->checksum = checksum;
+
+    int written = 0;
+    while (written < count) {
+        size_t position;
+        int reserved = queue_reserve(stage->out, count - written, &position, true);
+        if (reserved == 0) {
+            break;
+        }
+
+        for (int i = 0; i < reserved; i++) {
+            memcpy(queue_item(stage->out, position + i), staging + (written + i) * item_size, item_bytes);
+        }
+        queue_commit(stage->out, position, reserved);
+
+        for (int i = 0; i < reserved; i++) {
+            log_event(ProducedEvent, first + written + i);
+        }
+        written += reserved;
+    }
+    actor->items += written;
+
+    return written;
+}
+
+// The stages in between: take a batch, copy it out so that its slots can be
+// released right away, work on it and pass it on. Holding on to the slots instead
+// would hold the mutex backend's lock while waiting for room in the next queue.
+// Returns how many items were passed on.
+int pipeline_forward(struct PipelineActor* worker, unsigned char* staging, size_t item_size, bool wait) {
+    struct ProdConActor* actor = &worker->actor;
+    struct PipelineStage* stage = worker->stage;
+    size_t item_bytes = sizeof(struct Item) + stage->in->payload_size;
+
+    size_t position;
+    int acquired = queue_acquire(stage->in, BatchSize, &position, wait);
+    if (acquired == 0) {
+        return 0;
+    }
+    for (int i = 0; i < acquired; i++) {
+        memcpy(staging + i * item_size, queue_item(stage->in, position + i), item_bytes);
+    }
+    queue_release(stage->in, position, acquired);
+
+    uint64_t checksum = actor->checksum;
+    for (int i = 0; i < acquired; i++) {
+        checksum += work_on_item(stage, stage->in, (struct Item*)(staging + i * item_size));
+    }
+    actor->checksum = checksum;
+
+    // While draining, the queues no longer wait once termination is requested, but
+    // the next stage is sure to make room, as it stays until this one is gone.
+    int written = 0;
+    while (written < acquired) {
+        int reserved = queue_reserve(stage->out, acquired - written, &position, true);
+        if (reserved == 0 && DrainOnShutdown) {
+            sched_yield();
+            continue;
+        }
+        if (reserved == 0) {
+            break;
+        }
+
+        for (int i = 0; i < reserved; i++) {
+            memcpy(queue_item(stage->out, position + i), staging + (written + i) * item_size, item_bytes);
+        }
+        queue_commit(stage->out, position, reserved);
+
+        for (int i = 0; i < reserved; i++) {
+            log_event(ForwardedEvent, ((struct Item*)(staging + (written + i) * item_size))->value);
+        }
+        written += reserved;
+    }
+    actor->items += written;
+
+    return written;
+}
+
+// The last stage: takes a batch, copies it out and releases its slots, for the
+// same reason as the first stage, then works on it and ends a benchmark that has
+// consumed all of its items. Returns how many items were taken.
+int pipeline_sink(struct PipelineActor* worker, unsigned char* staging, size_t item_size, bool wait) {
+    struct ProdConActor* actor = &worker->actor;
+    struct Pipeline* pipeline = worker->pipeline;
+    struct PipelineStage* stage = worker->stage;
+    size_t item_bytes = sizeof(struct Item) + stage->in->payload_size;
+
+    size_t position;
+    int acquired = queue_acquire(stage->in, BatchSize, &position, wait);
+    if (acquired == 0) {
+        return 0;
+    }
+
+    uint64_t now = BenchMode ? now_ns() : 0;
+    for (int i = 0; i < acquired; i++) {
+        memcpy(staging + i * item_size, queue_item(stage->in, position + i), item_bytes);
+    }
+    queue_release(stage->in, position, acquired);
+
+    uint64_t checksum = actor->checksum;
+    for (int i = 0; i < acquired; i++) {
+        struct Item* item = (struct Item*)(staging + i * item_size);
+        log_event(ConsumedEvent, item->value);
+        if (BenchMode) {
+            histogram_record(actor->latency, now - item->enqueued_ns);
+        }
+        checksum += work_on_item(stage, stage->in, item);
+    }
+
+    actor->checksum = checksum;
+    actor->items += acquired;
+
+    if (BenchMode && BenchItems > 0 &&
+        atomic_fetch_add_explicit(&pipeline->consumed_items, acquired, memory_order_relaxed) + acquired >=
+        BenchItems) {
+        request_pipeline_termination(pipeline);
+    }
+
+    return acquired;
+}
+
+void* run_stage(void* actor_info) {
+    struct PipelineActor* worker = (struct PipelineActor*)actor_info;
+    struct PipelineStage* stage = worker->stage;
+    int my_id = worker->actor.id;
+    printf("Starting stage %d worker %d\n", stage->index, my_id);
+    event_log_open(my_id);
+    counters_open();
+    random_seed_thread(StageStream, my_id);
+
+    // Items are staged 8-byte aligned, as their values and timestamps expect.
+    size_t item_size = (sizeof(struct Item) + PayloadSize + 7) & ~(size_t)7;
+    unsigned char* staging = (unsigned char*)malloc(item_size * BatchSize);
+
+    uint64_t start = now_ns();
+
+    while (!TerminationRequested) {
+        if (!BenchMode) {
+            random_sleep(PROD_CON_MAX_SLEEP_TIME_MS);
+        }
+
+        if (stage->in == NULL) {
+            if (pipeline_source(worker, staging, item_size) < 0) {
+                break;
+            }
+        } else if (stage->out == NULL) {
+            pipeline_sink(worker, staging, item_size, true);
+        } else {
+            pipeline_forward(worker, staging, item_size, true);
+        }
+    }
+
+    // As with drain_batch, the stage before is checked before the queue, so that
+    // whatever it passed on before leaving is sure to be seen.
+    while (DrainOnShutdown && stage->in != NULL) {
+        bool feeding = atomic_load(&worker->pipeline->stages[stage->index - 1].active) > 0;
+        int taken = stage->out == NULL ? pipeline_sink(worker, staging, item_size, false)
+                                       : pipeline_forward(worker, staging, item_size, false);
+        worker->actor.drained += taken;
+        if (taken == 0 && !feeding) {
+            break;
+        }
+        if (taken == 0) {
+            sched_yield();
+        }
+    }
+
+    atomic_fetch_sub(&stage->active, 1);
+    worker->actor.elapsed_ns = now_ns() - start;
+    printf("Stage %d worker %d exiting.\n", stage->index, my_id);
+    free(staging);
+
+    return NULL;
+}
+
+void sample_pipeline_depths(struct Pipeline* pipeline) {
+    for (int i = 0; i < pipeline->stage_count - 1; i++) {
+        struct PipelineStage* stage = &pipeline->stages[i];
+        size_t depth = queue_depth(stage->out);
+
+        stage->depth_total += depth;
+        stage->depth_samples++;
+        if (depth > stage->max_depth) {
+            stage->max_depth = depth;
+        }
+    }
+}
+
+double average_queue_fill(struct PipelineStage* stage) {
+    if (stage->out == NULL || stage->depth_samples == 0) {
+        return 0.0;
+    }
+
+    return (double)stage->depth_total / (double)stage->depth_samples / (double)stage->out->capacity;
+}
+
+
+//========================================================
+// Pipeline report
+//========================================================
+
+// A stage that holds the pipeline back has its in queue full, since it cannot keep
+// up with the stage before it, and its out queue empty, since the one after it is
+// starved. The stage where the difference is largest is named as the likely
+// bottleneck (the first stage counts as always fed, the last as never blocked).
+void report_pipeline(struct Pipeline* pipeline, struct PipelineActor* workers, uint64_t elapsed_ns) {
+    event_log_drain();
+    printf("\nBenchmark results over %.3f s:\n", (double)elapsed_ns / (double)NANOS_PER_SEC);
+
+    struct Histogram* latency = (struct Histogram*)calloc(1, sizeof(struct Histogram));
+    int bottleneck = 0;
+    double worst = -2.0;
+    int first_worker = 0;
+    long items = 0;
+    for (int s = 0; s < pipeline->stage_count; s++) {
+        struct PipelineStage* stage = &pipeline->stages[s];
+
+        items = 0;
+        for (int i = 0; i < stage->thread_count; i++) {
+            struct ProdConActor* actor = &workers[first_worker + i].actor;
+            items += actor->items;
+            if (actor->latency != NULL) {
+                histogram_merge(latency, actor->latency);
+            }
+        }
+        first_worker += stage->thread_count;
+
+        printf("  Stage %d: %d thread%s, %ld rounds of work, %ld items, %.0f items/sec (%.0f per thread)\n",
+               s, stage->thread_count, stage->thread_count > 1 ? "s" : "", stage->work, items,
+               items_per_sec(items, elapsed_ns),
+               items_per_sec(items, elapsed_ns) / stage->thread_count);
+        if (stage->out != NULL) {
+            printf("    Queue to stage %d: average depth %.1f of %zu (%.0f%% full), max %zu\n",
+                   s + 1, average_queue_fill(stage) * (double)stage->out->capacity, stage->out->capacity,
+                   100.0 * average_queue_fill(stage), stage->max_depth);
+        }
+
+        double in_fill = s == 0 ? 1.0 : average_queue_fill(&pipeline->stages[s - 1]);
+        double out_fill = average_queue_fill(stage);
+        if (in_fill - out_fill > worst) {
+            worst = in_fill - out_fill;
+            bottleneck = s;
+        }
+    }
+
+    print_latency_percentiles("End to end latency", latency);
+    printf("  Likely bottleneck: stage %d\n", bottleneck);
+    // What the last stage took is what the pipeline got through.
+    record_run(items, elapsed_ns, latency);
+
+    free(latency);
+}
+
+
+//========================================================
+// Pipeline runner
+//========================================================
+
+void destroy_pipeline(struct Pipeline* pipeline) {
+    for (int i = 0; i < pipeline->stage_count; i++) {
+        if (pipeline->stages[i].out != NULL) {
+            queue_destroy(pipeline->stages[i].out);
+        }
+        pipeline->stages[i].out = NULL;
+        pipeline->stages[i].in = NULL;
+    }
+    free(pipeline);
+}
+
+void run_pipeline() {
+    struct Pipeline* pipeline = (struct Pipeline*)calloc(1, sizeof(struct Pipeline));
+    pipeline->stage_count = PipelineStageCount;
+    atomic_init(&pipeline->consumed_items, 0);
+
+    int thread_count = 0;
+    for (int s = 0; s < pipeline->stage_count; s++) {
+        struct PipelineStage* stage = &pipeline->stages[s];
+        memset(stage, 0, sizeof(struct PipelineStage));
+        stage->index = s;
+        stage->thread_count = (int)StageThreads[s];
+        stage->work = StageWorkCount == 1 ? StageWork[0] : StageWork[s];
+        atomic_init(&stage->next_value, 0);
+        atomic_init(&stage->active, stage->thread_count);
+        thread_count += stage->thread_count;
+    }
+
+    // Threads take placement slots in stage order, and each queue is built while
+    // running on the CPU of the first thread that writes to it.
+    int slot = 0;
+    for (int s = 0; s < pipeline->stage_count - 1; s++) {
+        cpu_set_t previous_affinity;
+        bool moved = move_current_thread(slot, &previous_affinity);
+        pipeline->stages[s].out = queue_create(Backend, RequestedCapacity, PayloadSize);
+        pipeline->stages[s + 1].in = pipeline->stages[s].out;
+        if (moved) {
+            restore_current_thread(&previous_affinity);
+        }
+        slot += pipeline->stages[s].thread_count;
+
+        if (pipeline->stages[s].out == NULL) {
+            printf("Unable to allocate a queue of capacity %zu with %zu byte payloads.\n",
+                   RequestedCapacity, PayloadSize);
+            destroy_pipeline(pipeline);
+            return;
+        }
+    }
+
+    printf("Running a %d stage pipeline with %d threads on %s queues (capacity %zu, %s, %zu byte payloads), "
+           "batches of %d, %s waits.\n",
+           pipeline->stage_count, thread_count, BackendNames[Backend], pipeline->stages[0].out->capacity,
+           PCQUEUE_PADDING ? "padded" : "unpadded", PayloadSize, BatchSize, WaitStrategyNames[Waiting]);
+    if (Locking != NativeLocks) {
+        printf("The queue locks are %s locks.\n", LockKindNames[Locking]);
+    }
+
+    if (BenchMode) {
+        if (BenchItems > 0) {
+            printf("Benchmark mode: running until %ld items have been consumed.\n", BenchItems);
+        } else {
+            printf("Benchmark mode: running for %.3f seconds.\n", BenchDurationSecs);
+        }
+    }
+
+    // The workers, their threads' handles and the last stage's histograms all come
+    // from one arena.
+    int last_stage_threads = pipeline->stages[pipeline->stage_count - 1].thread_count;
+    struct Arena arena;
+    size_t size = arena_bytes(sizeof(pthread_t) * thread_count) +
+                  arena_bytes(sizeof(struct PipelineActor) * thread_count) +
+                  (BenchMode ? last_stage_threads * arena_bytes(sizeof(struct Histogram)) : 0);
+    if (!arena_init(&arena, size)) {
+        printf("Unable to allocate the bookkeeping of %d threads.\n", thread_count);
+        destroy_pipeline(pipeline);
+        return;
+    }
+
+    pthread_t* threads = (pthread_t*)arena_alloc(&arena, sizeof(pthread_t) * thread_count);
+    struct PipelineActor* workers = (struct PipelineActor*)arena_alloc(
+            &arena, sizeof(struct PipelineActor) * thread_count);
+    for (int s = 0, i = 0; s < pipeline->stage_count; s++) {
+        for (int j = 0; j < pipeline->stages[s].thread_count; j++, i++) {
+            workers[i].actor.id = i;
+            workers[i].pipeline = pipeline;
+            workers[i].stage = &pipeline->stages[s];
+            if (BenchMode && s == pipeline->stage_count - 1) {
+                workers[i].actor.latency = (struct Histogram*)arena_alloc(&arena, sizeof(struct Histogram));
+            }
+        }
+    }
+
+    struct PCQueue* queues[MAX_PIPELINE_STAGES];
+    for (int s = 0; s < pipeline->stage_count - 1; s++) {
+        queues[s] = pipeline->stages[s].out;
+    }
+
+    print_affinity();
+    uint64_t start = now_ns();
+    struct Telemetry* telemetry = telemetry_start(queues, pipeline->stage_count - 1, NULL);
+
+    // Start from the last stage, to avoid choking the queues.
+    for (int i = thread_count - 1; i >= 0; i--) {
+        pthread_create(&threads[i], NULL, run_stage, (void *) &workers[i]);
+        pin_thread(threads[i], i);
+    }
+
+    // While the stages run, this thread keeps sampling the queue depths, until the
+    // benchmark is over or SIGINT comes in.
+    uint64_t deadline = BenchMode && BenchItems == 0 ?
+                        start + (uint64_t)(BenchDurationSecs * (double)NANOS_PER_SEC) : UINT64_MAX;
+    uint64_t next_sample = start;
+    while (!TerminationRequested && next_sample < deadline) {
+        sample_pipeline_depths(pipeline);
+        next_sample += PIPELINE_SAMPLE_INTERVAL_NS;
+        sleep_until(next_sample < deadline ? next_sample : deadline);
+    }
+    request_pipeline_termination(pipeline);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    long drained = 0;
+    for (int i = thread_count - last_stage_threads; i < thread_count; i++) {
+        drained += workers[i].actor.drained;
+    }
+    report_shutdown();
+    report_queue_shutdown(drained, queues, pipeline->stage_count - 1);
+    if (BenchMode) {
+        report_pipeline(pipeline, workers, now_ns() - start);
+        report_counters("item");
+    }
+    telemetry_stop(telemetry);
+
+    arena_release(&arena);
+    destroy_pipeline(pipeline);
+}
+
+
+//======================================================================================
+//
+//  Dining Philosophers.
+//
+//======================================================================================
+
+// The original solution implements the four righties and one leftie strategy
+// discussed in The Little Book of Semaphores. The table can now seat any number of
+// philosophers (-N), and how they pick up their forks is up to the -S strategy:
+//   - leftie:  everybody picks up the right fork first, except philosopher 0, who
+//              picks up the left one first. That breaks the cycle of waits.
+//   - waiter:  a waiter only lets N - 1 philosophers try to eat at a time (also from
+//              The Little Book of Semaphores), so at least one gets both forks.
+//   - chandy:  Chandy/Misra hygienic forks: forks are clean or dirty, and a
+//              philosopher must give up a dirty fork it is not eating with as soon
+//              as a neighbour asks for it, hungry or not; the one receiving it
+//              cleans it. No philosopher starves.
+//   - trylock: grab the first fork, try to grab the second one; if that fails, put
+//              the first one back and back off for a random, growing period.
+enum ForkStrategy {
+    LeftieForks,
+    WaiterForks,
+    ChandyMisraForks,
+    TryLockForks,
+    InvalidForks
+};
+
+enum ForkStrategy ForkAcquisition = LeftieForks;
+
+char* ForkStrategyNames[] = {
+        "leftie",
+        "waiter",
+        "chandy",
+        "trylock",
+        "invalid"
+};
+
+enum ForkStrategy parse_fork_strategy(const char* name) {
+    for (int i = 0; i < InvalidForks; i++) {
+        if (strcmp(name, ForkStrategyNames[i]) == 0) {
+            return (enum ForkStrategy)i;
+        }
+    }
+
+    return InvalidForks;
+}
+
+#define MAX_PHILOSOPHER_COUNT 1000000
+
+// By the problem definition, we have five philosophers and five forks.
+int PhilosopherCount = 5;
+
+// For the chandy strategy, each fork records who has it and whether it is dirty.
+// in_use is set while its holder eats with it, when it may not be taken away.
+struct HygienicFork {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int holder;
+    bool dirty;
+    bool in_use;
+
+    // Set by the neighbour who does not hold the fork, while it waits for it.
+    bool requested;
+};
+
+struct Fork {
+    union {
+        struct Semaphore semaphore;
+        struct TicketLock ticket;
+        struct McsLock mcs;
+    };
+};
+
+// Everything the philosophers at one table share. With --instances there are
+// several tables, each with forks (and placement slots) of its own.
+struct DiningTable {
+    int id;
+    int first_slot;
+
+    // The forks will be the resources that the diners share/compete for. Since each
+    // philosopher is a different thread, the forks need to be in the heap.
+    // I use semaphores since that seems to be the convention, though in this case,
+    // its maximum value is 1, so I could, just the same, have used mutexes. Every
+    // strategy but chandy uses them, unless -L makes them ticket or MCS locks.
+    struct Fork* forks;
+
+    // With -L mcs, each philosopher's queue nodes: one for its own fork (the one with
+    // its id), one for its neighbour's.
+    struct McsNode* fork_nodes;
+
+    // For the waiter strategy: the seats at which philosophers may try to eat.
+    struct Semaphore seats;
+
+    // For the chandy strategy, the forks are hygienic ones instead.
+    struct HygienicFork* hygienic_forks;
+
+    struct PhilosopherActor* philosophers;
+    pthread_t* threads;
+    int seated;
+
+    // Where the forks, the philosophers, their threads' handles and their histograms
+    // come from. The executors' tasks and fibers are allocated when they start.
+    struct Arena arena;
+
+    // With --executor pool, the table's own executor and the tasks it runs.
+    struct Executor* executor;
+    struct PhilosopherTask* tasks;
+
+    // With --executor fibers, the table's own schedulers and the fibers they run.
+    // With a million philosophers, a fork wait histogram each would take gigabytes,
+    // so the fibers of a scheduler share one instead.
+    struct FiberPool* fiber_pool;
+    struct PhilosopherFiber* fibers;
+    struct Histogram* fiber_fork_waits;
+    uint64_t fiber_switches;
+};
+
+// --think and --eat replace the random periods above with fixed ones, in
+// milliseconds. Zero means no pause at all, which is what benchmark mode uses unless
+// told otherwise, so that the run measures fork contention and nothing else.
+double ThinkMs = -1;
+double EatMs = -1;
+
+const long MINIMUM_THINKING_SECS = 1;
+const long MAXIMUM_THINKING_SECS = 20 - MINIMUM_THINKING_SECS;
+const long MINIMUM_EATING_SECS = 2;
+const long MAXIMUM_EATING_SECS = 9 - MINIMUM_EATING_SECS;
+
+// The trylock strategy backs off between 1 us and 1 ms.
+const long MINIMUM_BACKOFF_NS = 1000;
+const long MAXIMUM_BACKOFF_NS = 1000 * 1000;
+
+// How long to think, and to eat, for: the fixed --think and --eat periods, or
+// random ones of a few seconds. Threads sleep for them, tasks are woken after them.
+uint64_t thinking_ns() {
+    if (ThinkMs >= 0) {
+        return (uint64_t)(ThinkMs * 1E6);
+    }
+
+    return (uint64_t)(MINIMUM_THINKING_SECS * 1000 + random_below(MAXIMUM_THINKING_SECS * 1000)) * 1000000;
+}
+
+uint64_t eating_ns() {
+    if (EatMs >= 0) {
+        return (uint64_t)(EatMs * 1E6);
+    }
+
+    return (uint64_t)(MINIMUM_EATING_SECS * 1000 + random_below(MAXIMUM_EATING_SECS)) * 1000000;
+}
+
+// Thinking and eating are cut short by a termination request, so that nobody,
+// waiting for forks or not, holds up the shutdown for seconds.
+void pause_for(uint64_t period_ns) {
+    if (period_ns > 0) {
+        timer_sleep_until(now_ns() + period_ns);
+    }
+}
+
+void think() {
+    log_event(ThinkingEvent, 0);
+    pause_for(thinking_ns());
+}
+
+void eat() {
+    log_event(EatingEvent, 0);
+    pause_for(eating_ns());
+}
+
+//========================================================
+// Chandy/Misra hygienic forks
+//========================================================
+
+// Initially every fork is dirty and goes to the lower numbered of its two
+// philosophers. That makes the "who yields to whom" graph acyclic, and the
+// cleaning rules keep it that way.
+void hygienic_forks_init(struct DiningTable* table) {
+    for (int i = 0; i < PhilosopherCount; i++) {
+        struct HygienicFork* hygienic = &table->hygienic_forks[i];
+        pthread_mutex_init(&hygienic->lock, NULL);
+        pthread_cond_init(&hygienic->changed, NULL);
+        hygienic->holder = i == 0 ? 0 : i - 1;
+        hygienic->dirty = true;
+        hygienic->in_use = false;
+        hygienic->requested = false;
+    }
+}
+
+void hygienic_forks_destroy(struct DiningTable* table) {
+    for (int i = 0; i < PhilosopherCount; i++) {
+        pthread_cond_destroy(&table->hygienic_forks[i].changed);
+        pthread_mutex_destroy(&table->hygienic_forks[i].lock);
+    }
+}
+
+// Fork i is shared by philosophers i - 1 and i; this is the one that is not id.
+int hygienic_neighbour(int id, int fork) {
+    return fork == id ? (fork + PhilosopherCount - 1) % PhilosopherCount : fork;
+}
+
+// One step towards having the fork, with its lock held. A dirty fork we are not
+// eating with goes to the neighbour if it asked for it, even though we are hungry
+// again ourselves: otherwise we could eat with it over and over while the neighbour
+// waits. A dirty fork the neighbour is not eating with is ours for the taking; its
+// holder would have had to hand it over. Forks that change hands are cleaned, which
+// is what lets the receiver keep them until it eats. If the fork is still not ours,
+// we ask for it. Returns whether the fork changed hands.
+bool hygienic_exchange(struct HygienicFork* hygienic, int id, int fork) {
+    if (hygienic->holder == id) {
+        if (!hygienic->dirty || !hygienic->requested || hygienic->in_use) {
+            return false;
+        }
+        hygienic->holder = hygienic_neighbour(id, fork);
+    } else if (hygienic->dirty && !hygienic->in_use) {
+        hygienic->holder = id;
+    } else {
+        hygienic->requested = true;
+        return false;
+    }
+
+    hygienic->dirty = false;
+    hygienic->requested = hygienic->holder != id;
+    return true;
+}
+
+// Waits until the fork is ours.
+void hygienic_take(struct DiningTable* table, int id, int fork) {
+    struct HygienicFork* hygienic = &table->hygienic_forks[fork];
+
+    lock_mutex(&hygienic->lock);
+    bool changed = hygienic_exchange(hygienic, id, fork);
+    while (hygienic->holder != id) {
+        if (changed) {
+            // We handed it over; the neighbour may be waiting for it.
+            pthread_cond_broadcast(&hygienic->changed);
+        }
+        wait_condition(&hygienic->changed, &hygienic->lock);
+        changed = hygienic_exchange(hygienic, id, fork);
+    }
+    unlock_mutex(&hygienic->lock);
+}
+
+// The same, except that it never waits. Returns whether the fork is ours.
+bool hygienic_try_take(struct DiningTable* table, int id, int fork) {
+    struct HygienicFork* hygienic = &table->hygienic_forks[fork];
+
+    lock_mutex(&hygienic->lock);
+    bool changed = hygienic_exchange(hygienic, id, fork);
+    bool ours = hygienic->holder == id;
+    unlock_mutex(&hygienic->lock);
+    if (changed && !ours) {
+        pthread_cond_broadcast(&hygienic->changed);
+    }
+
+    return ours;
+}
+
+// A fork we already had was dirty, so a neighbour may have taken it while we waited
+// for the other one, or asked for it, in which case it must go to the neighbour
+// first. This checks we still have both, neither of them owed, and if so, starts
+// eating with them. Locking both forks is done in index order, to avoid deadlocks
+// among the locks themselves.
+bool hygienic_claim_both(struct DiningTable* table, int id, int left_fork, int right_fork) {
+    struct HygienicFork* lower = &table->hygienic_forks[left_fork < right_fork ? left_fork : right_fork];
+    struct HygienicFork* higher = &table->hygienic_forks[left_fork < right_fork ? right_fork : left_fork];
+
+    lock_mutex(&lower->lock);
+    lock_mutex(&higher->lock);
+    bool both = lower->holder == id && higher->holder == id && !(lower->dirty && lower->requested) &&
+                !(higher->dirty && higher->requested);
+    if (both) {
+        lower->in_use = true;
+        higher->in_use = true;
+    }
+    unlock_mutex(&higher->lock);
+    unlock_mutex(&lower->lock);
+
+    return both;
+}
+
+void hygienic_get_forks(struct DiningTable* table, int id, int left_fork, int right_fork) {
+    do {
+        log_event(GettingForkEvent, right_fork);
+        hygienic_take(table, id, right_fork);
+        log_event(GettingForkEvent, left_fork);
+        hygienic_take(table, id, left_fork);
+    } while (!hygienic_claim_both(table, id, left_fork, right_fork));
+}
+
+void hygienic_put_down(struct DiningTable* table, int fork) {
+    struct HygienicFork* hygienic = &table->hygienic_forks[fork];
+
+    log_event(YieldingForkEvent, fork);
+    lock_mutex(&hygienic->lock);
+    hygienic->dirty = true;
+    hygienic->in_use = false;
+    unlock_mutex(&hygienic->lock);
+    pthread_cond_broadcast(&hygienic->changed);
+}
+
+//========================================================
+// Fork acquisition
+//========================================================
+
+// Taking, trying for and putting down a single fork, whatever -L made it.
+struct McsNode* fork_node(struct DiningTable* table, int id, int fork) {
+    return &table->fork_nodes[2 * id + (fork == id ? 0 : 1)];
+}
+
+void take_fork(struct DiningTable* table, int id, int fork) {
+    switch (Locking) {
+        case TicketLocks:
+            ticket_lock(&table->forks[fork].ticket);
+            break;
+
+        case McsLocks:
+            mcs_lock(&table->forks[fork].mcs, fork_node(table, id, fork));
+            break;
+
+        default:
+            wait_on_semaphore(&table->forks[fork].semaphore);
+            break;
+    }
+}
+
+bool try_take_fork(struct DiningTable* table, int id, int fork) {
+    switch (Locking) {
+        case TicketLocks:
+            return ticket_trylock(&table->forks[fork].ticket);
+
+        case McsLocks:
+            return mcs_trylock(&table->forks[fork].mcs, fork_node(table, id, fork));
+
+        default:
+            return semaphore_trywait(&table->forks[fork].semaphore);
+    }
+}
+
+void put_down_fork(struct DiningTable* table, int id, int fork) {
+    switch (Locking) {
+        case TicketLocks:
+            ticket_unlock(&table->forks[fork].ticket);
+            break;
+
+        case McsLocks:
+            mcs_unlock(&table->forks[fork].mcs, fork_node(table, id, fork));
+            break;
+
+        default:
+            semaphore_post(&table->forks[fork].semaphore);
+            break;
+    }
+}
+
+// Sleeps for a random period of up to *backoff_ns, then doubles *backoff_ns.
+void backoff(long* backoff_ns) {
+    struct timespec timespec = {0, (long)random_below((uint64_t)*backoff_ns)};
+    nanosleep(&timespec, NULL);
+
+    if (*backoff_ns < MAXIMUM_BACKOFF_NS) {
+        *backoff_ns *= 2;
+    }
+}
+
+void trylock_get_forks(struct DiningTable* table, int id, int left_fork, int right_fork) {
+    long backoff_ns = MINIMUM_BACKOFF_NS;
+
+    for (;;) {
+        log_event(GettingForkEvent, right_fork);
+        take_fork(table, id, right_fork);
+
+        log_event(GettingForkEvent, left_fork);
+        if (try_take_fork(table, id, left_fork)) {
+            return;
+        }
+
+        log_event(YieldingForkEvent, right_fork);
+        put_down_fork(table, id, right_fork);
+        backoff(&backoff_ns);
+    }
+}
+
+void get_forks(struct DiningTable* table, int id, int left_fork, int right_fork) {
+    switch (ForkAcquisition) {
+        case ChandyMisraForks:
+            hygienic_get_forks(table, id, left_fork, right_fork);
+            return;
+
+        case TryLockForks:
+            trylock_get_forks(table, id, left_fork, right_fork);
+            return;
+
+        case WaiterForks:
+            wait_on_semaphore(&table->seats);
+            break;
+
+        default:
+            break;
+    }
+
+    log_event(GettingForkEvent, right_fork);
+    take_fork(table, id, right_fork);
+    log_event(GettingForkEvent, left_fork);
+    take_fork(table, id, left_fork);
+}
+
+void put_down_forks(struct DiningTable* table, int id, int left_fork, int right_fork) {
+    if (ForkAcquisition == ChandyMisraForks) {
+        hygienic_put_down(table, right_fork);
+        hygienic_put_down(table, left_fork);
+        return;
+    }
+
+    log_event(YieldingForkEvent, right_fork);
+    put_down_fork(table, id, right_fork);
+    log_event(YieldingForkEvent, left_fork);
+    put_down_fork(table, id, left_fork);
+
+    if (ForkAcquisition == WaiterForks) {
+        semaphore_post(&table->seats);
+    }
+}
+
+//========================================================
+// Dining Philosophers tasks
+//========================================================
+
+// Per-philosopher bookkeeping, each on its own cache line.
+struct PhilosopherActor {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    // The table the philosopher sits at.
+    struct DiningTable* table;
+
+    long meals;
+
+    // Only in benchmark mode: how long get_forks() took, meal after meal.
+    struct Histogram* fork_wait;
+};
+
+// Figures out which forks a philosopher can get.
+void philosopher_forks(int id, int* left_fork, int* right_fork) {
+    *left_fork = id;
+    *right_fork = (id + 1) % PhilosopherCount;
+
+    // With the leftie strategy, philosopher 0 is a leftie, so his/her/their forks
+    // need to be swapped.
+    if (ForkAcquisition == LeftieForks && id == 0) {
+        *left_fork = *right_fork;
+        *right_fork = id;
+    }
+}
+
+void* think_then_eat(void* actor_info) {
+    struct PhilosopherActor* actor = (struct PhilosopherActor*)actor_info;
+    int my_id = actor->id;
+    printf("Philosopher %d sitting at table.\n", my_id);
+    event_log_open(my_id);
+    counters_open();
+    random_seed_thread(PhilosopherStream, my_id);
+
+    int left_fork;
+    int right_fork;
+    philosopher_forks(my_id, &left_fork, &right_fork);
+
+    while (!TerminationRequested) {
+        think();
+
+        uint64_t hungry_since = BenchMode ? now_ns() : 0;
+        get_forks(actor->table, my_id, left_fork, right_fork);
+        if (BenchMode) {
+            histogram_record(actor->fork_wait, now_ns() - hungry_since);
+        }
+
+        eat();
+        put_down_forks(actor->table, my_id, left_fork, right_fork);
+        actor->meals++;
+    }
+
+     printf("Philosopher %d leaving the table.\n", my_id);
+     return NULL;
+}
+
+//========================================================
+// Dining Philosophers executor tasks
+//========================================================
+
+// On the executor, a philosopher is a state machine that goes round the same cycle
+// as think_then_eat(), but only ever tries for a fork:
+//   - thinking:     about to think. Sleeps (as a task) for the thinking period.
+//   - hungry:       trying for the first fork (or, with the waiter, for a seat).
+//   - holding fork: has the first fork, trying for the second one.
+//   - eating:       done eating (as a task slept through the meal); puts the forks
+//                   down.
+// With the chandy and trylock strategies, both forks are tried for while hungry.
+enum PhilosopherState {
+    ThinkingState,
+    HungryState,
+    HoldingForkState,
+    EatingState
+};
+
+struct PhilosopherTask {
+    struct Task task;
+
+    struct PhilosopherActor* actor;
+    int left_fork;
+    int right_fork;
+
+    enum PhilosopherState state;
+    uint64_t hungry_since;
+
+    // Waiter strategy: whether the waiter has given us a seat yet.
+    bool seated;
+
+    // Trylock strategy: the current backoff period.
+    long backoff_ns;
+};
+
+// Gets the philosopher going: records how long the forks took, and naps through
+// the meal.
+enum TaskStatus start_eating(struct PhilosopherTask* philosopher) {
+    uint64_t now = now_ns();
+    if (BenchMode) {
+        histogram_record(philosopher->actor->fork_wait, now - philosopher->hungry_since);
+    }
+
+    log_event(EatingEvent, 0);
+    philosopher->task.wake_ns = now + eating_ns();
+    philosopher->state = EatingState;
+    philosopher->backoff_ns = MINIMUM_BACKOFF_NS;
+
+    return TaskProgressed;
+}
+
+// Hungry, with the chandy or trylock strategy: both forks or nothing.
+enum TaskStatus try_both_forks(struct PhilosopherTask* philosopher) {
+    struct DiningTable* table = philosopher->actor->table;
+    int id = philosopher->actor->id;
+    int left_fork = philosopher->left_fork;
+    int right_fork = philosopher->right_fork;
+
+    if (ForkAcquisition == ChandyMisraForks) {
+        bool got = hygienic_try_take(table, id, right_fork) && hygienic_try_take(table, id, left_fork) &&
+                   hygienic_claim_both(table, id, left_fork, right_fork);
+        return got ? start_eating(philosopher) : TaskStalled;
+    }
+
+    if (!try_take_fork(table, id, right_fork)) {
+        return TaskStalled;
+    }
+    if (try_take_fork(table, id, left_fork)) {
+        return start_eating(philosopher);
+    }
+
+    // Put the first fork back, and back off for a random, growing period.
+    put_down_fork(table, id, right_fork);
+    philosopher->task.wake_ns = now_ns() + random_below((uint64_t)philosopher->backoff_ns);
+    if (philosopher->backoff_ns < MAXIMUM_BACKOFF_NS) {
+        philosopher->backoff_ns *= 2;
+    }
+
+    return TaskStalled;
+}
+
+enum TaskStatus philosopher_step(struct Task* task) {
+    struct PhilosopherTask* philosopher = (struct PhilosopherTask*)task;
+    struct DiningTable* table = philosopher->actor->table;
+
+    switch (philosopher->state) {
+        case ThinkingState:
+            if (TerminationRequested) {
+                return TaskDone;
+            }
+
+            log_event(ThinkingEvent, 0);
+            task->wake_ns = now_ns() + thinking_ns();
+            philosopher->hungry_since = task->wake_ns;
+            philosopher->state = HungryState;
+            return TaskProgressed;
+
+        case HungryState:
+            if (ForkAcquisition == ChandyMisraForks || ForkAcquisition == TryLockForks) {
+                return try_both_forks(philosopher);
+            }
+
+            if (ForkAcquisition == WaiterForks && !philosopher->seated) {
+                if (!semaphore_trywait(&table->seats)) {
+                    return TaskStalled;
+                }
+                philosopher->seated = true;
+            }
+
+            if (!try_take_fork(table, philosopher->actor->id, philosopher->right_fork)) {
+                return TaskStalled;
+            }
+            log_event(GettingForkEvent, philosopher->right_fork);
+            philosopher->state = HoldingForkState;
+            // The second fork may well be free too.
+            // fall through
+        case HoldingForkState:
+            if (!try_take_fork(table, philosopher->actor->id, philosopher->left_fork)) {
+                return TaskStalled;
+            }
+            log_event(GettingForkEvent, philosopher->left_fork);
+            return start_eating(philosopher);
+
+        case EatingState:
+            put_down_forks(table, philosopher->actor->id, philosopher->left_fork, philosopher->right_fork);
+            philosopher->seated = false;
+            philosopher->actor->meals++;
+            philosopher->state = ThinkingState;
+            return TaskProgressed;
+    }
+
+    return TaskDone;
+}
+
+// Builds a task for each philosopher at the table and starts them on an executor of
+// its own. The tasks must be freed after executor_join.
+void start_philosopher_tasks(struct DiningTable* table) {
+    struct PhilosopherActor* philosophers = table->philosophers;
+    struct PhilosopherTask* philosopher = (struct PhilosopherTask*)calloc(PhilosopherCount,
+                                                                          sizeof(struct PhilosopherTask));
+    struct Task** queue = (struct Task**)malloc(sizeof(struct Task*) * PhilosopherCount);
+
+    for (int i = 0; i < PhilosopherCount; i++) {
+        philosopher[i].task.step = philosopher_step;
+        philosopher[i].task.id = i;
+        philosopher[i].actor = &philosophers[i];
+        philosopher[i].state = ThinkingState;
+        philosopher[i].backoff_ns = MINIMUM_BACKOFF_NS;
+        philosopher_forks(i, &philosopher[i].left_fork, &philosopher[i].right_fork);
+        queue[i] = &philosopher[i].task;
+    }
+
+    table->executor = executor_start(queue, PhilosopherCount);
+    free(queue);
+
+    table->tasks = philosopher;
+}
+
+
+//========================================================
+// Dining Philosophers fibers
+//========================================================
+
+// As fibers, philosophers go round the same cycle as think_then_eat(), but think
+// and eat on the timer wheel, and never wait for a fork: they try for it, and give
+// way to the other fibers until they get it.
+struct PhilosopherFiber {
+    struct Fiber fiber;
+
+    struct PhilosopherActor* actor;
+    int left_fork;
+    int right_fork;
+};
+
+void fiber_take_fork(struct DiningTable* table, int id, int fork) {
+    while (!try_take_fork(table, id, fork)) {
+        fiber_yield();
+    }
+}
+
+void fiber_get_forks(struct PhilosopherFiber* philosopher) {
+    struct DiningTable* table = philosopher->actor->table;
+    int id = philosopher->actor->id;
+    int left_fork = philosopher->left_fork;
+    int right_fork = philosopher->right_fork;
+
+    switch (ForkAcquisition) {
+        case ChandyMisraForks:
+            while (!(hygienic_try_take(table, id, right_fork) && hygienic_try_take(table, id, left_fork) &&
+                     hygienic_claim_both(table, id, left_fork, right_fork))) {
+                fiber_yield();
+            }
+            return;
+
+        case TryLockForks: {
+            long backoff_ns = MINIMUM_BACKOFF_NS;
+            for (;;) {
+                log_event(GettingForkEvent, right_fork);
+                fiber_take_fork(table, id, right_fork);
+
+                log_event(GettingForkEvent, left_fork);
+                if (try_take_fork(table, id, left_fork)) {
+                    return;
+                }
+
+                log_event(YieldingForkEvent, right_fork);
+                put_down_fork(table, id, right_fork);
+
+                // A backoff that does not give way would leave the neighbour holding the
+                // other fork no chance to put it down, when it shares the scheduler.
+                if (TerminationRequested) {
+                    fiber_yield();
+                } else {
+                    fiber_sleep(1 + random_below((uint64_t)backoff_ns));
+                }
+                if (backoff_ns < MAXIMUM_BACKOFF_NS) {
+                    backoff_ns *= 2;
+                }
+            }
+        }
+
+        case WaiterForks:
+            while (!semaphore_trywait(&table->seats)) {
+                fiber_yield();
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    log_event(GettingForkEvent, right_fork);
+    fiber_take_fork(table, id, right_fork);
+    log_event(GettingForkEvent, left_fork);
+    fiber_take_fork(table, id, left_fork);
+}
+
+void philosopher_fiber(struct Fiber* fiber) {
+    struct PhilosopherFiber* philosopher = (struct PhilosopherFiber*)fiber;
+    struct PhilosopherActor* actor = philosopher->actor;
+
+    while (!TerminationRequested) {
+        log_event(ThinkingEvent, 0);
+        fiber_sleep(thinking_ns());
+
+        uint64_t hungry_since = BenchMode ? now_ns() : 0;
+        fiber_get_forks(philosopher);
+        if (BenchMode) {
+            histogram_record(&actor->table->fiber_fork_waits[fiber->scheduler->id], now_ns() - hungry_since);
+        }
+
+        log_event(EatingEvent, 0);
+        fiber_sleep(eating_ns());
+        put_down_forks(actor->table, actor->id, philosopher->left_fork, philosopher->right_fork);
+        actor->meals++;
+
+        // With no thinking or eating period, nothing else would make it give way.
+        fiber_yield();
+    }
+}
+
+// Builds a fiber for each philosopher at the table and starts them on schedulers of
+// its own. Returns false when the fibers cannot be had.
+bool start_philosopher_fibers(struct DiningTable* table) {
+    table->fibers = (struct PhilosopherFiber*)calloc(PhilosopherCount, sizeof(struct PhilosopherFiber));
+    struct Fiber** fibers = (struct Fiber**)malloc(sizeof(struct Fiber*) * PhilosopherCount);
+
+    for (int i = 0; i < PhilosopherCount; i++) {
+        struct PhilosopherFiber* philosopher = &table->fibers[i];
+        philosopher->fiber.body = philosopher_fiber;
+        philosopher->fiber.id = i;
+        philosopher->actor = &table->philosophers[i];
+        philosopher_forks(i, &philosopher->left_fork, &philosopher->right_fork);
+        fibers[i] = &philosopher->fiber;
+    }
+
+    table->fiber_pool = fibers_start(fibers, PhilosopherCount);
+    free(fibers);
+
+    return table->fiber_pool != NULL;
+}
+
+
+//========================================================
+// Dining Philosophers benchmark report
+//========================================================
+
+// Jain's fairness index of the meal counts: 1 when everybody ate the same number of
+// meals, 1/N when a single philosopher got to eat everything.
+double jain_index(const struct PhilosopherActor* philosophers, int count) {
+    double sum = 0;
+    double sum_of_squares = 0;
+    for (int i = 0; i < count; i++) {
+        sum += (double)philosophers[i].meals;
+        sum_of_squares += (double)philosophers[i].meals * (double)philosophers[i].meals;
+    }
+
+    return sum_of_squares > 0 ? sum * sum / ((double)count * sum_of_squares) : 1.0;
+}
+
+void report_diners(struct DiningTable* table, uint64_t elapsed_ns) {
+    struct PhilosopherActor* philosophers = table->philosophers;
+    int count = table->seated;
+    event_log_drain();
+    const char* kind = Locking == NativeLocks ? SEMAPHORE_KIND : LockKindNames[Locking];
+    const char* forks = Locking == NativeLocks ? "semaphores" : "locks";
+    if (InstanceCount > 1) {
+        printf("\nTable %d benchmark results over %.3f s, with %s %s:\n",
+               table->id, (double)elapsed_ns / (double)NANOS_PER_SEC, kind, forks);
+    } else {
+        printf("\nBenchmark results over %.3f s, with %s %s:\n",
+               (double)elapsed_ns / (double)NANOS_PER_SEC, kind, forks);
+    }
+
+    long meals = 0;
+    long fewest = count > 0 ? philosophers[0].meals : 0;
+    long most = fewest;
+    struct Histogram* fork_wait = (struct Histogram*)calloc(1, sizeof(struct Histogram));
+    for (int i = 0; i < count; i++) {
+        if (count <= MAX_REPORTED_ACTORS) {
+            printf("  Philosopher %d: %ld meals\n", i, philosophers[i].meals);
+        }
+        meals += philosophers[i].meals;
+        fewest = philosophers[i].meals < fewest ? philosophers[i].meals : fewest;
+        most = philosophers[i].meals > most ? philosophers[i].meals : most;
+        if (philosophers[i].fork_wait != NULL) {
+            histogram_merge(fork_wait, philosophers[i].fork_wait);
+        }
+    }
+    for (int i = 0; table->fiber_fork_waits != NULL && i < fiber_scheduler_count(PhilosopherCount); i++) {
+        histogram_merge(fork_wait, &table->fiber_fork_waits[i]);
+    }
+
+    printf("  Total: %ld meals, %.0f meals/sec\n", meals, items_per_sec(meals, elapsed_ns));
+    printf("  Meals per philosopher: fewest %ld, most %ld; Jain's fairness index %.4f\n",
+           fewest, most, jain_index(philosophers, count));
+    if (table->fiber_switches > 0) {
+        printf("  Fiber switches: %llu, %.0f per second\n",
+               (unsigned long long)table->fiber_switches, items_per_sec((long)table->fiber_switches, elapsed_ns));
+    }
+    print_latency_percentiles("Fork wait", fork_wait);
+    record_run(meals, elapsed_ns, fork_wait);
+
+    free(fork_wait);
+}
+
+// With several tables, what they got through between them.
+void report_tables(struct DiningTable* tables, int count, uint64_t elapsed_ns) {
+    long meals = 0;
+    long fewest = -1;
+    long most = 0;
+    for (int t = 0; t < count; t++) {
+        long table_meals = 0;
+        for (int i = 0; i < tables[t].seated; i++) {
+            table_meals += tables[t].philosophers[i].meals;
+        }
+        meals += table_meals;
+        fewest = fewest < 0 || table_meals < fewest ? table_meals : fewest;
+        most = table_meals > most ? table_meals : most;
+    }
+
+    printf("\nAll %d tables: %ld meals, %.0f meals/sec; per table fewest %ld, most %ld\n",
+           count, meals, items_per_sec(meals, elapsed_ns), fewest, most);
+}
+
+
+//========================================================
+// Dining Philosophers runner
+//========================================================
+
+// Philosophers hardly use any stack, and with thousands of them the default 8 MB
+// each would add up to a lot of address space.
+const size_t PHILOSOPHER_STACK_SIZE = 256 * 1024;
+
+// Lays the table: its forks, i.e. the semaphores (or their hygienic counterparts),
+// and the philosophers' bookkeeping, all from the table's arena. Returns false when
+// the arena cannot be allocated.
+bool create_dining_table(struct DiningTable* table, int id) {
+    memset(table, 0, sizeof(struct DiningTable));
+    table->id = id;
+    table->first_slot = id * PhilosopherCount;
+
+    size_t count = (size_t)PhilosopherCount;
+    bool fiber_histograms = BenchMode && Execution == FiberExecutor;
+    bool philosopher_histograms = BenchMode && Execution != FiberExecutor;
+    size_t size = arena_bytes(sizeof(struct PhilosopherActor) * count) + arena_bytes(sizeof(pthread_t) * count);
+    if (ForkAcquisition == ChandyMisraForks) {
+        size += arena_bytes(sizeof(struct HygienicFork) * count);
+    } else {
+        size += arena_bytes(sizeof(struct Fork) * count);
+        size += Locking == McsLocks ? arena_bytes(sizeof(struct McsNode) * 2 * count) : 0;
+    }
+    if (fiber_histograms) {
+        size += arena_bytes(sizeof(struct Histogram) * (size_t)fiber_scheduler_count(PhilosopherCount));
+    }
+    if (philosopher_histograms) {
+        size += count * arena_bytes(sizeof(struct Histogram));
+    }
+    if (!arena_init(&table->arena, size)) {
+        return false;
+    }
+
+    if (ForkAcquisition == ChandyMisraForks) {
+        table->hygienic_forks = (struct HygienicFork*)arena_alloc(
+                &table->arena, sizeof(struct HygienicFork) * count);
+        hygienic_forks_init(table);
+    } else {
+        table->forks = (struct Fork*)arena_alloc(&table->arena, sizeof(struct Fork) * count);
+        for (int i = 0; i < PhilosopherCount; i++) {
+            switch (Locking) {
+                case TicketLocks:
+                    ticket_lock_init(&table->forks[i].ticket);
+                    break;
+
+                case McsLocks:
+                    mcs_lock_init(&table->forks[i].mcs);
+                    break;
+
+                default:
+                    semaphore_init(&table->forks[i].semaphore, 1);
+                    break;
+            }
+        }
+        semaphore_init(&table->seats, PhilosopherCount - 1);
+
+        if (Locking == McsLocks) {
+            table->fork_nodes = (struct McsNode*)arena_alloc(&table->arena, sizeof(struct McsNode) * 2 * count);
+        }
+    }
+
+    table->philosophers = (struct PhilosopherActor*)arena_alloc(
+            &table->arena, sizeof(struct PhilosopherActor) * count);
+    table->threads = (pthread_t*)arena_alloc(&table->arena, sizeof(pthread_t) * count);
+    if (fiber_histograms) {
+        table->fiber_fork_waits = (struct Histogram*)arena_alloc(
+                &table->arena, sizeof(struct Histogram) * (size_t)fiber_scheduler_count(PhilosopherCount));
+    }
+    for (int i = 0; i < PhilosopherCount; i++) {
+        table->philosophers[i].id = i;
+        table->philosophers[i].table = table;
+        if (philosopher_histograms) {
+            table->philosophers[i].fork_wait = (struct Histogram*)arena_alloc(
+                    &table->arena, sizeof(struct Histogram));
+        }
+    }
+
+    return true;
+}
+
+void destroy_dining_table(struct DiningTable* table) {
+    if (table->arena.base == NULL) {
+        return;
+    }
+
+    if (ForkAcquisition == ChandyMisraForks) {
+        hygienic_forks_destroy(table);
+    } else {
+        for (int i = 0; Locking == NativeLocks && i < PhilosopherCount; i++) {
+            semaphore_destroy(&table->forks[i].semaphore);
+        }
+        semaphore_destroy(&table->seats);
+    }
+
+    free(table->tasks);
+    free(table->fibers);
+    arena_release(&table->arena);
+
+    memset(table, 0, sizeof(struct DiningTable));
+}
+
+void seat_philosophers(struct DiningTable* table, pthread_attr_t* attributes) {
+    if (Execution == PoolExecutor) {
+        start_philosopher_tasks(table);
+        table->seated = PhilosopherCount;
+        printf("Running as tasks on %d workers.\n", table->executor->worker_count);
+        return;
+    }
+
+    if (Execution == FiberExecutor) {
+        if (start_philosopher_fibers(table)) {
+            table->seated = PhilosopherCount;
+            printf("Running as fibers on %d scheduler threads.\n", table->fiber_pool->scheduler_count);
+        } else {
+            request_termination();
+        }
+        return;
+    }
+
+    // Neighbours at the table share forks, so they get neighbouring slots.
+    for (int i = 0; i < PhilosopherCount; i++) {
+        if (pthread_create(&table->threads[i], attributes, think_then_eat,
+                           (void *) &table->philosophers[i]) != 0) {
+            printf("Unable to seat philosopher %d; the table will stay at %d.\n", i, table->seated);
+            request_termination();
+            break;
+        }
+        pin_thread(table->threads[i], table->first_slot + i);
+        table->seated++;
+    }
+}
+
+// Waits for the philosophers to be done.
+void clear_dining_table(struct DiningTable* table) {
+    if (table->executor != NULL) {
+        executor_join(table->executor);
+        table->executor = NULL;
+        return;
+    }
+
+    if (table->fiber_pool != NULL) {
+        table->fiber_switches = fibers_join(table->fiber_pool);
+        table->fiber_pool = NULL;
+        return;
+    }
+
+    for (int i = 0; i < table->seated; i++) {
+        pthread_join(table->threads[i], NULL);
+    }
+}
+
+void run_diners() {
+    printf("Running Dining Philosophers with %d philosophers, %s fork strategy.\n",
+           PhilosopherCount, ForkStrategyNames[ForkAcquisition]);
+    if (Locking != NativeLocks) {
+        printf("The forks are %s locks.\n", LockKindNames[Locking]);
+    }
+    if (InstanceCount > 1) {
+        printf("Running %d independent tables side by side.\n", InstanceCount);
+    }
+
+    if (BenchMode) {
+        printf("Benchmark mode: running for %.3f seconds, thinking %.3f ms and eating %.3f ms.\n",
+               BenchDurationSecs, ThinkMs, EatMs);
+    }
+
+    struct DiningTable* tables = (struct DiningTable*)malloc(sizeof(struct DiningTable) * InstanceCount);
+    for (int i = 0; i < InstanceCount; i++) {
+        if (!create_dining_table(&tables[i], i)) {
+            printf("Unable to allocate a table for %d philosophers.\n", PhilosopherCount);
+            for (int j = 0; j <= i; j++) {
+                destroy_dining_table(&tables[j]);
+            }
+            free(tables);
+            return;
+        }
+    }
+    print_affinity();
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, PHILOSOPHER_STACK_SIZE);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < InstanceCount && !TerminationRequested; i++) {
+        seat_philosophers(&tables[i], &attributes);
+    }
+    pthread_attr_destroy(&attributes);
+
+    // Nobody starves waiting for a fork once termination is requested: everyone
+    // still at the table finishes the meal at hand and puts the forks down, so a
+    // waiting philosopher is woken by its neighbour within a meal.
+    uint64_t deadline = BenchMode ? start + (uint64_t)(BenchDurationSecs * (double)NANOS_PER_SEC) : UINT64_MAX;
+    sleep_until(deadline);
+    request_termination();
+
+    for (int i = 0; i < InstanceCount; i++) {
+        clear_dining_table(&tables[i]);
+    }
+
+    report_shutdown();
+    if (BenchMode) {
+        uint64_t elapsed_ns = now_ns() - start;
+        for (int i = 0; i < InstanceCount; i++) {
+            report_diners(&tables[i], elapsed_ns);
+        }
+        if (InstanceCount > 1) {
+            report_tables(tables, InstanceCount, elapsed_ns);
+        }
+        report_counters("meal");
+    }
+
+    for (int i = 0; i < InstanceCount; i++) {
+        destroy_dining_table(&tables[i]);
+    }
+    free(tables);
+}
+
+
+//======================================================================================
+//
+//  Potion Brewers.
+//
+//======================================================================================
+
+// This solution implements the pushers strategy for the Cigarette Smoker's Problem
+// as presented in the Little Book of Semaphores. I prefer to call them brokers. Other
+// elements of the problem have been named according to the nomenclature used in the
+// class materials.
+//
+// Each agent puts all ingredients but one on the table, each of them through the
+// ingredient's semaphore. Each broker waits on one of those semaphores, and keeps
+// track (under a mutex) of what else is on the table; whichever broker sees the last
+// ingredient of a set wakes up the brewer that has the missing one, through that
+// brewer's own semaphore. The brewer brews, then lets the agents know the table is
+// free again. The classic problem has three ingredients; -K allows more.
+//
+// The brokers are a whole layer of threads and context switches per round, just to
+// do some bookkeeping. The bitmask matcher (--matcher bitmask) drops them: what is
+// on the table is an atomic bitmask, and the agent placing an ingredient does a
+// single CAS that either records it, or, when that completes some brewer's set,
+// clears the table and claims that brewer.
+enum BrewersMatcher {
+    BrokerMatcher,
+    BitmaskMatcher,
+    InvalidMatcher
+};
+
+enum BrewersMatcher Matching = BrokerMatcher;
+
+char* MatcherNames[] = {
+        "broker",
+        "bitmask",
+        "invalid"
+};
+
+enum BrewersMatcher parse_matcher(const char* name) {
+    for (int i = 0; i < InvalidMatcher; i++) {
+        if (strcmp(name, MatcherNames[i]) == 0) {
+            return (enum BrewersMatcher)i;
+        }
+    }
+
+    return InvalidMatcher;
+}
+
+// The bitmask matcher keeps one bit per ingredient in a 64 bit word.
+#define MAX_INGREDIENT_COUNT 64
+
+// There is one brewer per ingredient, who has plenty of it.
+int IngredientCount = 3;
+
+const char* INGREDIENT_NAMES[] = { "Bezoars", "Unicorn Horns", "Mistletoe Berries"};
+
+// Outside of benchmark mode, brewing takes a little while, so the output is readable.
+const int BREWING_MAX_SLEEP_TIME_MS = 500;
+
+// In benchmark mode, -R stops the run after this many potions instead of after
+// --duration.
+long BenchRounds = 0;
+
+// Each ingredient sits on a cache line of its own, as its flag is posted and waited
+// on by different threads than its neighbours'.
+struct Ingredient {
+    _Alignas(CACHE_LINE_SIZE) char name[32];
+
+    // Posted by the agents when they put the ingredient on the table. Broker matcher
+    // only.
+    struct Semaphore flag;
+
+    // Only looked at by brokers, under the table mutex.
+    bool is_available;
+};
+
+// Everything the agents, brokers and brewers share.
+struct Table {
+    int ingredient_count;
+    struct Ingredient* ingredients;
+
+    // One of each per ingredient, and with threads their handles. These, the
+    // ingredients and the brewers' histograms all come from the table's arena.
+    struct AgentInfo* agents;
+    struct BrokerInfo* brokers;
+    struct BrewerInfo* brewers;
+    pthread_t* agent_threads;
+    pthread_t* broker_threads;
+    pthread_t* brewer_threads;
+    struct Arena arena;
+
+    // Bitmask matcher only: the ingredients currently on the table.
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t available;
+
+    // Posted by the brewers, once they have taken the ingredients off the table.
+    _Alignas(CACHE_LINE_SIZE) struct Semaphore agent;
+
+    // Guards the brokers' view of the table. Each table has its own, rather than
+    // sharing one lock with whatever else runs in the process.
+    pthread_mutex_t mutex;
+
+    // When the agent put the current set on the table. Only one set is out at a
+    // time, and the semaphores order the write by the agent before the read by the
+    // brewer, so this needs no further synchronization.
+    uint64_t released_ns;
+
+    atomic_long potions;
+};
+
+struct BrewerInfo {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    struct Table* table;
+
+    // Posted by the matcher: brewer i has ingredient i, and needs all the others.
+    struct Semaphore ready;
+
+    long potions;
+
+    // Only in benchmark mode: from the agent releasing the ingredients to the brewer
+    // getting them.
+    struct Histogram* latency;
+};
+
+// Agent i supplies every ingredient but ingredient i, so its set goes to brewer i.
+struct AgentInfo {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    struct Table* table;
+};
+
+struct BrokerInfo {
+    _Alignas(CACHE_LINE_SIZE) int id;
+
+    struct Table* table;
+
+    // The ingredient this broker waits for, and its index.
+    int ingredient;
+};
+
+uint64_t ingredient_bit(int ingredient) {
+    return (uint64_t)1 << ingredient;
+}
+
+uint64_t all_ingredients(int count) {
+    return count == 64 ? ~(uint64_t)0 : ingredient_bit(count) - 1;
+}
+
+// Sets the termination flag and makes sure no thread stays asleep on a semaphore.
+// Every thread checks the flag as soon as it wakes up, so one post per thread that
+// may be waiting on each semaphore is enough.
+void request_brewers_termination(struct Table* table) {
+    request_termination();
+
+    for (int i = 0; i < table->ingredient_count; i++) {
+        semaphore_post(&table->agent);
+        semaphore_post(&table->brewers[i].ready);
+        semaphore_post(&table->ingredients[i].flag);
+    }
+}
+
+//========================================================
+// Broker matcher
+//========================================================
+
+// Called once the broker's ingredient is on the table.
+void broker_match(struct BrokerInfo* broker) {
+    struct Table* table = broker->table;
+    struct Ingredient* ingredients = table->ingredients;
+
+    lock_mutex(&table->mutex);
+
+    // If all the other ingredients but one are already on the table, the brewer
+    // that has that one can get going. Otherwise, note this one is on the table.
+    ingredients[broker->ingredient].is_available = true;
+    int brewer = -1;
+    int available = 0;
+    for (int i = 0; i < table->ingredient_count; i++) {
+        if (ingredients[i].is_available) {
+            available++;
+        } else {
+            brewer = i;
+        }
+    }
+
+    if (available == table->ingredient_count - 1) {
+        for (int i = 0; i < table->ingredient_count; i++) {
+            ingredients[i].is_available = false;
+        }
+    } else {
+        brewer = -1;
+    }
+
+    unlock_mutex(&table->mutex);
+
+    if (brewer >= 0) {
+        log_event(BrokeringEvent, brewer);
+        semaphore_post(&table->brewers[brewer].ready);
+    }
+}
+
+void* broker_ingredients(void* broker_info) {
+    struct BrokerInfo* broker = (struct BrokerInfo*)broker_info;
+    struct Ingredient* ingredients = broker->table->ingredients;
+
+    printf("Broker %d waiting for %s.\n", broker->id, ingredients[broker->ingredient].name);
+    event_log_open(broker->id);
+    counters_open();
+    random_seed_thread(BrokerStream, broker->id);
+
+    while (!TerminationRequested) {
+        wait_on_semaphore(&ingredients[broker->ingredient].flag);
+        if (TerminationRequested) {
+            break;
+        }
+
+        broker_match(broker);
+    }
+
+    printf("Broker %d done.\n", broker->id);
+    return NULL;
+}
+
+//========================================================
+// Bitmask matcher
+//========================================================
+
+// Puts the ingredient on the table. Returns the brewer whose set it completes, after
+// taking the set off the table; or -1 if no set is complete yet.
+int bitmask_place(struct Table* table, int ingredient) {
+    uint64_t all = all_ingredients(table->ingredient_count);
+    uint64_t available = atomic_load_explicit(&table->available, memory_order_relaxed);
+
+    for (;;) {
+        uint64_t placed = available | ingredient_bit(ingredient);
+
+        // A complete set is everything but exactly one ingredient: that brewer's.
+        uint64_t missing = all & ~placed;
+        bool complete = missing != 0 && (missing & (missing - 1)) == 0;
+
+        if (atomic_compare_exchange_weak_explicit(&table->available, &available, complete ? 0 : placed,
+                                                  memory_order_acq_rel, memory_order_relaxed)) {
+            return complete ? __builtin_ctzll(missing) : -1;
+        }
+    }
+}
+
+//========================================================
+// Potion Brewers tasks
+//========================================================
+
+// Called once the table is free: puts every ingredient but the agent's own on it.
+void release_set(struct AgentInfo* agent) {
+    struct Table* table = agent->table;
+
+    log_event(ReleasingIngredientsEvent, 0);
+    table->released_ns = BenchMode ? now_ns() : 0;
+    for (int i = 0; i < table->ingredient_count; i++) {
+        if (i == agent->id) {
+            continue;
+        }
+
+        if (Matching == BrokerMatcher) {
+            semaphore_post(&table->ingredients[i].flag);
+            continue;
+        }
+
+        int brewer = bitmask_place(table, i);
+        if (brewer >= 0) {
+            log_event(MatchingEvent, brewer);
+            semaphore_post(&table->brewers[brewer].ready);
+        }
+    }
+}
+
+// Called once the brewer has its set of ingredients.
+void start_potion(struct BrewerInfo* brewer) {
+    if (BenchMode) {
+        histogram_record(brewer->latency, now_ns() - brewer->table->released_ns);
+    }
+
+    log_event(BrewingEvent, 0);
+}
+
+// Called once the potion is brewed.
+void finish_potion(struct BrewerInfo* brewer) {
+    struct Table* table = brewer->table;
+
+    brewer->potions++;
+    semaphore_post(&table->agent);
+    log_event(UsingPotionEvent, 0);
+
+    // With a fixed number of rounds, whoever brews the last potion ends the run.
+    long brewed = atomic_fetch_add_explicit(&table->potions, 1, memory_order_relaxed) + 1;
+    if (BenchMode && BenchRounds > 0 && brewed >= BenchRounds) {
+        request_termination();
+    }
+}
+
+void* release_ingredients(void* agent_info) {
+    struct AgentInfo* agent = (struct AgentInfo*)agent_info;
+    struct Table* table = agent->table;
+
+    printf("Agent %d opening shop with everything but %s.\n", agent->id, table->ingredients[agent->id].name);
+    event_log_open(agent->id);
+    counters_open();
+    random_seed_thread(AgentStream, agent->id);
+
+    while (!TerminationRequested) {
+        wait_on_semaphore(&table->agent);
+        if (TerminationRequested) {
+            break;
+        }
+
+        release_set(agent);
+    }
+
+    printf("Agent %d closing shop.\n", agent->id);
+    return NULL;
+}
+
+void* brew(void* brewer_info) {
+    struct BrewerInfo* brewer = (struct BrewerInfo*)brewer_info;
+    struct Table* table = brewer->table;
+
+    printf("Brewer %d opening shop with plenty of %s.\n", brewer->id, table->ingredients[brewer->id].name);
+    event_log_open(brewer->id);
+    counters_open();
+    random_seed_thread(BrewerStream, brewer->id);
+
+    while (!TerminationRequested) {
+        wait_on_semaphore(&brewer->ready);
+        if (TerminationRequested) {
+            break;
+        }
+
+        start_potion(brewer);
+        if (!BenchMode) {
+            random_sleep(BREWING_MAX_SLEEP_TIME_MS);
+        }
+        finish_potion(brewer);
+    }
+
+    printf("Brewer %d closing shop.\n", brewer->id);
+    return NULL;
+}
+
+// Sets the table, and everyone around it. Returns false when the arena cannot be
+// allocated.
+bool initialize_table(struct Table* table, int ingredient_count) {
+    memset(table, 0, sizeof(struct Table));
+    size_t count = (size_t)ingredient_count;
+    size_t size = arena_bytes(sizeof(struct Ingredient) * count) +
+                  arena_bytes(sizeof(struct AgentInfo) * count) +
+                  arena_bytes(sizeof(struct BrokerInfo) * count) +
+                  arena_bytes(sizeof(struct BrewerInfo) * count) +
+                  3 * arena_bytes(sizeof(pthread_t) * count) +
+                  (BenchMode ? count * arena_bytes(sizeof(struct Histogram)) : 0);
+    if (!arena_init(&table->arena, size)) {
+        return false;
+    }
+
+    table->ingredient_count = ingredient_count;
+    table->ingredients = (struct Ingredient*)arena_alloc(&table->arena, sizeof(struct Ingredient) * count);
+    table->agents = (struct AgentInfo*)arena_alloc(&table->arena, sizeof(struct AgentInfo) * count);
+    table->brokers = (struct BrokerInfo*)arena_alloc(&table->arena, sizeof(struct BrokerInfo) * count);
+    table->brewers = (struct BrewerInfo*)arena_alloc(&table->arena, sizeof(struct BrewerInfo) * count);
+    table->agent_threads = (pthread_t*)arena_alloc(&table->arena, sizeof(pthread_t) * count);
+    table->broker_threads = (pthread_t*)arena_alloc(&table->arena, sizeof(pthread_t) * count);
+    table->brewer_threads = (pthread_t*)arena_alloc(&table->arena, sizeof(pthread_t) * count);
+    table->available = 0;
+
+    for (int i = 0; i < ingredient_count; i++) {
+        // Past the classic three, ingredients just get a number.
+        if (i < 3) {
+            snprintf(table->ingredients[i].name, sizeof(table->ingredients[i].name), "%s", INGREDIENT_NAMES[i]);
+        } else {
+            snprintf(table->ingredients[i].name, sizeof(table->ingredients[i].name), "Ingredient %d", i);
+        }
+        semaphore_init(&table->ingredients[i].flag, 0);
+        table->ingredients[i].is_available = false;
+
+        // Brewer i has ingredient i, so agent i is the one that supplies the others.
+        table->brewers[i].id = i;
+        table->brewers[i].table = table;
+        semaphore_init(&table->brewers[i].ready, 0);
+        if (BenchMode) {
+            table->brewers[i].latency = (struct Histogram*)arena_alloc(&table->arena, sizeof(struct Histogram));
+        }
+
+        table->agents[i].id = i;
+        table->agents[i].table = table;
+
+        table->brokers[i].id = i;
+        table->brokers[i].table = table;
+        table->brokers[i].ingredient = i;
+    }
+
+    // The table starts empty, so the first agent to get here can go ahead.
+    semaphore_init(&table->agent, 1);
+    pthread_mutex_init(&table->mutex, NULL);
+    table->released_ns = 0;
+    table->potions = 0;
+
+    return true;
+}
+
+void destroy_table(struct Table* table) {
+    for (int i = 0; i < table->ingredient_count; i++) {
+        semaphore_destroy(&table->ingredients[i].flag);
+        semaphore_destroy(&table->brewers[i].ready);
+    }
+
+    semaphore_destroy(&table->agent);
+    pthread_mutex_destroy(&table->mutex);
+    arena_release(&table->arena);
+}
+
+//========================================================
+// Potion Brewers executor tasks
+//========================================================
+
+// On the executor, agents, brokers and brewers are tasks that try their semaphore
+// instead of waiting on it. A brewer that is brewing (outside of benchmark mode)
+// naps as a task, and finishes the potion when it wakes up.
+struct BrewersTask {
+    struct Task task;
+
+    struct AgentInfo* agent;
+    struct BrokerInfo* broker;
+    struct BrewerInfo* brewer;
+
+    bool brewing;
+};
+
+enum TaskStatus agent_step(struct Task* task) {
+    struct AgentInfo* agent = ((struct BrewersTask*)task)->agent;
+
+    if (TerminationRequested) {
+        return TaskDone;
+    }
+    if (!semaphore_trywait(&agent->table->agent)) {
+        return TaskStalled;
+    }
+
+    // Workers run the tasks in the same order every time, so the first agent task to
+    // see the semaphore would win it every time, and only its brewer would ever brew.
+    // Whichever agent task gets there, the set comes from an agent picked at random,
+    // as the threads' race for the semaphore picks one.
+    struct Table* table = agent->table;
+    release_set(&table->agents[random_below((uint64_t)table->ingredient_count)]);
+    return TaskProgressed;
+}
+
+enum TaskStatus broker_step(struct Task* task) {
+    struct BrokerInfo* broker = ((struct BrewersTask*)task)->broker;
+
+    if (TerminationRequested) {
+        return TaskDone;
+    }
+    if (!semaphore_trywait(&broker->table->ingredients[broker->ingredient].flag)) {
+        return TaskStalled;
+    }
+
+    broker_match(broker);
+    return TaskProgressed;
+}
+
+enum TaskStatus brewer_step(struct Task* task) {
+    struct BrewersTask* brewers_task = (struct BrewersTask*)task;
+    struct BrewerInfo* brewer = brewers_task->brewer;
+
+    if (brewers_task->brewing) {
+        brewers_task->brewing = false;
+        finish_potion(brewer);
+        return TaskProgressed;
+    }
+
+    if (TerminationRequested) {
+        return TaskDone;
+    }
+    if (!semaphore_trywait(&brewer->ready)) {
+        return TaskStalled;
+    }
+
+    start_potion(brewer);
+    if (BenchMode) {
+        finish_potion(brewer);
+    } else {
+        task->wake_ns = now_ns() + random_below(BREWING_MAX_SLEEP_TIME_MS) * 1000000;
+        brewers_task->brewing = true;
+    }
+    return TaskProgressed;
+}
+
+// Builds a task for each agent, broker (with the broker matcher) and brewer, and
+// starts them on the executor. *tasks must be freed after executor_join.
+struct Executor* start_brewers_tasks(struct AgentInfo* agents, struct BrokerInfo* brokers,
+                                     struct BrewerInfo* brewers, int count, struct BrewersTask** tasks) {
+    int task_count = Matching == BrokerMatcher ? 3 * count : 2 * count;
+    struct BrewersTask* brewers_tasks = (struct BrewersTask*)calloc(task_count, sizeof(struct BrewersTask));
+    struct Task** queue = (struct Task**)malloc(sizeof(struct Task*) * task_count);
+
+    for (int i = 0; i < task_count; i++) {
+        struct BrewersTask* task = &brewers_tasks[i];
+        int id = i % count;
+
+        if (i < count) {
+            task->brewer = &brewers[id];
+            task->task.step = brewer_step;
+        } else if (i < 2 * count) {
+            task->agent = &agents[id];
+            task->task.step = agent_step;
+        } else {
+            task->broker = &brokers[id];
+            task->task.step = broker_step;
+        }
+        task->task.id = id;
+        queue[i] = &task->task;
+    }
+
+    struct Executor* executor = executor_start(queue, task_count);
+    free(queue);
+
+    *tasks = brewers_tasks;
+    return executor;
+}
+
+
+//========================================================
+// Potion Brewers benchmark report
+//========================================================
+
+void report_brewers(struct BrewerInfo* brewers, int count, uint64_t elapsed_ns) {
+    event_log_drain();
+    printf("\nBenchmark results over %.3f s, with %s semaphores:\n",
+           (double)elapsed_ns / (double)NANOS_PER_SEC, SEMAPHORE_KIND);
+
+    long potions = 0;
+    struct Histogram* latency = (struct Histogram*)calloc(1, sizeof(struct Histogram));
+    for (int i = 0; i < count; i++) {
+        printf("  Brewer %d: %ld potions, %.0f potions/sec\n",
+               i, brewers[i].potions, items_per_sec(brewers[i].potions, elapsed_ns));
+        potions += brewers[i].potions;
+        histogram_merge(latency, brewers[i].latency);
+    }
+
+    printf("  Total: %ld potions, %.0f potions/sec\n", potions, items_per_sec(potions, elapsed_ns));
+    print_latency_percentiles("Agent to brewer latency", latency);
+    record_run(potions, elapsed_ns, latency);
+
+    free(latency);
+}
+
+//========================================================
+// Potion Brewers runner
+//========================================================
+
+void run_brewers() {
+    int count = IngredientCount;
+    printf("Running Potion Brewers with %d ingredients, %s matcher.\n", count, MatcherNames[Matching]);
+
+    if (BenchMode) {
+        if (BenchRounds > 0) {
+            printf("Benchmark mode: running until %ld potions have been brewed.\n", BenchRounds);
+        } else {
+            printf("Benchmark mode: running for %.3f seconds.\n", BenchDurationSecs);
+        }
+    }
+
+    struct Table table;
+    if (!initialize_table(&table, count)) {
+        printf("Unable to allocate a table for %d ingredients.\n", count);
+        return;
+    }
+
+    pthread_t* brewers = table.brewer_threads;
+    pthread_t* agents = table.agent_threads;
+    pthread_t* brokers = table.broker_threads;
+    bool use_brokers = Matching == BrokerMatcher;
+
+    print_affinity();
+
+    uint64_t start = now_ns();
+
+    struct Executor* executor = NULL;
+    struct BrewersTask* tasks = NULL;
+    if (Execution == PoolExecutor) {
+        executor = start_brewers_tasks(table.agents, table.brokers, table.brewers, count, &tasks);
+        printf("Running as tasks on %d workers.\n", executor->worker_count);
+    }
+
+    for (int i = 0; executor == NULL && i < count; i++) {
+        pthread_create(&brewers[i], NULL, brew, (void *) &table.brewers[i]);
+        pthread_create(&agents[i], NULL, release_ingredients, (void *) &table.agents[i]);
+        pin_thread(agents[i], 3 * i);
+        pin_thread(brewers[i], 3 * i + 2);
+
+        if (use_brokers) {
+            pthread_create(&brokers[i], NULL, broker_ingredients, (void *) &table.brokers[i]);
+            pin_thread(brokers[i], 3 * i + 1);
+        }
+    }
+
+    // Everybody blocks on semaphores, so it is up to this thread to wake them up
+    // once the run is over: after --duration, after -R rounds, or on SIGINT.
+    uint64_t deadline = BenchMode && BenchRounds == 0
+            ? start + (uint64_t)(BenchDurationSecs * (double)NANOS_PER_SEC)
+            : UINT64_MAX;
+    sleep_until(deadline);
+    request_brewers_termination(&table);
+
+    // Wait for everyone to be done.
+    if (executor != NULL) {
+        executor_join(executor);
+        free(tasks);
+    }
+    for (int i = 0; executor == NULL && i < count; i++) {
+        pthread_join(agents[i], NULL);
+        if (use_brokers) {
+            pthread_join(brokers[i], NULL);
+        }
+        pthread_join(brewers[i], NULL);
+    }
+
+    report_shutdown();
+    if (BenchMode) {
+        report_brewers(table.brewers, count, now_ns() - start);
+        report_counters("potion");
+    }
+
+    destroy_table(&table);
+}
+
+
+//======================================================================================
+//
+//  MAIN: command line parser, usage help, top level routine.
+//
+//======================================================================================
+
+//========================================================
+// Concurrency Problem Management
+//========================================================
+
+// Represents the concurrency problem to tackle:
+//   - Producers/Consumers
+//   - Dining Philosophers
+//   - Potion Brewers
+enum Model {
+    ProdCon,
+    Diners,
+    Brewers,
+    None
 };
 
 enum Model ProblemType = None;
 
-char* ModelNames[] = {
-        "Producers/Consumers",
-        "Dining Philosophers",
-        "Potion Brewers",
-        "Invalid"
-};
+char* ModelNames[] = {
+        "Producers/Consumers",
+        "Dining Philosophers",
+        "Potion Brewers",
+        "Invalid"
+};
+
+//========================================================
+// Sweep parameters
+//========================================================
+
+// With --sweep, the harness (see Benchmark harness below) runs the model over every
+// combination of the values given to these options as comma-separated lists, such
+// as -n 1,2,4 -Q mutex,mpmc. The first option in the string varies slowest.
+const char* SWEEP_OPTIONS = "QqncSNL";
+#define SWEEP_OPTION_COUNT 7
+#define MAX_SWEEP_VALUES 32
+
+struct SweepList {
+    int count;
+    char* values[MAX_SWEEP_VALUES];
+};
+
+// Indexed like SWEEP_OPTIONS. A count of 0 means the option was not given, and -1
+// that its list is not valid.
+struct SweepList SweepLists[SWEEP_OPTION_COUNT];
+
+bool SweepMode = false;
+
+// Each combination is run --warmup times for nothing, then --repeat times for real.
+int SweepRepeats = 5;
+int SweepWarmups = 1;
+
+enum ResultsFormat {
+    CsvResults,
+    JsonResults,
+    InvalidResults
+};
+
+enum ResultsFormat ResultsOutput = CsvResults;
+
+char* ResultsFormatNames[] = {
+        "csv",
+        "json",
+        "invalid"
+};
+
+enum ResultsFormat parse_results_format(const char* name) {
+    for (int i = 0; i < InvalidResults; i++) {
+        if (strcmp(name, ResultsFormatNames[i]) == 0) {
+            return (enum ResultsFormat)i;
+        }
+    }
+
+    return InvalidResults;
+}
+
+// Where the results go, --results-file. Standard output by default.
+char* ResultsPath = NULL;
+
+struct SweepList* sweep_list(int option) {
+    return &SweepLists[strchr(SWEEP_OPTIONS, option) - SWEEP_OPTIONS];
+}
+
+// Remembers the option's list of values, and returns the first one, for the option
+// to be set to and checked as usual.
+const char* sweep_option(int option, const char* text) {
+    struct SweepList* list = sweep_list(option);
+    char* next = strdup(text);
+
+    list->count = 0;
+    while (true) {
+        char* comma = strchr(next, ',');
+        if (comma != NULL) {
+            *comma = '\0';
+        }
+        if (*next == '\0' || list->count == MAX_SWEEP_VALUES) {
+            list->count = -1;
+            return text;
+        }
+        list->values[list->count++] = next;
+
+        if (comma == NULL) {
+            return list->values[0];
+        }
+        next = comma + 1;
+    }
+}
+
+// Sets one of the options a sweep can go over.
+void set_sweep_option(int option, const char* value) {
+    switch (option) {
+        case 'n':
+            ProducerCount = atoi(value);
+            break;
+
+        case 'c':
+            ConsumerCount = atoi(value);
+            break;
+
+        case 'q':
+            RequestedCapacity = strtoul(value, NULL, 10);
+            break;
+
+        case 'Q':
+            Backend = parse_backend(value);
+            break;
+
+        case 'N':
+            PhilosopherCount = atoi(value);
+            break;
+
+        case 'S':
+            ForkAcquisition = parse_fork_strategy(value);
+            break;
+
+        case 'L':
+            Locking = parse_lock_kind(value);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// The number of combinations to go over.
+int sweep_combination_count() {
+    int count = 1;
+    for (int i = 0; i < SWEEP_OPTION_COUNT; i++) {
+        count *= SweepLists[i].count > 0 ? SweepLists[i].count : 1;
+    }
+
+    return count;
+}
+
+// The value the given option takes in the given combination, the last option
+// varying fastest. NULL when the option is not swept.
+const char* sweep_value(int combination, int option_index) {
+    for (int i = SWEEP_OPTION_COUNT - 1; i > option_index; i--) {
+        combination /= SweepLists[i].count > 0 ? SweepLists[i].count : 1;
+    }
+
+    struct SweepList* list = &SweepLists[option_index];
+    return list->count > 0 ? list->values[combination % list->count] : NULL;
+}
+
+void set_sweep_combination(int combination) {
+    for (int i = 0; i < SWEEP_OPTION_COUNT; i++) {
+        const char* value = sweep_value(combination, i);
+        if (value != NULL) {
+            set_sweep_option(SWEEP_OPTIONS[i], value);
+        }
+    }
+}
+
+//========================================================
+// Command line parsing
+//========================================================
+
+// Options that only have a long form are identified by values beyond any character.
+// Marks a --think or --eat value that is not a valid period.
+#define INVALID_MILLISECONDS (-2.0)
+
+double parse_milliseconds(const char* text) {
+    char* end;
+    double ms = strtod(text, &end);
+
+    return end == text || *end != '\0' || ms < 0 ? INVALID_MILLISECONDS : ms;
+}
+
+enum LongOption {
+    BenchOption = 256,
+    DurationOption,
+    ItemsOption,
+    AffinityOption,
+    WaitOption,
+    ThinkOption,
+    EatOption,
+    MatcherOption,
+    ExecutorOption,
+    WorkersOption,
+    PayloadOption,
+    ShardsOption,
+    WorkOption,
+    TelemetryOption,
+    SampleOption,
+    TelemetryFileOption,
+    DrainOption,
+    SeedOption,
+    InstancesOption,
+    SweepOption,
+    RepeatOption,
+    WarmupOption,
+    ResultsOption,
+    ResultsFileOption,
+    TimersOption,
+    ShmOption,
+    RoleOption,
+    CountersOption,
+    LanesOption,
+    LanePolicyOption,
+    LaneWeightsOption
+};
+
+struct option LongOptions[] = {
+        {"bench",    no_argument,       NULL, BenchOption},
+        {"duration", required_argument, NULL, DurationOption},
+        {"items",    required_argument, NULL, ItemsOption},
+        {"affinity", required_argument, NULL, AffinityOption},
+        {"wait",     required_argument, NULL, WaitOption},
+        {"think",    required_argument, NULL, ThinkOption},
+        {"eat",      required_argument, NULL, EatOption},
+        {"matcher",  required_argument, NULL, MatcherOption},
+        {"executor", required_argument, NULL, ExecutorOption},
+        {"workers",  required_argument, NULL, WorkersOption},
+        {"payload",  required_argument, NULL, PayloadOption},
+        {"shards",   no_argument,       NULL, ShardsOption},
+        {"work",     required_argument, NULL, WorkOption},
+        {"telemetry", required_argument, NULL, TelemetryOption},
+        {"sample-ms", required_argument, NULL, SampleOption},
+        {"telemetry-file", required_argument, NULL, TelemetryFileOption},
+        {"drain",    no_argument,       NULL, DrainOption},
+        {"seed",     required_argument, NULL, SeedOption},
+        {"instances", required_argument, NULL, InstancesOption},
+        {"sweep",    no_argument,       NULL, SweepOption},
+        {"repeat",   required_argument, NULL, RepeatOption},
+        {"warmup",   required_argument, NULL, WarmupOption},
+        {"results",  required_argument, NULL, ResultsOption},
+        {"results-file", required_argument, NULL, ResultsFileOption},
+        {"timers",   required_argument, NULL, TimersOption},
+        {"shm",      required_argument, NULL, ShmOption},
+        {"role",     required_argument, NULL, RoleOption},
+        {"counters", no_argument,       NULL, CountersOption},
+        {"lanes",    required_argument, NULL, LanesOption},
+        {"lane-policy", required_argument, NULL, LanePolicyOption},
+        {"lane-weights", required_argument, NULL, LaneWeightsOption},
+        {NULL,       0,                 NULL, 0}
+};
+
+const char* long_option_name(int value) {
+    for (int i = 0; LongOptions[i].name != NULL; i++) {
+        if (LongOptions[i].val == value) {
+            return LongOptions[i].name;
+        }
+    }
+
+    return "?";
+}
+
+// The checks that only apply to -P. Stage thread counts stand in for -n and -c.
+void parse_pipeline_options() {
+    bool valid = PipelineStageCount >= 2;
+    bool single_threaded = true;
+    for (int i = 0; i < PipelineStageCount; i++) {
+        valid = valid && StageThreads[i] <= MAX_STAGE_THREADS;
+        single_threaded = single_threaded && StageThreads[i] == 1;
+    }
+
+    if (!valid) {
+        printf("The -P option must be followed by 2 to %d colon-separated thread counts of at most %d, "
+               "such as 4:8:2.\n", MAX_PIPELINE_STAGES, MAX_STAGE_THREADS);
+        ProblemType = None;
+        return;
+    }
+
+    if (StageWorkCount < 0 || (StageWorkCount > 1 && StageWorkCount != PipelineStageCount)) {
+        printf("The --work option must be followed by a number of rounds, or one per stage such as 0:500:100.\n");
+        ProblemType = None;
+    }
+
+    if (Sharded || Execution == PoolExecutor) {
+        printf("The pipeline runs every stage on threads of its own, without --shards or --executor pool.\n");
+        ProblemType = None;
+    }
+
+    if (Backend == SpscBackend && !single_threaded) {
+        printf("The spsc queue supports a pipeline only with one thread per stage (such as -P 1:1:1).\n");
+        ProblemType = None;
+    }
+}
+
+// The checks on the options as a whole, once they are all set.
+void validate_options() {
+    if (PipelineStageCount != 0) {
+        parse_pipeline_options();
+    } else if  (ProblemType == ProdCon && ((ProducerCount == 0 && SharedQueueRole != ConsumerRole) ||
+                                           (ConsumerCount == 0 && SharedQueueRole != ProducerRole))) {
+        printf("For the Producer/Consumer, both the -n and -c commands must be "
+               "present (only -n with --role producers, only -c with --role consumers) "
+               "and each followed by an integer value greater than zero.\n");
+        ProblemType = None;
+    }
+
+    if (SharedQueueRole == InvalidRole) {
+        printf("The --role option must be one of: both, producers, consumers.\n");
+        ProblemType = None;
+    } else if (SharedQueueRole != BothRoles && SharedQueueName == NULL) {
+        printf("The --role option only applies with --shm.\n");
+        ProblemType = None;
+    } else if (SharedQueueRole == ProducerRole) {
+        ConsumerCount = 0;
+    } else if (SharedQueueRole == ConsumerRole) {
+        ProducerCount = 0;
+    }
+
+    // The other processes can neither be told how many --items were consumed nor
+    // use an MCS node that lives in this one's memory; --sweep would fork runs that
+    // share the one object.
+    if (SharedQueueName != NULL && (ProblemType != ProdCon || PipelineStageCount != 0 || Sharded ||
+                                    InstanceCount > 1 || Execution != ThreadExecutor || SweepMode ||
+                                    BenchItems > 0 || Locking != NativeLocks)) {
+        printf("The --shm option applies to -p alone, without --shards, --instances, --executor, --sweep, "
+               "--items or -L.\n");
+        ProblemType = None;
+    }
+    FutexPrivateFlag = SharedQueueName != NULL ? 0 : FUTEX_PRIVATE_FLAG;
+
+    if (LaneCount < 1) {
+        printf("The --lanes option must be followed by the shares of 1 to %d lanes, each at least 1, "
+               "such as 1:9.\n", MAX_LANES);
+        ProblemType = None;
+    } else if (LaneCount > 1 && (ProblemType != ProdCon || PipelineStageCount != 0 || Sharded ||
+                                 SharedQueueName != NULL || BenchItems > 0)) {
+        printf("The --lanes option applies to -p, without --shards, --shm or --items.\n");
+        ProblemType = None;
+    }
+
+    if (LaneScheduling == InvalidLanes) {
+        printf("The --lane-policy option must be one of: strict, wrr.\n");
+        ProblemType = None;
+    } else if (LaneWeightCount != 0 && (LaneScheduling != WeightedLanes || LaneWeightCount != LaneCount)) {
+        printf("The --lane-weights option goes with --lane-policy wrr, and takes one weight of at least 1 "
+               "per lane, such as 4:1.\n");
+        ProblemType = None;
+    }
+
+    LaneShareTotal = 0;
+    for (int i = 0; i < LaneCount; i++) {
+        LaneShareTotal += LaneShares[i];
+        LaneWeights[i] = LaneWeightCount > 0 ? LaneWeights[i] : 1;
+    }
+
+    if (ProblemType == ProdCon && Backend == InvalidBackend) {
+        printf("The -Q option must be one of: mutex, spsc, mpmc.\n");
+        ProblemType = None;
+    }
+
+    if (ProblemType == ProdCon && BatchSize < 1) {
+        printf("The -B option must be followed by an integer value greater than zero.\n");
+        ProblemType = None;
+    }
+
+    if (ProblemType == ProdCon && (RequestedCapacity == 0 || RequestedCapacity > MAX_QUEUE_CAPACITY)) {
+        printf("The -q option must be followed by a queue capacity between 1 and %zu.\n", MAX_QUEUE_CAPACITY);
+        ProblemType = None;
+    }
+
+    // Sharded, each queue has a single producer, so one consumer is all it takes.
+    if (ProblemType == ProdCon && PipelineStageCount == 0 && Backend == SpscBackend && (ConsumerCount > 1 || (ProducerCount > 1 && !Sharded))) {
+        printf("The spsc queue supports exactly one producer and one consumer (-n 1 -c 1, or -c 1 with --shards).\n");
+        ProblemType = None;
+    }
+
+    if (ProblemType == Diners && (PhilosopherCount < 2 || PhilosopherCount > MAX_PHILOSOPHER_COUNT)) {
+        printf("The -N option must be followed by a number of philosophers between 2 and %d.\n",
+               MAX_PHILOSOPHER_COUNT);
+        ProblemType = None;
+    }
+
+    if (ProblemType == Diners && ForkAcquisition == InvalidForks) {
+        printf("The -S option must be one of: leftie, waiter, chandy, trylock.\n");
+        ProblemType = None;
+    }
+
+    if (Locking == InvalidLocks) {
+        printf("The -L option must be one of: native, ticket, mcs.\n");
+        ProblemType = None;
+    } else if (Locking != NativeLocks && (ProblemType == Brewers ||
+                                          (ProblemType == ProdCon && Backend != MutexBackend) ||
+                                          (ProblemType == Diners && ForkAcquisition == ChandyMisraForks))) {
+        printf("The -L option applies to the forks of -d (but not -S chandy) and to the mutex queue "
+               "of -p and -P.\n");
+        ProblemType = None;
+    }
+
+    if (ThinkMs == INVALID_MILLISECONDS || EatMs == INVALID_MILLISECONDS) {
+        printf("The --think and --eat options must be followed by a number of milliseconds, 0 or more.\n");
+        ProblemType = None;
+    } else if (BenchMode) {
+        ThinkMs = ThinkMs < 0 ? 0 : ThinkMs;
+        EatMs = EatMs < 0 ? 0 : EatMs;
+    }
+
+    if (PayloadSize > MAX_PAYLOAD_SIZE) {
+        printf("The --payload option must be followed by a number of bytes, at most %zu.\n", MAX_PAYLOAD_SIZE);
+        ProblemType = None;
+    }
 
-//========================================================
-// Command line parsing
-//========================================================
+    if (TelemetryOutput == InvalidTelemetry) {
+        printf("The --telemetry option must be one of: none, summary, csv, json.\n");
+        ProblemType = None;
+    }
+
+    if (SampleIntervalMs <= 0 || SampleIntervalMs > MAX_SAMPLE_INTERVAL_MS) {
+        printf("The --sample-ms option must be followed by a period in milliseconds, at most %.0f.\n",
+               MAX_SAMPLE_INTERVAL_MS);
+        ProblemType = None;
+    }
+
+    if (Execution == InvalidExecutor) {
+        printf("The --executor option must be one of: threads, pool, fibers.\n");
+        ProblemType = None;
+    } else if (Execution == FiberExecutor && ProblemType != Diners) {
+        printf("The fibers executor is only for the Dining Philosophers (-d).\n");
+        ProblemType = None;
+    }
+
+    if (WorkerCount < 0) {
+        printf("The --workers option must be followed by a positive number of workers.\n");
+        ProblemType = None;
+    }
+
+    if (Waiting == InvalidWait) {
+        printf("The --wait option must be one of: spin, yield, block, adaptive.\n");
+        ProblemType = None;
+    }
+
+    if (Timing == InvalidTimers) {
+        printf("The --timers option must be one of: wheel, sleep.\n");
+        ProblemType = None;
+    }
+
+    if (LogVerbosity == InvalidLog) {
+        printf("The -v option must be one of: none (0), sampled (1), full (2).\n");
+        ProblemType = None;
+    } else if (LogVerbosity < 0) {
+        LogVerbosity = BenchMode ? QuietLog : FullLog;
+    }
+
+    if (BenchMode && (BenchDurationSecs <= 0 || BenchItems < 0)) {
+        printf("The --duration option must be a positive number of seconds and --items a positive count.\n");
+        ProblemType = None;
+    }
+
+    if (ProblemType == Brewers && (IngredientCount < 3 || IngredientCount > MAX_INGREDIENT_COUNT)) {
+        printf("The -K option must be followed by a number of ingredients between 3 and %d.\n",
+               MAX_INGREDIENT_COUNT);
+        ProblemType = None;
+    }
+
+    if (ProblemType == Brewers && Matching == InvalidMatcher) {
+        printf("The --matcher option must be one of: broker, bitmask.\n");
+        ProblemType = None;
+    }
+
+    if (HardwareCounters && !BenchMode) {
+        printf("The --counters option only applies with --bench, whose reports it adds to.\n");
+        ProblemType = None;
+    }
+
+    if (BenchMode && BenchRounds < 0) {
+        printf("The -R option must be followed by a positive number of rounds.\n");
+        ProblemType = None;
+    }
+
+    // Several instances all run until --duration is up (or SIGINT); a single one
+    // running out of --items would end the others' run too.
+    if (InstanceCount < 1 || InstanceCount > MAX_INSTANCES) {
+        printf("The --instances option must be followed by a number of instances between 1 and %d.\n",
+               MAX_INSTANCES);
+        ProblemType = None;
+    } else if (InstanceCount > 1 && (ProblemType == Brewers || PipelineStageCount != 0 || BenchItems > 0 ||
+                                     TelemetryOutput != NoTelemetry)) {
+        printf("The --instances option applies to -p and -d, without --items or --telemetry.\n");
+        ProblemType = None;
+    }
+}
 
 void parse_command_line(int argc, char **argv) {
     int option;
-    while ((option = getopt(argc, argv, "dbpn:c:")) != -1) {
+    while ((option = getopt_long(argc, argv, "dbpn:c:Q:B:q:v:N:S:R:K:P:L:", LongOptions, NULL)) != -1) {
         switch (option) {
             case 'd':
                 ProblemType = Diners;
@@ -601,23 +7640,199 @@ void parse_command_line(int argc, char **argv) {
                 ProblemType = ProdCon;
                 break;
 
-            case 'n':
-                ProducerCount = atoi(optarg);
+            case 'P':
+                ProblemType = ProdCon;
+                PipelineStageCount = parse_stage_list(optarg, StageThreads, MAX_PIPELINE_STAGES, 1);
                 break;
 
+            case 'n':
             case 'c':
-                ConsumerCount = atoi(optarg);
+            case 'q':
+            case 'Q':
+            case 'N':
+            case 'S':
+            case 'L':
+                set_sweep_option(option, sweep_option(option, optarg));
+                break;
+
+            case 'B':
+                BatchSize = atoi(optarg);
+                break;
+
+            case 'v':
+                LogVerbosity = parse_verbosity(optarg);
+                break;
+
+            case 'K':
+                IngredientCount = atoi(optarg);
+                break;
+
+            case 'R':
+                BenchMode = true;
+                BenchRounds = atol(optarg) > 0 ? atol(optarg) : -1;
+                break;
+
+            case BenchOption:
+                BenchMode = true;
+                break;
+
+            case DurationOption:
+                BenchDurationSecs = strtod(optarg, NULL);
+                break;
+
+            case ItemsOption:
+                BenchItems = atol(optarg);
+                break;
+
+            case WaitOption:
+                Waiting = parse_wait_strategy(optarg);
+                break;
+
+            case TimersOption:
+                Timing = parse_timers(optarg);
+                break;
+
+            case ShmOption:
+                SharedQueueName = optarg;
+                break;
+
+            case RoleOption:
+                SharedQueueRole = parse_shared_role(optarg);
+                break;
+
+            case CountersOption:
+                HardwareCounters = true;
+                break;
+
+            case LanesOption:
+                LaneCount = parse_stage_list(optarg, LaneShares, MAX_LANES, 1);
+                break;
+
+            case LanePolicyOption:
+                LaneScheduling = parse_lane_policy(optarg);
+                break;
+
+            case LaneWeightsOption:
+                LaneWeightCount = parse_stage_list(optarg, LaneWeights, MAX_LANES, 1);
+                break;
+
+            case ThinkOption:
+                ThinkMs = parse_milliseconds(optarg);
+                break;
+
+            case EatOption:
+                EatMs = parse_milliseconds(optarg);
+                break;
+
+            case MatcherOption:
+                Matching = parse_matcher(optarg);
+                break;
+
+            case ExecutorOption:
+                Execution = parse_executor(optarg);
+                break;
+
+            case PayloadOption:
+                PayloadSize = strtoul(optarg, NULL, 10);
+                break;
+
+            case ShardsOption:
+                Sharded = true;
+                break;
+
+            case WorkOption:
+                StageWorkCount = parse_stage_list(optarg, StageWork, MAX_PIPELINE_STAGES, 0);
+                break;
+
+            case TelemetryOption:
+                TelemetryOutput = parse_telemetry_mode(optarg);
+                break;
+
+            case SampleOption:
+                SampleIntervalMs = parse_milliseconds(optarg);
+                break;
+
+            case TelemetryFileOption:
+                TelemetryPath = optarg;
+                break;
+
+            case DrainOption:
+                DrainOnShutdown = true;
+                break;
+
+            case SeedOption: {
+                char* end;
+                RandomSeed = strtoull(optarg, &end, 0);
+                RandomSeedGiven = true;
+                if (end == optarg || *end != '\0') {
+                    printf("The --seed option must be followed by a number.\n");
+                    ProblemType = None;
+                    return;
+                }
+                break;
+            }
+
+            case InstancesOption:
+                InstanceCount = atoi(optarg);
+                break;
+
+            case SweepOption:
+                SweepMode = true;
+                BenchMode = true;
+                break;
+
+            case RepeatOption:
+                SweepRepeats = atoi(optarg);
+                break;
+
+            case WarmupOption:
+                SweepWarmups = atoi(optarg) >= 0 ? atoi(optarg) : -1;
+                break;
+
+            case ResultsOption:
+                ResultsOutput = parse_results_format(optarg);
+                break;
+
+            case ResultsFileOption:
+                ResultsPath = optarg;
+                break;
+
+            case WorkersOption:
+                WorkerCount = atoi(optarg) > 0 ? atoi(optarg) : -1;
+                break;
+
+            case AffinityOption:
+                if (!parse_affinity(optarg)) {
+                    printf("The --affinity option must be compact, scatter or a CPU list such as 0,2,4-7.\n");
+                    ProblemType = None;
+                    return;
+                }
                 break;
 
             case '?':
                 switch (optopt) {
                     case 'n':
                     case 'c':
+                    case 'Q':
+                    case 'B':
+                    case 'q':
+                    case 'v':
+                    case 'N':
+                    case 'S':
+                    case 'R':
+                    case 'K':
+                    case 'P':
                         printf("Option %c requires a value.\n", optopt);
                         break;
 
                     default:
-                        printf("Unknown option character %c.\n", optopt);
+                        if (optopt >= BenchOption) {
+                            printf("Option --%s requires a value.\n", long_option_name(optopt));
+                        } else if (optopt == 0) {
+                            printf("Unknown option %s.\n", argv[optind - 1]);
+                        } else {
+                            printf("Unknown option character %c.\n", optopt);
+                        }
                         ProblemType = None;
                         return;
                 }
@@ -628,17 +7843,347 @@ void parse_command_line(int argc, char **argv) {
         }
     }
 
-    if  (ProblemType == ProdCon && (ProducerCount == 0 || ConsumerCount == 0)) {
-        printf("For the Producer/Consumer, both the -n and -c commands must be "
-               "present and each followed by an integer value greater than zero.\n");
+    bool lists = false;
+    for (int i = 0; i < SWEEP_OPTION_COUNT; i++) {
+        if (SweepLists[i].count < 0) {
+            printf("The -%c option takes at most %d comma-separated values, none of them empty.\n",
+                   SWEEP_OPTIONS[i], MAX_SWEEP_VALUES);
+            ProblemType = None;
+        }
+        lists = lists || SweepLists[i].count > 1;
+    }
+
+    if (lists && !SweepMode) {
+        printf("Lists of values, such as -n 1,2,4, are only taken with --sweep.\n");
+        ProblemType = None;
+    }
+
+    if (SweepMode && (SweepRepeats < 1 || SweepWarmups < 0)) {
+        printf("The --repeat option must be followed by a positive number of runs, and --warmup by 0 or more.\n");
         ProblemType = None;
     }
 
-    if ((ProblemType == Diners || ProblemType == Brewers && argc > 2) || (ProblemType == ProdCon && argc > 6)) {
+    if (ResultsOutput == InvalidResults) {
+        printf("The --results option must be one of: csv, json.\n");
+        ProblemType = None;
+    }
+
+    // A sweep checks the rest for each combination in turn, as some may be valid
+    // and others not (such as spsc with -n 1,2).
+    if (!SweepMode) {
+        validate_options();
+    }
+
+    if (ProblemType != None && optind < argc) {
         printf("Solution set to %s, extra parameters passed will be ignored.\n", ModelNames[ProblemType]);
     }
 }
 
+//========================================================
+// Benchmark harness
+//========================================================
+
+// Runs the model chosen on the command line, once.
+void run_model() {
+    timer_service_start();
+
+    switch (ProblemType) {
+        case ProdCon:
+            if (PipelineStageCount > 0) {
+                run_pipeline();
+            } else {
+                run_prodcon();
+            }
+            break;
+
+        case Diners:
+            run_diners();
+            break;
+
+        case Brewers:
+            run_brewers();
+            break;
+
+        default:
+            break;
+    }
+
+    timer_service_stop();
+}
+
+// With --sweep, every combination of the swept options is run --warmup times and
+// then --repeat times, each run in a child process of its own: whatever a run leaves
+// behind (threads, queues, the termination flag) goes with it, and wait4() hands
+// over the CPU time it used. The child's chatter is thrown away; it sends back its
+// RunResult through a pipe. Each combination makes one line of results, csv or json
+// like the telemetry, and the progress goes to standard error.
+#define SWEEP_INVALID_COMBINATION 2
+
+struct SweepRun {
+    struct RunResult result;
+    double user_s;
+    double system_s;
+};
+
+double timeval_secs(struct timeval timeval) {
+    return (double)timeval.tv_sec + (double)timeval.tv_usec / 1E6;
+}
+
+// Runs the current combination once. Returns 0 when it went through, or the
+// child's exit status otherwise (SWEEP_INVALID_COMBINATION when the combination
+// does not pass validate_options).
+int sweep_run(int run, struct SweepRun* sweep_run) {
+    int channel[2];
+    if (pipe(channel) != 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if (child < 0) {
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+
+    if (child == 0) {
+        close(channel[0]);
+
+        // Why a combination is not valid is progress as far as the sweep goes.
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        validate_options();
+        if (ProblemType == None) {
+            fflush(stdout);
+            _exit(SWEEP_INVALID_COMBINATION);
+        }
+
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+
+        // Without --seed, each run gets a seed of its own.
+        if (!RandomSeedGiven) {
+            RandomSeed = mix_seed(RandomSeed + (uint64_t)run);
+        }
+        random_seed_thread(MainStream, 0);
+
+        memset(&LastRun, 0, sizeof(LastRun));
+        event_log_start();
+        run_model();
+        event_log_stop();
+
+        const char* next = (const char*)&LastRun;
+        size_t left = sizeof(LastRun);
+        while (left > 0) {
+            ssize_t written = write(channel[1], next, left);
+            if (written <= 0) {
+                _exit(1);
+            }
+            next += written;
+            left -= (size_t)written;
+        }
+        _exit(0);
+    }
+
+    close(channel[1]);
+    char* next = (char*)&sweep_run->result;
+    size_t left = sizeof(sweep_run->result);
+    while (left > 0) {
+        ssize_t got = read(channel[0], next, left);
+        if (got <= 0) {
+            break;
+        }
+        next += got;
+        left -= (size_t)got;
+    }
+    close(channel[0]);
+
+    int status;
+    struct rusage usage;
+    while (wait4(child, &status, 0, &usage) < 0 && errno == EINTR) {
+        // A SIGINT for the whole sweep lands here too; the child gets it as well.
+    }
+    sweep_run->user_s = timeval_secs(usage.ru_utime);
+    sweep_run->system_s = timeval_secs(usage.ru_stime);
+
+    if (!WIFEXITED(status)) {
+        return -1;
+    }
+    if (WEXITSTATUS(status) != 0 || left > 0) {
+        return WEXITSTATUS(status) != 0 ? WEXITSTATUS(status) : -1;
+    }
+
+    return 0;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+const char* sweep_model_name() {
+    switch (ProblemType) {
+        case ProdCon:
+            return PipelineStageCount > 0 ? "pipeline" : "prodcon";
+
+        case Diners:
+            return "diners";
+
+        case Brewers:
+            return "brewers";
+
+        default:
+            return "none";
+    }
+}
+
+// The swept options and their values in the combination, such as "-Q mpmc -n 2".
+void describe_combination(int combination, char* text, size_t size) {
+    size_t used = 0;
+    text[0] = '\0';
+    for (int i = 0; i < SWEEP_OPTION_COUNT; i++) {
+        const char* value = sweep_value(combination, i);
+        if (value != NULL && used < size) {
+            used += (size_t)snprintf(text + used, size - used, "%s-%c %s",
+                                     used > 0 ? " " : "", SWEEP_OPTIONS[i], value);
+        }
+    }
+    if (used == 0) {
+        snprintf(text, size, "as given");
+    }
+}
+
+void print_sweep_header(FILE* stream) {
+    if (ResultsOutput == CsvResults) {
+        fprintf(stream, "model,producers,consumers,capacity,backend,philosophers,strategy,lock,runs,"
+                        "median_ops_per_sec,mean_ops_per_sec,stddev_ops_per_sec,min_ops_per_sec,max_ops_per_sec,"
+                        "p50_latency_ns,p99_latency_ns,user_cpu_s,system_cpu_s\n");
+    }
+}
+
+// One line per combination: the throughput of each run (operations per second,
+// whatever the model's operations are), latency percentiles over all the runs'
+// samples together, and the CPU time per run. Returns the median throughput.
+double print_sweep_line(FILE* stream, double* rates, int runs, const struct Histogram* latency,
+                      double user_s, double system_s) {
+    double sum = 0;
+    for (int i = 0; i < runs; i++) {
+        sum += rates[i];
+    }
+    double mean = sum / runs;
+
+    double squares = 0;
+    for (int i = 0; i < runs; i++) {
+        squares += (rates[i] - mean) * (rates[i] - mean);
+    }
+    double stddev = runs > 1 ? sqrt(squares / (runs - 1)) : 0.0;
+
+    qsort(rates, runs, sizeof(double), compare_doubles);
+    double median = runs % 2 == 1 ? rates[runs / 2] : (rates[runs / 2 - 1] + rates[runs / 2]) / 2;
+
+    if (ResultsOutput == CsvResults) {
+        fprintf(stream, "%s,%d,%d,%zu,%s,%d,%s,%s,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%llu,%llu,%.3f,%.3f\n",
+                sweep_model_name(), ProducerCount, ConsumerCount, RequestedCapacity, BackendNames[Backend],
+                PhilosopherCount, ForkStrategyNames[ForkAcquisition], LockKindNames[Locking], runs,
+                median, mean, stddev, rates[0], rates[runs - 1],
+                (unsigned long long)histogram_percentile(latency, 0.50),
+                (unsigned long long)histogram_percentile(latency, 0.99),
+                user_s / runs, system_s / runs);
+    } else {
+        fprintf(stream,
+                "{\"model\": \"%s\", \"producers\": %d, \"consumers\": %d, \"capacity\": %zu, "
+                "\"backend\": \"%s\", \"philosophers\": %d, \"strategy\": \"%s\", \"lock\": \"%s\", \"runs\": %d, "
+                "\"median_ops_per_sec\": %.0f, \"mean_ops_per_sec\": %.0f, \"stddev_ops_per_sec\": %.0f, "
+                "\"min_ops_per_sec\": %.0f, \"max_ops_per_sec\": %.0f, "
+                "\"p50_latency_ns\": %llu, \"p99_latency_ns\": %llu, "
+                "\"user_cpu_s\": %.3f, \"system_cpu_s\": %.3f}\n",
+                sweep_model_name(), ProducerCount, ConsumerCount, RequestedCapacity, BackendNames[Backend],
+                PhilosopherCount, ForkStrategyNames[ForkAcquisition], LockKindNames[Locking], runs,
+                median, mean, stddev, rates[0], rates[runs - 1],
+                (unsigned long long)histogram_percentile(latency, 0.50),
+                (unsigned long long)histogram_percentile(latency, 0.99),
+                user_s / runs, system_s / runs);
+    }
+    fflush(stream);
+
+    return median;
+}
+
+void run_sweep() {
+    FILE* stream = stdout;
+    if (ResultsPath != NULL) {
+        stream = fopen(ResultsPath, "w");
+        if (stream == NULL) {
+            printf("Unable to open %s for the results: %s.\n", ResultsPath, strerror(errno));
+            return;
+        }
+    }
+
+    int combinations = sweep_combination_count();
+    fprintf(stderr, "Sweeping %s over %d combination%s, %d warm-up and %d measured runs each, "
+                    "%.3f seconds per run. Random seed %llu.\n",
+            ModelNames[ProblemType], combinations, combinations > 1 ? "s" : "", SweepWarmups, SweepRepeats,
+            BenchDurationSecs, (unsigned long long)RandomSeed);
+    print_sweep_header(stream);
+
+    enum Model model = ProblemType;
+    double* rates = (double*)malloc(sizeof(double) * SweepRepeats);
+    struct SweepRun* run = (struct SweepRun*)malloc(sizeof(struct SweepRun));
+    struct Histogram* latency = (struct Histogram*)malloc(sizeof(struct Histogram));
+    int run_number = 0;
+
+    for (int c = 0; c < combinations && !TerminationRequested; c++) {
+        ProblemType = model;
+        set_sweep_combination(c);
+
+        char description[256];
+        describe_combination(c, description, sizeof(description));
+
+        memset(latency, 0, sizeof(struct Histogram));
+        double user_s = 0;
+        double system_s = 0;
+        int measured = 0;
+        int status = 0;
+        for (int i = 0; i < SweepWarmups + SweepRepeats && !TerminationRequested; i++) {
+            status = sweep_run(run_number++, run);
+            if (status != 0) {
+                break;
+            }
+            if (i < SweepWarmups) {
+                continue;
+            }
+
+            rates[measured++] = items_per_sec(run->result.operations, run->result.elapsed_ns);
+            histogram_merge(latency, &run->result.latency);
+            user_s += run->user_s;
+            system_s += run->system_s;
+        }
+
+        if (status == SWEEP_INVALID_COMBINATION) {
+            fprintf(stderr, "[%d/%d] %s: skipped, not a valid combination.\n", c + 1, combinations, description);
+        } else if (status != 0) {
+            fprintf(stderr, "[%d/%d] %s: a run failed, skipped.\n", c + 1, combinations, description);
+        } else if (measured == SweepRepeats) {
+            double median = print_sweep_line(stream, rates, measured, latency, user_s, system_s);
+            fprintf(stderr, "[%d/%d] %s: median %.0f ops/sec\n", c + 1, combinations, description, median);
+        }
+    }
+
+    if (TerminationRequested) {
+        fprintf(stderr, "Sweep interrupted; the combination at hand was left out.\n");
+    }
+
+    free(latency);
+    free(run);
+    free(rates);
+    if (stream != stdout) {
+        fclose(stream);
+    }
+}
+
 //========================================================
 // Help messages and such.
 //========================================================
@@ -648,11 +8193,82 @@ void print_help(char *exe_name) {
     printf("%s <Mode>\n", exe_name);
     printf("Mode is one of: \n");
     printf("  -d: Dining Philosopher's solution \n");
-    printf("  -b: Potion BrewerInfo's solution\n");
+    printf("      Optional arguments for Dining Philosopher's solution:\n");
+    printf("      -N: Number of philosophers at the table (default 5)\n");
+    printf("      -S: Fork strategy, one of leftie (default), waiter, chandy or trylock\n");
+    printf("      -L: What the forks are: native (semaphores, the default), ticket locks or MCS\n");
+    printf("          locks (mcs); not for chandy, whose forks are hygienic ones\n");
+    printf("      --think, --eat: Fixed thinking and eating periods in milliseconds, 0 for none\n");
+    printf("                      (the default in benchmark mode)\n");
+    printf("  -b: Potion Brewers' solution\n");
+    printf("      Optional arguments for Potion Brewers' solution:\n");
+    printf("      -K: Number of ingredients, and so of brewers and agents (default 3)\n");
+    printf("      --matcher: How sets of ingredients are matched to brewers: broker threads\n");
+    printf("                 (the default) or a bitmask updated by the agents\n");
+    printf("      -R: Benchmark until this many potions have been brewed, instead of for --duration\n");
     printf("  -p: Producer/Consumer solution\n");
     printf("      Required arguments for Producer/Consumer solution:\n");
     printf("      -n: Number of producers to instantiate\n");
-    printf("      -c: Number of consumes to instantiate\n\n");
+    printf("      -c: Number of consumes to instantiate\n");
+    printf("      Optional arguments for Producer/Consumer solution:\n");
+    printf("      -Q: Queue backend, one of mutex (default), spsc or mpmc\n");
+    printf("      -L: The mutex queue's lock: native (a pthread mutex, the default), ticket or mcs\n");
+    printf("      -B: Number of values moved per queue operation (default 1)\n");
+    printf("      -q: Queue capacity, rounded up to a power of two (default 100, i.e. 128)\n");
+    printf("      --payload: Bytes of payload per item, written and read in place (default 0)\n");
+    printf("      --shards: One queue per producer; consumers drain their own shards first and\n");
+    printf("                steal from the others when those are empty\n");
+    printf("      --items: In benchmark mode, stop after this many items instead of after --duration\n");
+    printf("      --lanes: Priority lanes, each a queue of its own, given each one's share of the\n");
+    printf("               items, most urgent first, such as 1:9 (default a single lane)\n");
+    printf("      --lane-policy: How consumers pick a lane: strict (the most urgent one with\n");
+    printf("                     items, the default) or wrr (weighted round-robin)\n");
+    printf("      --lane-weights: With wrr, the batches each lane gets per turn, such as 4:1\n");
+    printf("                      (default 1 each)\n");
+    printf("      --drain: On termination, consume what is left in the queues before exiting\n");
+    printf("      --shm: Put the queue in this POSIX shared memory object, such as /queue, so that\n");
+    printf("             separate processes can produce into it and consume from it\n");
+    printf("      --role: With --shm, what this process runs: producers (-n only), consumers\n");
+    printf("              (-c only), or both (the default), forking a process for each side and\n");
+    printf("              removing the object at the end; otherwise it stays for the next run\n");
+    printf("  -P: Producer/Consumer pipeline, given the threads of each stage, such as 4:8:2. Takes\n");
+    printf("      the same optional arguments, except for --shards and --lanes, plus:\n");
+    printf("      --work: Rounds of synthetic work per item, for all stages or for each, such as\n");
+    printf("              0:500:100 (default 0)\n");
+    printf("  Queue telemetry, for -p and -P:\n");
+    printf("      --telemetry: Sample the queues' depth, blocked threads and wakeups: none (the\n");
+    printf("                   default), summary (histograms at the end), or csv or json to also\n");
+    printf("                   stream every sample as a line\n");
+    printf("      --sample-ms: Sampling period in milliseconds (default 10)\n");
+    printf("      --telemetry-file: Where to stream the samples (default standard output)\n\n");
+    printf("Benchmark options:\n");
+    printf("  --bench: Run without artificial sleeps or per-action output and report throughput\n");
+    printf("           and latency at the end\n");
+    printf("  --duration: Length of a benchmark run in seconds (default 5)\n");
+    printf("  --counters: Count each worker thread's cycles, instructions, last-level cache misses\n");
+    printf("              and context switches, and report them per item, meal or potion\n");
+    printf("  --sweep: Run every combination of the values given to -Q, -q, -n, -c, -S, -N and -L as\n");
+    printf("           comma-separated lists (such as -n 1,2,4 -Q mutex,mpmc), several times each,\n");
+    printf("           and write a line of results per combination\n");
+    printf("  --repeat, --warmup: Measured and warm-up runs per combination (default 5 and 1)\n");
+    printf("  --results: Format of the sweep results, csv (the default) or json\n");
+    printf("  --results-file: Where to write the sweep results (default standard output)\n\n");
+    printf("Other options:\n");
+    printf("  -v: Event logging, one of none (0), sampled (1) or full (2). Defaults to full,\n");
+    printf("      or to none in benchmark mode\n");
+    printf("  --affinity: Pin each thread to a CPU: compact, scatter, or a CPU list such as 0,2,4-7\n");
+    printf("  --wait: What a thread does while it cannot proceed: spin, yield, block, or\n");
+    printf("          adaptive (spin, then yield, then block; the default)\n");
+    printf("  --timers: How threads sleep outside benchmarks: wheel (a shared timer thread\n");
+    printf("            wakes them, tick by tick; the default) or sleep (each in nanosleep)\n");
+    printf("  --executor: threads (one thread per actor, the default), pool (actors run as\n");
+    printf("              tasks on a work-stealing pool of workers) or fibers (-d only: each\n");
+    printf("              philosopher is a fiber, so that tables can seat up to a million)\n");
+    printf("  --workers: Number of pool workers or fiber scheduler threads (default one per CPU)\n");
+    printf("  --instances: Run this many independent copies of -p or -d side by side, each with\n");
+    printf("               queues or forks of its own (default 1)\n");
+    printf("  --seed: Seed for the random sleep and backoff periods, so that a run can be\n");
+    printf("          repeated (by default, a new one each run, printed at the start)\n\n");
     printf("If multiple modes are specified, the last one in the command line overrides the others.\n");
 }
 
@@ -678,25 +8294,41 @@ int main(int argc, char **argv) {
 
     parse_command_line(argc, argv);
 
-    srandom(time(0));
-
-    switch (ProblemType) {
-        case ProdCon:
-            run_prodcon();
-            break;
+    // Without --seed, every run is different, but the seed is printed so that an
+    // interesting one can be repeated.
+    if (!RandomSeedGiven) {
+        RandomSeed = mix_seed(now_ns() ^ ((uint64_t)getpid() << 32));
+    }
+    if (ProblemType != None && !SweepMode) {
+        printf("Random seed %llu.\n", (unsigned long long)RandomSeed);
+    }
+    random_seed_thread(MainStream, 0);
+    affinity_init();
 
-        case Diners:
-            run_diners();
-            break;
+    if (ProblemType == None) {
+        printf("No valid mode chosen or the parameters are incorrect.\n\n");
+        print_help(argv[0]);
+        return -1;
+    }
 
-        case Brewers:
-            run_brewers();
-            break;
+    // The sweep forks a child per run, so it must not have started any thread.
+    if (SweepMode) {
+        run_sweep();
+        return 0;
+    }
 
-        default:
-            printf("No valid mode chosen or the parameters are incorrect.\n\n");
-            print_help(argv[0]);
+    // So does --role both, for the producer and consumer processes; only they return.
+    if (SharedQueueName != NULL && SharedQueueRole == BothRoles) {
+        int status = run_shared_roles();
+        if (status >= 0) {
+            return status;
+        }
     }
 
-    return ProblemType == None ? -1 : 0;
+    event_log_start();
+    run_model();
+    event_log_stop();
+    lock_profile_report();
+
+    return 0;
 }